@@ -8,8 +8,11 @@
  */
 #include "bin.h"
 
-const bin_t bin_t::NONE(static_cast<bin_t::uint_t>(0xffffffffffffffffULL));
-const bin_t bin_t::ALL(static_cast<bin_t::uint_t>(0xffffffffffffffffULL) >> 1);
+template <typename uint_type>
+const basic_bin_t<uint_type> basic_bin_t<uint_type>::NONE(static_cast<uint_type>(0xffffffffffffffffULL));
+
+template <typename uint_type>
+const basic_bin_t<uint_type> basic_bin_t<uint_type>::ALL(static_cast<uint_type>(0xffffffffffffffffULL) >> 1);
 
 
 /* A set of bit operations */
@@ -17,7 +20,8 @@ const bin_t bin_t::ALL(static_cast<bin_t::uint_t>(0xffffffffffffffffULL) >> 1);
 /**
  * Gets the layer value of a bin
  */
-int bin_t::layer() const {
+template <typename uint_type>
+int basic_bin_t<uint_type>::layer() const {
     if( is_none() )
         return -1;
 
@@ -44,7 +48,8 @@ int bin_t::layer() const {
 /**
  * Gets the offset value of a bin
  */
-bin_t::uint_t bin_t::layer_offset() const {
+template <typename uint_type>
+typename basic_bin_t<uint_type>::uint_t basic_bin_t<uint_type>::layer_offset() const {
     return m_v >> (layer() + 1);
 }
 
@@ -54,22 +59,25 @@ bin_t::uint_t bin_t::layer_offset() const {
 /**
  * Constructor
  */
-bin_t::bin_t(int layer, uint_t offset) : m_v( (offset << (layer + 1)) | ((1ULL << layer) - 1) ) {
+template <typename uint_type>
+basic_bin_t<uint_type>::basic_bin_t(int layer, uint_t offset) : m_v( ((offset << layer) << 1) | ((1ULL << layer) - 1) ) {
 }
 
 
 /**
  * Gets the sibling bin
  */
-bin_t bin_t::sibling() const {
-    return bin_t(m_v ^ (layer_bits() + 1));
+template <typename uint_type>
+basic_bin_t<uint_type> basic_bin_t<uint_type>::sibling() const {
+    return basic_bin_t(m_v ^ (layer_bits() + 1));
 }
 
 
 /**
  * Gets a begining of the bin interval
  */
-bin_t::uint_t bin_t::base_offset() const {
+template <typename uint_type>
+typename basic_bin_t<uint_type>::uint_t basic_bin_t<uint_type>::base_offset() const {
     return (m_v & (m_v + 1)) >> 1;
 }
 
@@ -77,7 +85,8 @@ bin_t::uint_t bin_t::base_offset() const {
 /**
  * Gets the length of the bin interval
  */
-bin_t::uint_t bin_t::base_length() const {
+template <typename uint_type>
+typename basic_bin_t<uint_type>::uint_t basic_bin_t<uint_type>::base_length() const {
     return (layer_bits() >> 1) + 1;
 }
 
@@ -93,7 +102,8 @@ bin_t::uint_t bin_t::base_length() const {
 /**
  * Gets the left or the right bin, depending whether the destination is
  */
-bin_t bin_t::towards(bin_t dest) const {
+template <typename uint_type>
+basic_bin_t<uint_type> basic_bin_t<uint_type>::towards(basic_bin_t dest) const {
     if (*this == dest || !contains(dest))
         return NONE;
     if (dest < *this)
@@ -105,11 +115,12 @@ bin_t bin_t::towards(bin_t dest) const {
 /**
  * Gets the leftmost base sub-bin
  */
-bin_t bin_t::base_left() const {
+template <typename uint_type>
+basic_bin_t<uint_type> basic_bin_t<uint_type>::base_left() const {
     if (is_none())
         return NONE;
 
-    return bin_t(m_v & (m_v + 1));
+    return basic_bin_t(m_v & (m_v + 1));
 }
 
 
@@ -129,23 +140,30 @@ bin_t bin_t::base_left() const {
 //}
 
 
-///**
-// * The array must have 64 cells, as it is the max number of peaks possible + 1 (and there are no reasons to assume there will be less in any given case).
-// */
-//int bin_t::peaks(bint_t length, bin_t * peaks) {
-//    int pp = 0;
-//    for(int layer = 0; length > 0; length >>= 1, layer++) {
-//        if (length & 1)
-//            peaks[++pp] = bin_t(layer, length - 1);
-//    }
-//
-//    for(int i = (pp >> 1) - 1; i >= 0; --i) {
-//        bint_t memo = peaks[pp - 1 - i];
-//        peaks[pp - 1 - i] = peaks[i];
-//        peaks[i] = memo;
-//    }
-//
-//    peaks[pp] = NONE;
-//
-//    return pp;
-//}
+/**
+ * Splits the interval [0, length) into peaks.
+ * The array must have 64 cells, as it is the max number of peaks possible + 1 (and there are no reasons to assume there will be less in any given case).
+ */
+template <typename uint_type>
+int basic_bin_t<uint_type>::peaks(uint_t length, basic_bin_t * peaks) {
+    int pp = 0;
+    for(int layer = 0; length > 0; length >>= 1, ++layer) {
+        if( length & 1 )
+            peaks[pp++] = basic_bin_t(layer, length ^ 1);
+    }
+
+    for(int i = (pp >> 1) - 1; i >= 0; --i) {
+        const basic_bin_t memo = peaks[pp - 1 - i];
+        peaks[pp - 1 - i] = peaks[i];
+        peaks[i] = memo;
+    }
+
+    peaks[pp] = NONE;
+
+    return pp;
+}
+
+
+/* Explicit instantiations */
+template class basic_bin_t<uint32_t>;
+template class basic_bin_t<uint64_t>;
@@ -1,6 +1,12 @@
 #ifndef BIN64_H
 #define BIN64_H
 
+#ifndef _MSC_VER
+#  include <stdint.h>
+#else
+typedef unsigned __int32 uint32_t;
+typedef unsigned __int64 uint64_t;
+#endif
 
 /**
  * Numbering for (aligned) logarithmical bins.
@@ -40,40 +46,49 @@
  *
  * Once we have peak hashes, this struture is more natural than bin-v1
  *
+ * The numbering is parametrized by the basic integer type: bin_t covers
+ * 2^31 base bins, bin64_t covers 2^63 base bins.
+ *
  */
 
-class bin_t {
+template <typename uint_type>
+class basic_bin_t {
 public:
     /**
      * Basic integer type
      */
-    typedef unsigned int uint_t;
+    typedef uint_type uint_t;
 
 
     /**
      * Constants
      */
-    static const bin_t NONE;
-    static const bin_t ALL;
+    static const basic_bin_t NONE;
+    static const basic_bin_t ALL;
 
 
     /**
+     * Splits the interval [0, length) into peaks, left to right.
      * The array must have 64 cells, as it is the max number
      * of peaks possible + 1 (and there are no reasons to
-     * assume there will be less in any given case).  */
-//    static int peaks(bint_t length, bin_t * peaks);
+     * assume there will be less in any given case).
+     * The list is terminated with NONE.
+     *
+     * @return the number of peaks
+     */
+    static int peaks(uint_t length, basic_bin_t * peaks);
 
 
     /**
      * Constructor
      */
-    bin_t();
+    basic_bin_t();
 
 
     /**
      * Constructor
      */
-    explicit bin_t(uint_t val);
+    explicit basic_bin_t(uint_t val);
 
 
     /**
@@ -85,25 +100,25 @@ public:
     /**
      * Operator equal
      */
-    bool operator == (const bin_t & bin) const;
+    bool operator == (const basic_bin_t & bin) const;
 
 
     /**
      * Operator non-equal
      */
-    bool operator != (const bin_t & bin) const;
+    bool operator != (const basic_bin_t & bin) const;
 
 
     /**
      * Operator less than
      */
-    bool operator < (const bin_t & bin) const;
+    bool operator < (const basic_bin_t & bin) const;
 
 
     /**
      * Operator greater than
      */
-    bool operator > (const bin_t & bin) const;
+    bool operator > (const basic_bin_t & bin) const;
 
 
     /**
@@ -169,73 +184,73 @@ public:
     /**
      * Gets the sibling bin
      */
-    bin_t sibling() const;
+    basic_bin_t sibling() const;
 
 
     /**
      * Sets this object to the parent
      */
-    bin_t & to_parent();
+    basic_bin_t & to_parent();
 
 
     /**
      * Sets this object to the left child
      */
-    bin_t & to_left();
+    basic_bin_t & to_left();
 
 
     /**
      * Sets this object to the right child
      */
-    bin_t & to_right();
+    basic_bin_t & to_right();
 
 
     /**
      * Gets the parent bin
      */
-    bin_t parent() const;
+    basic_bin_t parent() const;
 
 
     /**
      * Gets the left child
      */
-    bin_t left() const;
+    basic_bin_t left() const;
 
 
     /**
      * Gets the right child
      */
-    bin_t right() const;
+    basic_bin_t right() const;
 
 
     /**
      * Gets the leftmost base sub-bin
      */
-    bin_t base_left() const;
+    basic_bin_t base_left() const;
 
 
 //    /**
 //     * Performs a permutation
 //     */
-//    bin_t twisted(bint_t mask) const;
+//    basic_bin_t twisted(bint_t mask) const;
 
 
     /**
      * Checks for contains
      */
-    bool contains(bin_t bin) const;
+    bool contains(basic_bin_t bin) const;
 
 
     /**
      * Gets the left or the right bin, depending whether the destination is
      */
-    bin_t towards(bin_t dest) const;
+    basic_bin_t towards(basic_bin_t dest) const;
 
 
 //    /**
 //     * Depth-first in-order binary tree traversal.
 //     */
-//    bin_t next_dfsio(uint8_t floor);
+//    basic_bin_t next_dfsio(uint8_t floor);
 
 
 private:
@@ -243,7 +258,7 @@ private:
     /**
      * Constructor
      */
-    bin_t(int layer, uint_t offset);
+    basic_bin_t(int layer, uint_t offset);
 
     uint_t m_v;
 };
@@ -253,21 +268,24 @@ private:
 /**
  * Constructor
  */
-inline bin_t::bin_t() {
+template <typename uint_type>
+inline basic_bin_t<uint_type>::basic_bin_t() {
 }
 
 
 /**
  * Constructor
  */
-inline bin_t::bin_t(uint_t val) : m_v(val) {
+template <typename uint_type>
+inline basic_bin_t<uint_type>::basic_bin_t(uint_t val) : m_v(val) {
 }
 
 
 /**
  * Gets the layer bits
  */
-inline bin_t::uint_t bin_t::layer_bits() const {
+template <typename uint_type>
+inline typename basic_bin_t<uint_type>::uint_t basic_bin_t<uint_type>::layer_bits() const {
     return m_v ^ (m_v + 1);
 }
 
@@ -275,7 +293,8 @@ inline bin_t::uint_t bin_t::layer_bits() const {
 /**
  * Gets the bin value
  */
-inline bin_t::uint_t bin_t::toUInt() const {
+template <typename uint_type>
+inline typename basic_bin_t<uint_type>::uint_t basic_bin_t<uint_type>::toUInt() const {
     return m_v;
 }
 
@@ -283,7 +302,8 @@ inline bin_t::uint_t bin_t::toUInt() const {
 /**
  * Operator equal
  */
-inline bool bin_t::operator == (const bin_t & bin) const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::operator == (const basic_bin_t & bin) const {
     return m_v == bin.m_v;
 }
 
@@ -291,7 +311,8 @@ inline bool bin_t::operator == (const bin_t & bin) const {
 /**
  * Operator non-equal
  */
-inline bool bin_t::operator != (const bin_t & bin) const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::operator != (const basic_bin_t & bin) const {
     return m_v != bin.m_v;
 }
 
@@ -299,7 +320,8 @@ inline bool bin_t::operator != (const bin_t & bin) const {
 /**
  * Operator less
  */
-inline bool bin_t::operator < (const bin_t & bin) const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::operator < (const basic_bin_t & bin) const {
     return m_v < bin.m_v;
 }
 
@@ -307,7 +329,8 @@ inline bool bin_t::operator < (const bin_t & bin) const {
 /**
  * Operator great
  */
-inline bool bin_t::operator > (const bin_t & bin) const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::operator > (const basic_bin_t & bin) const {
     return m_v > bin.m_v;
 }
 
@@ -315,7 +338,8 @@ inline bool bin_t::operator > (const bin_t & bin) const {
 /**
  * Sets this object to the parent
  */
-inline bin_t & bin_t::to_parent() {
+template <typename uint_type>
+inline basic_bin_t<uint_type> & basic_bin_t<uint_type>::to_parent() {
     const uint_t lbs = layer_bits();
     const uint_t nlbs = -2 - lbs;
 
@@ -328,7 +352,8 @@ inline bin_t & bin_t::to_parent() {
 /**
  * Sets this object to the left child
  */
-inline bin_t & bin_t::to_left() {
+template <typename uint_type>
+inline basic_bin_t<uint_type> & basic_bin_t<uint_type>::to_left() {
     register uint_t t;
 
     t = m_v + 1;
@@ -347,7 +372,8 @@ inline bin_t & bin_t::to_left() {
 /**
 * Sets this object to the right child
 */
-inline bin_t & bin_t::to_right() {
+template <typename uint_type>
+inline basic_bin_t<uint_type> & basic_bin_t<uint_type>::to_right() {
     register uint_t t;
 
     t = m_v + 1;
@@ -366,18 +392,20 @@ inline bin_t & bin_t::to_right() {
 /**
  * Gets the parent bin
  */
-inline bin_t bin_t::parent() const {
+template <typename uint_type>
+inline basic_bin_t<uint_type> basic_bin_t<uint_type>::parent() const {
     const uint_t lbs = layer_bits();
     const uint_t nlbs = -2 - lbs;
 
-    return bin_t((m_v | lbs) & nlbs);
+    return basic_bin_t((m_v | lbs) & nlbs);
 }
 
 
 /**
  * Gets the left child
  */
-inline bin_t bin_t::left() const {
+template <typename uint_type>
+inline basic_bin_t<uint_type> basic_bin_t<uint_type>::left() const {
     register uint_t t;
 
     t = m_v + 1;
@@ -387,14 +415,15 @@ inline bin_t bin_t::left() const {
 //    if (t == 0)
 //        return NONE;
 
-    return bin_t(m_v ^ t);
+    return basic_bin_t(m_v ^ t);
 }
 
 
 /**
  * Gets the right child
  */
-inline bin_t bin_t::right() const {
+template <typename uint_type>
+inline basic_bin_t<uint_type> basic_bin_t<uint_type>::right() const {
     register uint_t t;
 
     t = m_v + 1;
@@ -404,14 +433,15 @@ inline bin_t bin_t::right() const {
 //    if (t == 0)
 //        return NONE;
 
-    return bin_t(m_v + t);
+    return basic_bin_t(m_v + t);
 }
 
 
 /**
  * Does the bin is none
  */
-inline bool bin_t::is_none() const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::is_none() const {
     return *this == NONE;
 }
 
@@ -419,7 +449,8 @@ inline bool bin_t::is_none() const {
 /**
  * Does the bin is all
  */
-inline bool bin_t::is_all() const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::is_all() const {
     return *this == ALL;
 }
 
@@ -427,7 +458,8 @@ inline bool bin_t::is_all() const {
 /**
  * Checks is bin is base (layer == 0)
  */
-inline bool bin_t::is_base() const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::is_base() const {
     return !(m_v & 1);
 }
 
@@ -435,7 +467,8 @@ inline bool bin_t::is_base() const {
 /**
  * Checks is bin is a left child
  */
-inline bool bin_t::is_left() const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::is_left() const {
     return !(m_v & (layer_bits() + 1));
 }
 
@@ -443,7 +476,8 @@ inline bool bin_t::is_left() const {
 /**
  * Checks wheither is bin is a left child
  */
-inline bool bin_t::is_right() const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::is_right() const {
     return !is_left();
 }
 
@@ -451,7 +485,8 @@ inline bool bin_t::is_right() const {
 /**
  * Checks for contains
  */
-inline bool bin_t::contains(bin_t bin) const {
+template <typename uint_type>
+inline bool basic_bin_t<uint_type>::contains(basic_bin_t bin) const {
     if (is_none())
         return false;
 
@@ -461,4 +496,15 @@ inline bool bin_t::contains(bin_t bin) const {
     return (my_bits >= bin_bits) && ((m_v | my_bits) == (bin.m_v | my_bits));
 }
 
+
+/**
+ * 32-bit bins
+ */
+typedef basic_bin_t<uint32_t> bin_t;
+
+/**
+ * 64-bit bins
+ */
+typedef basic_bin_t<uint64_t> bin64_t;
+
 #endif
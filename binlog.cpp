@@ -0,0 +1,570 @@
+/*
+ *  binlog.cpp
+ *  binmap
+ *
+ *  Write-ahead log of binmaps.
+ *
+ */
+
+/* 64-bit file offsets on 32-bit POSIX systems */
+#if !defined(_WIN32) && !defined(_FILE_OFFSET_BITS)
+#  define _FILE_OFFSET_BITS 64
+#endif
+
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#  include <io.h>
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+#include "binlog.h"
+
+
+/* Constants */
+static const size_t BATCH_CAPACITY = 64 * 1024;
+static const size_t MAX_RECORD_SIZE = 11; /* the operation and the bin or the offset */
+static const size_t FRAME_SIZE = 8; /* the size and the checksum of a batch */
+
+/* Header of the log files: signature, version and the size of the bins */
+static const unsigned char LOG_SIGNATURE[4] = { 'B', 'M', 'L', 1 };
+static const size_t LOG_HEADER_SIZE = 5;
+
+/* Operations */
+enum {
+    OP_RESET,
+    OP_SET,
+    OP_DROP
+};
+
+
+/**
+ * Get the CRC-32 of the data
+ */
+static uint32_t crc32(const unsigned char * p, size_t size) {
+    uint32_t crc = 0xffffffffU;
+
+    while( size-- > 0 ) {
+        crc ^= *p++;
+        for(int i = 0; i < 8; ++i)
+            crc = (crc >> 1) ^ (0xedb88320U & (0U - (crc & 1)));
+    }
+
+    return ~crc;
+}
+
+
+/**
+ * Load and store 32-bit little-endian numbers
+ */
+static uint32_t load_le32(const unsigned char * p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static void store_le32(uint32_t value, unsigned char * p) {
+    for(int i = 0; i < 4; ++i)
+        p[i] = static_cast<unsigned char>(value >> (8 * i));
+}
+
+
+/**
+ * Flush the file to the disk
+ */
+static bool flush_file(FILE * file) {
+    if( fflush(file) != 0 )
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+
+/**
+ * Set the position of the file, beyond 2 GB too
+ */
+static bool seek_file(FILE * file, size_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, static_cast<__int64>(offset), SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+
+/**
+ * Truncate the file, its position must be set by seek_file before
+ */
+static bool truncate_file(FILE * file, size_t size) {
+    if( fflush(file) != 0 )
+        return false;
+#ifdef _WIN32
+    return _chsize_s(_fileno(file), size) == 0;
+#else
+    return ftruncate(fileno(file), static_cast<off_t>(size)) == 0;
+#endif
+}
+
+
+/**
+ * Replace the file atomically and durably
+ *
+ * On POSIX the directory is flushed after the rename, or else a crash
+ * could bring the old file back.
+ */
+static bool replace_file(const char * from, const char * to) {
+#ifdef _WIN32
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+    if( rename(from, to) != 0 )
+        return false;
+
+    /* The directory of the file */
+    const char * const slash = strrchr(to, '/');
+    const size_t length = (slash == NULL) ? 0 : (slash == to) ? 1 : static_cast<size_t>(slash - to);
+
+    char * const dir_path = static_cast<char *>(malloc(length + 2));
+    if( dir_path == NULL )
+        return false;
+
+    if( slash == NULL ) {
+        strcpy(dir_path, ".");
+    } else {
+        memcpy(dir_path, to, length);
+        dir_path[length] = '\0';
+    }
+
+    const int fd = open(dir_path, O_RDONLY);
+    free(dir_path);
+
+    if( fd < 0 )
+        return false;
+
+    const bool ok = fsync(fd) == 0;
+    close(fd);
+
+    return ok;
+#endif
+}
+
+
+/* Methods */
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binlog_t<traits>::basic_binlog_t(binmap_type & binmap) : m_binmap(&binmap) {
+    m_checkpoint_path = NULL;
+    m_log = NULL;
+    m_log_size = 0;
+    m_batch = static_cast<unsigned char *>(malloc(BATCH_CAPACITY));
+    m_batch_size = 0;
+    m_is_dirty = false;
+    m_is_lost = false;
+}
+
+
+/**
+ * Destructor
+ */
+template <class traits>
+basic_binlog_t<traits>::~basic_binlog_t() {
+    if( m_log ) {
+        commit();
+        fclose(m_log);
+    }
+
+    free(m_batch);
+    free(m_checkpoint_path);
+}
+
+
+/**
+ * Read the checkpoint file to the binmap
+ */
+template <class traits>
+bool basic_binlog_t<traits>::read_checkpoint() {
+    typename binmap_type::decoder_t decoder(*m_binmap);
+
+    FILE * const file = fopen(m_checkpoint_path, "rb");
+    if( file == NULL )
+        return errno == ENOENT /* No checkpoint yet */;
+
+    bool ok = true;
+    size_t size;
+
+    while( ok && (size = fread(m_batch, 1, BATCH_CAPACITY, file)) > 0 )
+        ok = decoder.decode(m_batch, size);
+
+    ok = ok && !ferror(file) && decoder.is_done();
+
+    fclose(file);
+
+    return ok;
+}
+
+
+/**
+ * Apply the changes of a batch
+ */
+template <class traits>
+bool basic_binlog_t<traits>::replay_batch(const unsigned char * p, const unsigned char * end) {
+    while( p != end ) {
+        const unsigned char op = *p++;
+
+        uint_t value = 0;
+        for(int shift = 0; ; shift += 7) {
+            if( p == end || shift >= 8 * static_cast<int>(sizeof(value)) )
+                return false;
+
+            value |= static_cast<uint_t>(*p & 0x7f) << shift;
+            if( !(*p++ & 0x80) )
+                break;
+        }
+
+        if( op == OP_SET )
+            m_binmap->set(bin_t(value));
+        else if( op == OP_RESET )
+            m_binmap->reset(bin_t(value));
+        else if( op == OP_DROP )
+            m_binmap->drop_before(value);
+        else
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Apply the committed batches of the log file
+ *
+ * @return the end of the last whole batch, 0 if there is no header,
+ *         -1 if the file is not a log of the binmap
+ */
+template <class traits>
+size_t basic_binlog_t<traits>::replay_log() {
+    unsigned char header[LOG_HEADER_SIZE];
+
+    if( fread(header, 1, LOG_HEADER_SIZE, m_log) != LOG_HEADER_SIZE )
+        return 0;
+
+    if( memcmp(header, LOG_SIGNATURE, sizeof(LOG_SIGNATURE)) != 0 || header[4] != sizeof(typename bin_t::uint_t) )
+        return static_cast<size_t>(-1);
+
+    size_t end = LOG_HEADER_SIZE;
+
+    for( ;; ) {
+        unsigned char frame[FRAME_SIZE];
+        if( fread(frame, 1, FRAME_SIZE, m_log) != FRAME_SIZE )
+            break;
+
+        const size_t size = load_le32(frame);
+        if( size == 0 || size > BATCH_CAPACITY )
+            break;
+
+        if( fread(m_batch, 1, size, m_log) != size || crc32(m_batch, size) != load_le32(frame + 4) )
+            break;
+
+        if( !replay_batch(m_batch, m_batch + size) )
+            break;
+
+        end += FRAME_SIZE + size;
+    }
+
+    return end;
+}
+
+
+/**
+ * Recover the binmap from the checkpoint and the log files
+ */
+template <class traits>
+bool basic_binlog_t<traits>::open(const char * checkpoint_path, const char * log_path) {
+    if( m_log != NULL ) {
+        fprintf(stderr, "Warning: binlog_t::open: LOG IS ALREADY OPEN\n");
+        return false /* LOG IS ALREADY OPEN */;
+    }
+
+    free(m_checkpoint_path);
+    m_checkpoint_path = static_cast<char *>(malloc(strlen(checkpoint_path) + 1));
+
+    if( m_batch == NULL || m_checkpoint_path == NULL ) {
+        fprintf(stderr, "Warning: binlog_t::open: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    strcpy(m_checkpoint_path, checkpoint_path);
+
+    if( !read_checkpoint() ) {
+        fprintf(stderr, "Warning: binlog_t::open: CHECKPOINT ERROR\n");
+        return false /* CHECKPOINT ERROR */;
+    }
+
+    m_log = fopen(log_path, "r+b");
+    if( m_log == NULL && errno == ENOENT )
+        m_log = fopen(log_path, "w+b");
+
+    if( m_log == NULL ) {
+        fprintf(stderr, "Warning: binlog_t::open: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    size_t end = replay_log();
+
+    if( end == static_cast<size_t>(-1) ) {
+        fclose(m_log);
+        m_log = NULL;
+        fprintf(stderr, "Warning: binlog_t::open: FORMAT ERROR\n");
+        return false /* FORMAT ERROR */;
+    }
+
+    /* Cut the torn tail, or start a new log */
+    bool ok = seek_file(m_log, 0) && truncate_file(m_log, end);
+
+    if( ok && end == 0 ) {
+        unsigned char header[LOG_HEADER_SIZE];
+        memcpy(header, LOG_SIGNATURE, sizeof(LOG_SIGNATURE));
+        header[4] = sizeof(typename bin_t::uint_t);
+
+        ok = fwrite(header, 1, LOG_HEADER_SIZE, m_log) == LOG_HEADER_SIZE;
+        end = LOG_HEADER_SIZE;
+    }
+
+    ok = ok && fseek(m_log, 0, SEEK_END) == 0 && flush_file(m_log);
+
+    if( !ok ) {
+        fclose(m_log);
+        m_log = NULL;
+        fprintf(stderr, "Warning: binlog_t::open: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    m_log_size = end;
+    m_is_dirty = false;
+
+    return true;
+}
+
+
+/**
+ * Append a change to the batch
+ */
+template <class traits>
+void basic_binlog_t<traits>::append(unsigned char op, uint_t value) {
+    if( m_log == NULL || m_is_lost )
+        return;
+
+    /* The change stays in the binmap, the next checkpoint saves it */
+    if( m_batch_size + MAX_RECORD_SIZE > BATCH_CAPACITY && !write_batch() ) {
+        m_is_lost = true;
+        return;
+    }
+
+    unsigned char * p = m_batch + m_batch_size;
+    *p++ = op;
+
+    for( ; value >= 0x80; value >>= 7)
+        *p++ = static_cast<unsigned char>(value | 0x80);
+    *p++ = static_cast<unsigned char>(value);
+
+    m_batch_size = p - m_batch;
+}
+
+
+/**
+ * Set bins and log it
+ */
+template <class traits>
+void basic_binlog_t<traits>::set(bin_t bin) {
+    m_binmap->set(bin);
+    append(OP_SET, bin.toUInt());
+}
+
+
+/**
+ * Reset bins and log it
+ */
+template <class traits>
+void basic_binlog_t<traits>::reset(bin_t bin) {
+    m_binmap->reset(bin);
+    append(OP_RESET, bin.toUInt());
+}
+
+
+/**
+ * Drop the base bins before the offset and log it, the replay shifts
+ * the offsets of the changes after it the same way
+ */
+template <class traits>
+typename basic_binlog_t<traits>::uint_t basic_binlog_t<traits>::drop_before(uint_t offset) {
+    const uint_t shift = m_binmap->drop_before(offset);
+    append(OP_DROP, offset);
+    return shift;
+}
+
+
+/**
+ * Write the batch to the log file
+ *
+ * The batch is framed by its size and checksum, so a torn write is
+ * detected on recovery. On error the torn frame is cut and the batch
+ * is kept for the next write.
+ */
+template <class traits>
+bool basic_binlog_t<traits>::write_batch() {
+    if( m_batch_size == 0 )
+        return true;
+
+    unsigned char frame[FRAME_SIZE];
+    store_le32(static_cast<uint32_t>(m_batch_size), frame);
+    store_le32(crc32(m_batch, m_batch_size), frame + 4);
+
+    const bool ok = fwrite(frame, 1, FRAME_SIZE, m_log) == FRAME_SIZE
+        && fwrite(m_batch, 1, m_batch_size, m_log) == m_batch_size
+        && fflush(m_log) == 0;
+
+    if( !ok ) {
+        /* Go back to the end of the last whole batch */
+        clearerr(m_log);
+        if( !seek_file(m_log, m_log_size) || !truncate_file(m_log, m_log_size) )
+            fprintf(stderr, "Warning: binlog_t::write_batch: TRUNCATE ERROR\n");
+
+        fprintf(stderr, "Warning: binlog_t::write_batch: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    m_log_size += FRAME_SIZE + m_batch_size;
+    m_batch_size = 0;
+    m_is_dirty = true;
+
+    return true;
+}
+
+
+/**
+ * Write the logged changes to the disk
+ */
+template <class traits>
+bool basic_binlog_t<traits>::commit() {
+    if( m_log == NULL )
+        return false;
+
+    if( m_is_lost ) {
+        fprintf(stderr, "Warning: binlog_t::commit: CHANGES ARE NOT LOGGED, CHECKPOINT IS NEEDED\n");
+        return false /* CHANGES ARE NOT LOGGED */;
+    }
+
+    if( !write_batch() )
+        return false;
+
+    if( m_is_dirty ) {
+        if( !flush_file(m_log) ) {
+            fprintf(stderr, "Warning: binlog_t::commit: FILE ERROR\n");
+            return false /* FILE ERROR */;
+        }
+
+        m_is_dirty = false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Write the binmap to the checkpoint file and empty the log
+ *
+ * The checkpoint is written to a temporary file that replaces the old
+ * one and its directory is flushed before the log is emptied.
+ * Replaying the log again over the new checkpoint gives the same bins
+ * (the last change of every bin wins), so a crash before the log is
+ * emptied loses nothing.
+ *
+ * The changes not logged after a write error are saved too.
+ */
+template <class traits>
+bool basic_binlog_t<traits>::checkpoint() {
+    if( m_log == NULL || (!m_is_lost && !commit()) )
+        return false;
+
+    char * const temp_path = static_cast<char *>(malloc(strlen(m_checkpoint_path) + 5));
+    if( temp_path == NULL ) {
+        fprintf(stderr, "Warning: binlog_t::checkpoint: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    strcpy(temp_path, m_checkpoint_path);
+    strcat(temp_path, ".tmp");
+
+    FILE * const file = fopen(temp_path, "wb");
+    bool ok = (file != NULL);
+
+    if( ok ) {
+        typename binmap_type::encoder_t encoder(*m_binmap);
+
+        size_t size;
+        while( ok && (size = encoder.encode(m_batch, BATCH_CAPACITY)) > 0 )
+            ok = fwrite(m_batch, 1, size, file) == size;
+
+        ok = ok && flush_file(file);
+        ok = (fclose(file) == 0) && ok;
+        ok = ok && replace_file(temp_path, m_checkpoint_path);
+
+        if( !ok )
+            remove(temp_path);
+    }
+
+    free(temp_path);
+
+    if( !ok ) {
+        fprintf(stderr, "Warning: binlog_t::checkpoint: CHECKPOINT ERROR\n");
+        return false /* CHECKPOINT ERROR */;
+    }
+
+    /* Empty the log */
+    if( !truncate_file(m_log, LOG_HEADER_SIZE) || fseek(m_log, 0, SEEK_END) != 0 || !flush_file(m_log) ) {
+        fprintf(stderr, "Warning: binlog_t::checkpoint: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    m_log_size = LOG_HEADER_SIZE;
+
+    /* The batch not written is in the checkpoint */
+    m_batch_size = 0;
+    m_is_lost = false;
+
+    return true;
+}
+
+
+/**
+ * Get the size of the log file, including the changes not committed
+ */
+template <class traits>
+size_t basic_binlog_t<traits>::log_size() const {
+    return m_log_size + (m_batch_size ? FRAME_SIZE + m_batch_size : 0);
+}
+
+
+/* Explicit instantiations */
+template class basic_binlog_t< binmap_traits<bin_t, bitmap32_t> >;
+template class basic_binlog_t< binmap_traits<bin_t, bitmap64_t> >;
+template class basic_binlog_t< binmap_traits<bin_t, bitmap128_t> >;
+template class basic_binlog_t< binmap_traits<bin_t, bitmap256_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap32_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap64_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap128_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap256_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap32_t, uint64_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap64_t, uint64_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap128_t, uint64_t> >;
+template class basic_binlog_t< binmap_traits<bin64_t, bitmap256_t, uint64_t> >;
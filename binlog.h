@@ -0,0 +1,189 @@
+#ifndef BINLOG_H
+#define BINLOG_H
+
+#include <cstddef>
+#include <cstdio>
+#include "binmap.h"
+
+
+/**
+ * Write-ahead log of a binmap
+ *
+ * The changes made through the log are applied to the binmap and
+ * appended to a memory buffer; commit() writes the buffer to the log
+ * file as one checksummed batch and flushes it to the disk, so many
+ * changes share one disk flush. checkpoint() writes the whole binmap
+ * (see basic_binmap_t::encoder_t) and empties the log. open() recovers
+ * the binmap from the last checkpoint and the committed batches.
+ *
+ * The changes made to the binmap directly are not logged, the drops of
+ * the window included: later changes would be replayed at the wrong
+ * offsets.
+ */
+template <class traits>
+class basic_binlog_t {
+public:
+
+    /**
+     * Type of the binmap
+     */
+    typedef basic_binmap_t<traits> binmap_type;
+
+    /**
+     * Type of bin
+     */
+    typedef typename binmap_type::bin_t bin_t;
+
+    /**
+     * Type of the offsets
+     */
+    typedef typename binmap_type::uint_t uint_t;
+
+
+    /**
+     * Constructor
+     */
+    explicit basic_binlog_t(binmap_type & binmap);
+
+
+    /**
+     * Destructor, commits the changes
+     */
+    ~basic_binlog_t();
+
+
+    /**
+     * Recover the binmap from the checkpoint and the log files, missing
+     * files stand for an empty binmap. The torn tail of the log is cut.
+     *
+     * @return false on error
+     */
+    bool open(const char * checkpoint_path, const char * log_path);
+
+
+    /**
+     * Set bins and log it
+     */
+    void set(bin_t bin);
+
+
+    /**
+     * Reset bins and log it
+     */
+    void reset(bin_t bin);
+
+
+    /**
+     * Drop the base bins before the offset and log it
+     *
+     * @return the number of base bins the offsets are shifted down by
+     */
+    uint_t drop_before(uint_t offset);
+
+
+    /**
+     * Write the logged changes to the disk
+     *
+     * @return false on error; after a change could not be logged it
+     *         fails until checkpoint() succeeds
+     */
+    bool commit();
+
+
+    /**
+     * Write the binmap to the checkpoint file and empty the log
+     *
+     * @return false on error, the log stays valid then
+     */
+    bool checkpoint();
+
+
+    /**
+     * Get the size of the log file, including the changes not committed
+     */
+    size_t log_size() const;
+
+
+private:
+
+    /**
+     * Append a change to the batch, the bin or the offset
+     */
+    void append(unsigned char op, uint_t value);
+
+
+    /**
+     * Write the batch to the log file
+     */
+    bool write_batch();
+
+
+    /**
+     * Read the checkpoint file to the binmap
+     */
+    bool read_checkpoint();
+
+
+    /**
+     * Apply the committed batches of the log file, and get the end of them
+     */
+    size_t replay_log();
+
+
+    /**
+     * Apply the changes of a batch
+     */
+    bool replay_batch(const unsigned char * p, const unsigned char * end);
+
+
+    /**
+     * The binmap
+     */
+    binmap_type * m_binmap;
+
+    /**
+     * Path of the checkpoint file
+     */
+    char * m_checkpoint_path;
+
+    /**
+     * The log file and its size
+     */
+    FILE * m_log;
+    size_t m_log_size;
+
+    /**
+     * Changes not written to the log file
+     */
+    unsigned char * m_batch;
+    size_t m_batch_size;
+
+    /**
+     * Whether the log file has changes not flushed to the disk
+     */
+    bool m_is_dirty;
+
+    /**
+     * Whether a change was not logged after a write error
+     */
+    bool m_is_lost;
+
+
+    /**
+     * Copy constructor
+     */
+    basic_binlog_t(const basic_binlog_t &); /* undefined */
+};
+
+
+/**
+ * Log of a binmap over 32-bit bins
+ */
+typedef basic_binlog_t< binmap_traits<bin_t> > binlog_t;
+
+/**
+ * Log of a binmap over 64-bit bins
+ */
+typedef basic_binlog_t< binmap_traits<bin64_t> > binlog64_t;
+
+#endif // BINLOG_H
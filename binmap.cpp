@@ -4,727 +4,4199 @@
 #include <cstring>
 #include <cstdio>
 
+#ifdef _WIN32
+#  include <windows.h>
+#else
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
 #include "binmap.h"
 
 /* Constants */
-const bitmap_t BITMAP_EMPTY  = static_cast<bitmap_t>(0);
-const bitmap_t BITMAP_FILLED = static_cast<bitmap_t>(-1);
-
 static const size_t ROOT_REF = 0;
-
-static const bin_t::uint_t BITMAP_LAYER_BITS = 2 * 8 * sizeof(bitmap_t) - 1;
-
-static const bitmap_t BITMAP[] = {
-    static_cast<bitmap_t>(0x00000001), static_cast<bitmap_t>(0x00000003),
-    static_cast<bitmap_t>(0x00000002), static_cast<bitmap_t>(0x0000000f),
-    static_cast<bitmap_t>(0x00000004), static_cast<bitmap_t>(0x0000000c),
-    static_cast<bitmap_t>(0x00000008), static_cast<bitmap_t>(0x000000ff),
-    static_cast<bitmap_t>(0x00000010), static_cast<bitmap_t>(0x00000030),
-    static_cast<bitmap_t>(0x00000020), static_cast<bitmap_t>(0x000000f0),
-    static_cast<bitmap_t>(0x00000040), static_cast<bitmap_t>(0x000000c0),
-    static_cast<bitmap_t>(0x00000080), static_cast<bitmap_t>(0x0000ffff),
-    static_cast<bitmap_t>(0x00000100), static_cast<bitmap_t>(0x00000300),
-    static_cast<bitmap_t>(0x00000200), static_cast<bitmap_t>(0x00000f00),
-    static_cast<bitmap_t>(0x00000400), static_cast<bitmap_t>(0x00000c00),
-    static_cast<bitmap_t>(0x00000800), static_cast<bitmap_t>(0x0000ff00),
-    static_cast<bitmap_t>(0x00001000), static_cast<bitmap_t>(0x00003000),
-    static_cast<bitmap_t>(0x00002000), static_cast<bitmap_t>(0x0000f000),
-    static_cast<bitmap_t>(0x00004000), static_cast<bitmap_t>(0x0000c000),
-    static_cast<bitmap_t>(0x00008000), static_cast<bitmap_t>(0xffffffff),
-    static_cast<bitmap_t>(0x00010000), static_cast<bitmap_t>(0x00030000),
-    static_cast<bitmap_t>(0x00020000), static_cast<bitmap_t>(0x000f0000),
-    static_cast<bitmap_t>(0x00040000), static_cast<bitmap_t>(0x000c0000),
-    static_cast<bitmap_t>(0x00080000), static_cast<bitmap_t>(0x00ff0000),
-    static_cast<bitmap_t>(0x00100000), static_cast<bitmap_t>(0x00300000),
-    static_cast<bitmap_t>(0x00200000), static_cast<bitmap_t>(0x00f00000),
-    static_cast<bitmap_t>(0x00400000), static_cast<bitmap_t>(0x00c00000),
-    static_cast<bitmap_t>(0x00800000), static_cast<bitmap_t>(0xffff0000),
-    static_cast<bitmap_t>(0x01000000), static_cast<bitmap_t>(0x03000000),
-    static_cast<bitmap_t>(0x02000000), static_cast<bitmap_t>(0x0f000000),
-    static_cast<bitmap_t>(0x04000000), static_cast<bitmap_t>(0x0c000000),
-    static_cast<bitmap_t>(0x08000000), static_cast<bitmap_t>(0xff000000),
-    static_cast<bitmap_t>(0x10000000), static_cast<bitmap_t>(0x30000000),
-    static_cast<bitmap_t>(0x20000000), static_cast<bitmap_t>(0xf0000000),
-    static_cast<bitmap_t>(0x40000000), static_cast<bitmap_t>(0xc0000000),
-    static_cast<bitmap_t>(0x80000000), /* special */ static_cast<bitmap_t>(0xffffffff) /* special */
+static const int MAX_THREADS = 64;
+
+/* Stream format */
+static const unsigned char STREAM_SIGNATURE[2] = { 'B', 'M' };
+static const unsigned char STREAM_VERSION = 1;
+static const size_t STREAM_HEADER_SIZE = 5; /* and the root bin */
+static const size_t MAX_VARINT_SIZE = 10;
+
+/* Types of the halves in the stream */
+enum {
+    STREAM_EMPTY,
+    STREAM_FILLED,
+    STREAM_BITMAP,
+    STREAM_REF
 };
 
+/* Flag byte of a cell of two references, followed by the size of the left subtree */
+static const unsigned char STREAM_REFS = (STREAM_REF << 2) | STREAM_REF;
+
 
 /**
- * Get the leftmost bin that coresponded to bitmap (the bin is filled in bitmap)
+ * Get the size of a variable-length number (7 bits per byte, low bits first)
  */
-static inline bin_t::uint_t bitmap_to_bin(register bitmap_t b) {
-    static const unsigned char BITMAP_TO_BIN[] = {
-        -1, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        12, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        14, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        13, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
-        11, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 7
-    };
+static size_t varint_size(size_t value) {
+    size_t size = 1;
+    for( ; value >= 0x80; value >>= 7)
+        ++size;
+    return size;
+}
 
-    assert( sizeof(bitmap_t) <= 4 );
-    assert( b != BITMAP_EMPTY );
 
-    unsigned char t;
+/**
+ * Put a variable-length number
+ */
+static unsigned char * put_varint(unsigned char * p, size_t value) {
+    for( ; value >= 0x80; value >>= 7)
+        *p++ = static_cast<unsigned char>(value | 0x80);
+    *p++ = static_cast<unsigned char>(value);
+    return p;
+}
 
-    t = BITMAP_TO_BIN[ b & 0xff ];
-    if( t < 16 ) {
-        if( t != 7 )
-            return static_cast<bin_t::uint_t>(t);
 
-        b += 1;
-        b &= -b;
-        if( !b )
-            return BITMAP_LAYER_BITS / 2;
-        if( b >= 0x10000 )
-            return 15;
-        return 7;
+/**
+ * Get a variable-length number of the buffer [p, end)
+ *
+ * @return the end of the number, NULL if it is broken
+ */
+static const unsigned char * get_varint(const unsigned char * p, const unsigned char * end, size_t & value) {
+    value = 0;
+    for(size_t shift = 0; p != end && shift < 7 * MAX_VARINT_SIZE; shift += 7) {
+        value |= static_cast<size_t>(*p & 0x7f) << shift;
+        if( !(*p++ & 0x80) )
+            return p;
     }
+    return NULL;
+}
 
-    b >>= 8;
-    t = BITMAP_TO_BIN[ b & 0xff ];
-    if( t <= 15 )
-            return 16 + t;
-
-    /* Recursion */
-    // return 32 + bitmap_to_bin( b >> 16 );
-
-    assert( sizeof(bitmap_t) == 4 );
 
-    b >>= 8;
-    t = BITMAP_TO_BIN[ b & 0xff ];
-    if( t < 16 ) {
-        if( t != 7 )
-            return 32 + static_cast<bin_t::uint_t>(t);
+/**
+ * Job of a thread
+ */
+typedef struct {
+    void (* m_run)(void * arg);
+    void * m_arg;
+} thread_job_t;
 
-        b += 1;
-        b &= -b;
-        if( b >= 0x10000 )
-            return 47;
-        return 39;
-    }
 
-    return 48 + BITMAP_TO_BIN[ b >> 8 ];
+/**
+ * Entry point of the threads
+ */
+#ifdef _WIN32
+static DWORD WINAPI thread_entry(LPVOID arg) {
+    const thread_job_t * const job = static_cast<const thread_job_t *>(arg);
+    job->m_run(job->m_arg);
+    return 0;
+}
+#else
+static void * thread_entry(void * arg) {
+    const thread_job_t * const job = static_cast<const thread_job_t *>(arg);
+    job->m_run(job->m_arg);
+    return NULL;
 }
+#endif
 
 
 /**
- * Trace the bin basing on bitmap
+ * Run the jobs in parallel threads, the first one in the calling thread.
+ * The jobs whose threads fail to start run in the calling thread too.
  */
-bin_t binmap_t::trace_bin_on_bitmap(const bin_t & bin, bitmap_t bitmap) const {
-    if( bitmap == BITMAP_FILLED ) {
-        if( m_root_bin.is_all() )
-            return bin_t::NONE;
-        return m_root_bin.sibling();
+static void run_jobs(thread_job_t * jobs, int count) {
+    assert( count <= MAX_THREADS );
+
+#ifdef _WIN32
+    HANDLE thread[MAX_THREADS];
+    for(int i = 1; i < count; ++i)
+        thread[i] = CreateThread(NULL, 0, thread_entry, &jobs[i], 0, NULL);
+#else
+    pthread_t thread[MAX_THREADS];
+    bool is_started[MAX_THREADS];
+    for(int i = 1; i < count; ++i)
+        is_started[i] = (pthread_create(&thread[i], NULL, thread_entry, &jobs[i]) == 0);
+#endif
+
+    thread_entry(&jobs[0]);
+
+    for(int i = 1; i < count; ++i) {
+#ifdef _WIN32
+        if( thread[i] != NULL ) {
+            WaitForSingleObject(thread[i], INFINITE);
+            CloseHandle(thread[i]);
+        } else
+            thread_entry(&jobs[i]);
+#else
+        if( is_started[i] )
+            pthread_join(thread[i], NULL);
+        else
+            thread_entry(&jobs[i]);
+#endif
     }
+}
 
-    if( bitmap == BITMAP_EMPTY )
-        return bin;
 
-    return bin_t(bin.base_left().toUInt() + bitmap_to_bin(~bitmap));
-}
+/**
+ * Memory-mapped file
+ */
+struct binmap_file_t {
+#ifdef _WIN32
+    HANDLE m_file;
+    HANDLE m_mapping;
+#else
+    int m_fd;
+#endif
+    void * m_data;
+    size_t m_size;
+};
 
 
-/* Methods */
+/**
+ * Header of the binmap files, the cells follow it at FILE_HEADER_SIZE
+ * and the flags of the blocks follow the cells
+ */
+typedef struct {
+    char m_signature[4];
+    uint32_t m_byte_order;
+    uint32_t m_cell_size;
+    uint32_t m_bin_size;
+    uint64_t m_root_bin;
+    uint64_t m_free_top;
+    uint64_t m_blocks_number;
+    uint64_t m_cells_number;
+    uint32_t m_ref_size;
+} file_header_t;
+
+static const char FILE_SIGNATURE[4] = { 'B', 'M', 'F', 4 };
+static const uint32_t FILE_BYTE_ORDER = 0x01020304;
+static const size_t FILE_HEADER_SIZE = 64;
 
 
 /**
- * Constructor
+ * Map the file to the memory with the new size
+ *
+ * The new mapping is made before the old one is released, so the old
+ * one stays valid on error. A shrunk file keeps its size on Windows.
  */
-binmap_t::binmap_t() : m_root_bin(63) {
-    assert( sizeof(bitmap_t) <= 4 );
+static bool resize_mapped_file(binmap_file_t * file, size_t size) {
+#ifdef _WIN32
+    const DWORD size_high = static_cast<DWORD>(static_cast<uint64_t>(size) >> 32);
+    const DWORD size_low = static_cast<DWORD>(size);
 
-    m_cell = NULL;
-    m_blocks_number = 0;
-    m_cells_number = 0;
-    m_free_top = ROOT_REF;
+    HANDLE const mapping = CreateFileMapping(file->m_file, NULL, PAGE_READWRITE, size_high, size_low, NULL);
+    if( mapping == NULL )
+        return false;
+
+    void * const data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+    if( data == NULL ) {
+        CloseHandle(mapping);
+        return false;
+    }
+
+    if( file->m_data != NULL )
+        UnmapViewOfFile(file->m_data);
+    if( file->m_mapping != NULL )
+        CloseHandle(file->m_mapping);
+
+    file->m_mapping = mapping;
+#else
+    if( size > file->m_size && ftruncate(file->m_fd, static_cast<off_t>(size)) != 0 )
+        return false;
+
+    void * const data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file->m_fd, 0);
+    if( data == MAP_FAILED )
+        return false;
 
-    const ref_t ROOT_REF = alloc_cell();
+    if( file->m_data != NULL )
+        munmap(file->m_data, file->m_size);
 
-    assert( ROOT_REF == 0 && m_blocks_number > 0 );
+    if( size < file->m_size && ftruncate(file->m_fd, static_cast<off_t>(size)) != 0 )
+        fprintf(stderr, "Warning: binmap_t: FILE TRUNCATE ERROR\n");
+#endif
+
+    file->m_data = data;
+    file->m_size = size;
+
+    return true;
 }
 
 
 /**
- * Destructor
+ * Close the memory-mapped file
  */
-binmap_t::~binmap_t() {
-    if( m_cell )
-        free(m_cell);
+static void close_mapped_file(binmap_file_t * file) {
+#ifdef _WIN32
+    if( file->m_data != NULL )
+        UnmapViewOfFile(file->m_data);
+    if( file->m_mapping != NULL )
+        CloseHandle(file->m_mapping);
+    CloseHandle(file->m_file);
+#else
+    if( file->m_data != NULL )
+        munmap(file->m_data, file->m_size);
+    close(file->m_fd);
+#endif
+
+    free(file);
 }
 
 
 /**
- * Allocates one cell
+ * Open the file and map it to the memory
+ *
+ * @return NULL on error
  */
-ref_t binmap_t::alloc_cell() {
-    if( m_free_top == ROOT_REF ) {
-        /* Check for reference capacity */
-        if( static_cast<ref_t>(16 * m_blocks_number) < 16 * m_blocks_number ) {
-            fprintf(stderr, "Warning: binmap_t::alloc_cell: REFERENCE LIMIT ERROR\n");
-            return ROOT_REF /* REFERENCE LIMIT ERROR */;
-        }
+static binmap_file_t * open_mapped_file(const char * path) {
+    binmap_file_t * const file = static_cast<binmap_file_t *>(malloc(sizeof(binmap_file_t)));
+    if( file == NULL )
+        return NULL /* MEMORY ERROR */;
+
+    file->m_data = NULL;
+    file->m_size = 0;
+
+    size_t size;
+
+#ifdef _WIN32
+    file->m_mapping = NULL;
+    file->m_file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if( file->m_file == INVALID_HANDLE_VALUE ) {
+        free(file);
+        return NULL /* FILE ERROR */;
+    }
 
-        /* Extend the buffer */
-        const size_t old_size = m_blocks_number;
-        const size_t new_size = (old_size ? 2 * old_size : 1);
+    LARGE_INTEGER file_size;
+    if( !GetFileSizeEx(file->m_file, &file_size) ) {
+        close_mapped_file(file);
+        return NULL /* FILE ERROR */;
+    }
 
-        const size_t size1 = 16 * new_size * sizeof(m_cell[0]);
+    size = static_cast<size_t>(file_size.QuadPart);
+#else
+    file->m_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if( file->m_fd < 0 ) {
+        free(file);
+        return NULL /* FILE ERROR */;
+    }
 
-        /* Check for integer overflow */
-        if( size1 == 0 ) {
-            fprintf(stderr, "Warning: binmap_t::alloc_cell: INTEGER OVERFLOW\n");
-            return ROOT_REF /* INTEGER OVERFLOW */;
-        }
+    struct stat st;
+    if( fstat(file->m_fd, &st) != 0 ) {
+        close_mapped_file(file);
+        return NULL /* FILE ERROR */;
+    }
 
-        /* Reallocate memory */
-        cell_t * const cell = static_cast<cell_t *>(realloc(m_cell, size1));
-        if( cell == NULL ) {
-            fprintf(stderr, "Warning: binmap_t::alloc_cell: MEMORY ERROR\n");
-            return ROOT_REF /* MEMORY ERROR */;
-        }
+    size = static_cast<size_t>(st.st_size);
+#endif
 
-        m_cell = cell;
-        m_blocks_number = new_size;
+    if( size > 0 && !resize_mapped_file(file, size) ) {
+        close_mapped_file(file);
+        return NULL /* MAP ERROR */;
+    }
 
-        /* Insert new cells to the free cell list */
-        const size_t stop_idx = 16 * old_size - 1;
-        size_t idx = 16 * new_size - 1;
+    return file;
+}
 
-        m_cell[ idx ].m_is_free = true;
-        m_cell[ idx ].m_free_next = m_free_top;
 
-        for(--idx; idx != stop_idx; --idx) {
-            m_cell[ idx ].m_is_free = true;
-            m_cell[ idx ].m_free_next = static_cast<ref_t>(idx + 1);
-        }
+/**
+ * Write the mapped memory to the disk
+ */
+static bool sync_mapped_file(binmap_file_t * file) {
+#ifdef _WIN32
+    return FlushViewOfFile(file->m_data, 0) && FlushFileBuffers(file->m_file);
+#else
+    return msync(file->m_data, file->m_size, MS_SYNC) == 0;
+#endif
+}
 
-        m_free_top = static_cast<ref_t>(16 * old_size);
-    }
 
-    /* Pop an element from the free cell list */
-    const ref_t ref = m_free_top;
-    assert( m_cell[ref].m_is_free );
+/**
+ * Address range reserved for the buffers of a binmap, the pages are
+ * committed as the buffers grow, so the cells are never moved
+ *
+ * The cells, the flags and the counts take the parts of the range at
+ * the offsets, up to the maximum number of blocks. The counts enabled
+ * after the reservation stay on the heap.
+ */
+struct binmap_region_t {
+    char * m_data;
+    size_t m_size;
+    size_t m_max_blocks;
+    size_t m_flags_offset;
+    size_t m_count_offset;
+    size_t m_cell_size;
+    size_t m_flags_size;
+    size_t m_count_size;
+    bool m_has_counts;
+    bool m_is_huge_pages;
+};
 
-    m_free_top = m_cell[ ref ].m_free_next;
 
-    /* Clean it */
-    memset(&m_cell[ref], 0, sizeof(m_cell[ref]));
+/* Number of blocks a reserved range grows by at most */
+static const size_t REGION_STEP_BLOCKS = 4096;
 
-    ++m_cells_number;
 
-    return ref;
+/**
+ * Get the size of the memory pages
+ */
+static size_t page_size() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwPageSize;
+#else
+    return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
 }
 
 
 /**
- * Releases the cell
+ * Round the size up to the memory pages
  */
-void binmap_t::free_cell(ref_t ref) {
-    assert( ref > 0 );
-    assert( !m_cell[ref].m_is_free );
-
-    if( m_cell[ref].m_is_left_ref )
-        free_cell(m_cell[ref].m_left.m_ref);
-    if( m_cell[ref].m_is_right_ref )
-        free_cell(m_cell[ref].m_right.m_ref);
+static size_t round_to_pages(size_t size) {
+    const size_t page = page_size();
+    return (size + page - 1) / page * page;
+}
 
-    m_cell[ref].m_is_free = true;
-    m_cell[ref].m_free_next = m_free_top;
-    m_free_top = ref;
 
-    --m_cells_number;
+/**
+ * Reserve an address range of inaccessible pages
+ *
+ * @return NULL on error
+ */
+static void * reserve_pages(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#  ifdef MAP_NORESERVE
+    flags |= MAP_NORESERVE;
+#  endif
+
+    void * const data = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+    return (data == MAP_FAILED) ? NULL : data;
+#endif
 }
 
 
 /**
- * Extend root
+ * Commit the pages of the reserved range [data, data + size) and
+ * release the pages above it, the committed size is updated
  */
-void binmap_t::extend_root() {
-    assert( m_root_bin != bin_t::ALL );
+static bool commit_pages(char * data, size_t & committed, size_t size) {
+    size = round_to_pages(size);
+
+    if( size > committed ) {
+#ifdef _WIN32
+        if( VirtualAlloc(data + committed, size - committed, MEM_COMMIT, PAGE_READWRITE) == NULL )
+            return false;
+#else
+        if( mprotect(data + committed, size - committed, PROT_READ | PROT_WRITE) != 0 )
+            return false;
+#endif
+    } else if( size < committed ) {
+#ifdef _WIN32
+        VirtualFree(data + size, committed - size, MEM_DECOMMIT);
+#else
+        madvise(data + size, committed - size, MADV_DONTNEED);
+        mprotect(data + size, committed - size, PROT_NONE);
+#endif
+    }
 
-    if( m_cell[ROOT_REF].m_left.m_bitmap == m_cell[ROOT_REF].m_right.m_bitmap ) {
-        /* Setup the root cell */
-        m_cell[ROOT_REF].m_right.m_bitmap = BITMAP_EMPTY;
+    committed = size;
 
-    } else {
-        /* Allocate new cell */
-        const ref_t ref = alloc_cell();
-        if( ref == ROOT_REF )
-            return /* ALLOC ERROR */;
+    return true;
+}
 
-        /* Move old root to the cell */
-        m_cell[ref] = m_cell[ROOT_REF];
 
-        /* Setup new root */
-        m_cell[ROOT_REF].m_is_left_ref = true;
-        m_cell[ROOT_REF].m_is_right_ref = false;
+/**
+ * Release the reserved or the mapped range
+ */
+static void release_pages(void * data, size_t size) {
+#ifdef _WIN32
+    (void)size;
+    VirtualFree(data, 0, MEM_RELEASE);
+#else
+    munmap(data, size);
+#endif
+}
 
-        m_cell[ROOT_REF].m_left.m_ref = ref;
-        m_cell[ROOT_REF].m_right.m_bitmap = BITMAP_EMPTY;
+
+/* Size of the huge pages the buffers are rounded to */
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+
+/**
+ * Map a range of the size on the huge pages, the explicit ones if the
+ * size is a multiple of them and there are some left, or else on the
+ * pages advised to be merged to the transparent ones
+ *
+ * @return NULL on error
+ */
+static void * map_huge_pages(size_t size) {
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void * data = MAP_FAILED;
+
+#  ifdef MAP_HUGETLB
+    if( size % HUGE_PAGE_SIZE == 0 )
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#  endif
+
+    if( data == MAP_FAILED ) {
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if( data == MAP_FAILED )
+            return NULL;
+
+#  ifdef MADV_HUGEPAGE
+        madvise(data, size, MADV_HUGEPAGE);
+#  endif
     }
 
-    /* Reset bin */
-    m_root_bin = m_root_bin.parent();
+    return data;
+#endif
 }
 
 
 /**
- * Unpack the left half of a cell
+ * Smallest buffer of the arena
  */
-ref_t binmap_t::unpack_left_half(ref_t ref) {
-    assert( !m_cell[ref].m_is_left_ref );
-
-    const ref_t left_ref = alloc_cell();
-    if( left_ref == ROOT_REF )
-        return ROOT_REF /* ALLOC ERROR */;
+static const size_t MIN_BUFFER_SIZE = 16;
 
-    m_cell[left_ref].m_left.m_bitmap = m_cell[ref].m_left.m_bitmap;
-    m_cell[left_ref].m_right.m_bitmap = m_cell[ref].m_left.m_bitmap;
+/**
+ * Offset of the buffers in the slabs, after the link to the next slab
+ */
+static const size_t SLAB_HEADER_SIZE = 16;
 
-    m_cell[ref].m_is_left_ref = true;
-    m_cell[ref].m_left.m_ref = left_ref;
 
-    return left_ref;
+/**
+ * Constructor
+ */
+binmap_arena_t::binmap_arena_t(size_t slab_size, bool is_huge_pages) {
+    /* The slabs take whole huge pages */
+    if( is_huge_pages )
+        slab_size = (SLAB_HEADER_SIZE + slab_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE - SLAB_HEADER_SIZE;
+
+    m_slab_size = slab_size;
+    m_is_huge_pages = is_huge_pages;
+    m_slab = NULL;
+    m_slabs_number = 0;
+    m_slab_free = NULL;
+    m_slab_free_size = 0;
+
+    for(size_t i = 0; i < SIZES_NUMBER; ++i)
+        m_free[i] = NULL;
 }
 
 
 /**
- * Unpack the right half of a cell
+ * Destructor
  */
-ref_t binmap_t::unpack_right_half(ref_t ref) {
-    assert( !m_cell[ref].m_is_right_ref );
+binmap_arena_t::~binmap_arena_t() {
+    while( m_slab != NULL ) {
+        void * const next = *static_cast<void **>(m_slab);
+        if( m_is_huge_pages )
+            release_pages(m_slab, SLAB_HEADER_SIZE + m_slab_size);
+        else
+            free(m_slab);
+        m_slab = next;
+    }
+}
 
-    const ref_t right_ref = alloc_cell();
-    if( right_ref == ROOT_REF )
-        return ROOT_REF /* ALLOC ERROR */;
 
-    m_cell[right_ref].m_left.m_bitmap = m_cell[ref].m_right.m_bitmap;
-    m_cell[right_ref].m_right.m_bitmap = m_cell[ref].m_right.m_bitmap;
+/**
+ * Get the size of the buffers allocated for the size
+ */
+size_t binmap_arena_t::buffer_size(size_t size) {
+    return MIN_BUFFER_SIZE << size_index(size);
+}
 
-    m_cell[ref].m_is_right_ref = true;
-    m_cell[ref].m_right.m_ref = right_ref;
 
-    return right_ref;
+/**
+ * Get the index of the buffer size, the sizes are powers of two
+ */
+size_t binmap_arena_t::size_index(size_t size) {
+    size_t index = 0;
+    while( (MIN_BUFFER_SIZE << index) < size )
+        ++index;
+    return index;
 }
 
 
 /**
- * Pack a trace of cells
+ * Allocate a buffer of the size
  */
-void binmap_t::pack_cells(ref_t * trace_ref) {
-    ref_t ref = *trace_ref--;
-    if( ref == ROOT_REF )
-        return;
+void * binmap_arena_t::alloc_buffer(size_t size) {
+    const size_t index = size_index(size);
+    const size_t buffer_size = MIN_BUFFER_SIZE << index;
+
+    if( buffer_size > m_slab_size / 4 )
+        return m_is_huge_pages ? map_huge_pages(buffer_size) : malloc(buffer_size);
+
+    /* Released buffer */
+    if( m_free[index] != NULL ) {
+        void * const buffer = m_free[index];
+        m_free[index] = *static_cast<void **>(buffer);
+        return buffer;
+    }
 
-    assert( !m_cell[ref].m_is_left_ref && !m_cell[ref].m_is_right_ref );
+    if( m_slab_free_size < buffer_size ) {
+        void * const slab = m_is_huge_pages ? map_huge_pages(SLAB_HEADER_SIZE + m_slab_size) : malloc(SLAB_HEADER_SIZE + m_slab_size);
+        if( slab == NULL )
+            return NULL /* MEMORY ERROR */;
 
-    if( m_cell[ref].m_left.m_bitmap != m_cell[ref].m_right.m_bitmap )
-        return;
+        /* The rest of the last slab goes to the free lists */
+        while( m_slab_free_size >= MIN_BUFFER_SIZE ) {
+            size_t rest_index = size_index(m_slab_free_size);
+            if( (MIN_BUFFER_SIZE << rest_index) > m_slab_free_size )
+                --rest_index;
 
-    const bitmap_t bitmap = m_cell[ref].m_left.m_bitmap;
+            *reinterpret_cast<void **>(m_slab_free) = m_free[rest_index];
+            m_free[rest_index] = m_slab_free;
 
-    do {
-        ref = *trace_ref--;
+            m_slab_free += MIN_BUFFER_SIZE << rest_index;
+            m_slab_free_size -= MIN_BUFFER_SIZE << rest_index;
+        }
 
-        if( !m_cell[ref].m_is_left_ref ) {
-            if( m_cell[ref].m_left.m_bitmap != bitmap )
-                break;
+        *static_cast<void **>(slab) = m_slab;
+        m_slab = slab;
+        ++m_slabs_number;
 
-        } else if( !m_cell[ref].m_is_right_ref ) {
-            if( m_cell[ref].m_right.m_bitmap != bitmap )
-                break;
+        m_slab_free = static_cast<char *>(slab) + SLAB_HEADER_SIZE;
+        m_slab_free_size = m_slab_size;
+    }
 
-        } else
-            break;
+    void * const buffer = m_slab_free;
+    m_slab_free += buffer_size;
+    m_slab_free_size -= buffer_size;
 
-    } while( ref != ROOT_REF );
+    return buffer;
+}
 
-    const ref_t par_ref = trace_ref[2];
 
-    if( m_cell[ref].m_is_left_ref && m_cell[ref].m_left.m_ref == par_ref ) {
-        m_cell[ref].m_is_left_ref = false;
-        m_cell[ref].m_left.m_bitmap = bitmap;
-    } else {
-        m_cell[ref].m_is_right_ref = false;
-        m_cell[ref].m_right.m_bitmap = bitmap;
+/**
+ * Release a buffer of the size
+ */
+void binmap_arena_t::free_buffer(void * buffer, size_t size) {
+    const size_t index = size_index(size);
+
+    if( (MIN_BUFFER_SIZE << index) > m_slab_size / 4 ) {
+        if( m_is_huge_pages )
+            release_pages(buffer, MIN_BUFFER_SIZE << index);
+        else
+            free(buffer);
+        return;
     }
 
-    free_cell(par_ref);
+    *static_cast<void **>(buffer) = m_free[index];
+    m_free[index] = buffer;
 }
 
 
 /**
- * Get bins
- *
- * @param bin
- *             the bin
- * @return fill type of the bin
+ * Get the size of the slabs
  */
-bool binmap_t::get(bin_t bin) const {
-    if( !m_root_bin.contains(bin) )
-        return false;
-
-    /* Trace the bin */
-    ref_t cur_ref = ROOT_REF;
-    bin_t cur_bin = m_root_bin;
+size_t binmap_arena_t::total_size() const {
+    return m_slabs_number * (SLAB_HEADER_SIZE + m_slab_size);
+}
 
-    for( ;; ) {
-        if( bin == cur_bin )
-            break;
 
-        if( bin < cur_bin ) {
-            if( m_cell[cur_ref].m_is_left_ref ) {
-                cur_ref = m_cell[cur_ref].m_left.m_ref;
-                cur_bin.to_left();
-            } else
-                break;
-        } else {
-            if( m_cell[cur_ref].m_is_right_ref ) {
-                cur_ref = m_cell[cur_ref].m_right.m_ref;
-                cur_bin.to_right();
-            } else
-                break;
-        }
+/**
+ * Trace the bin basing on bitmap
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::trace_bin_on_bitmap(const bin_t & bin, bitmap_t bitmap) const {
+    if( bitmap == bitmap_policy::FILLED ) {
+        if( m_root_bin.is_all() )
+            return bin_t::NONE;
+        return m_root_bin.sibling();
     }
 
-    assert( cur_bin.layer_bits() > BITMAP_LAYER_BITS );
-
-    /* Proccess common case */
-    if( bin.layer_bits() > BITMAP_LAYER_BITS ) {
-        if( bin == cur_bin )
-            return m_cell[cur_ref].m_left.m_bitmap == BITMAP_FILLED && m_cell[cur_ref].m_right.m_bitmap == BITMAP_FILLED;
-        if( bin < cur_bin )
-            return m_cell[cur_ref].m_left.m_bitmap == BITMAP_FILLED;
-        return m_cell[cur_ref].m_right.m_bitmap == BITMAP_FILLED;
-    }
+    if( bitmap == bitmap_policy::EMPTY )
+        return bin;
 
-    /* Process low-layers case */
-    assert( bin != cur_bin );
+    return bin_t(bin.base_left().toUInt() + bitmap_policy::to_bin(~bitmap));
+}
 
-    const bitmap_t bm1 = BITMAP[ BITMAP_LAYER_BITS & bin.toUInt() ];
-    const bitmap_t bm2 = (bin < cur_bin) ? m_cell[cur_ref].m_left.m_bitmap : m_cell[cur_ref].m_right.m_bitmap;
 
-    return (bm1 & bm2) == bm1;
-}
+/* Methods */
 
 
 /**
- * Find first empty bin
+ * Constructor
  */
-bin_t binmap_t::find_empty() const {
-    /* Trace the bin */
-    bitmap_t bitmap = BITMAP_FILLED;
+template <class traits>
+basic_binmap_t<traits>::basic_binmap_t() : m_root_bin(bitmap_policy::LAYER_BITS) /* two bitmaps at offset 0 */ {
+
+    m_cell = &m_root_cell;
+    m_flags = &m_root_flags;
+    m_count = NULL;
+    m_file = NULL;
+    m_region = NULL;
+    m_arena = NULL;
+    m_compact_offset = 0;
+    m_is_compacting = false;
+    m_blocks_number = 0;
+    m_cells_number = 1;
+    m_free_top = ROOT_REF;
 
-    ref_t cur_ref = ROOT_REF;
-    bin_t cur_bin = m_root_bin;
+    /* The root cell is kept in the object until the tree grows */
+    memset(&m_root_cell, 0, sizeof(m_root_cell));
+    memset(&m_root_flags, 0, sizeof(m_root_flags));
+}
 
-//    if( m_cell[cur_ref].m_left.m_bitmap == BITMAP_EMPTY && m_cell[cur_ref].m_right.m_bitmap == BITMAP_EMPTY )
-//        return bin_t::ALL;
 
-    for( ;; ) {
-        if( m_cell[cur_ref].m_is_left_ref ) {
-            cur_ref = m_cell[cur_ref].m_left.m_ref;
-            cur_bin.to_left();
-        } else if( m_cell[cur_ref].m_left.m_bitmap != BITMAP_FILLED ) {
-            bitmap = m_cell[cur_ref].m_left.m_bitmap;
-            cur_bin.to_left();
-            break;
-        } else if( m_cell[cur_ref].m_is_right_ref ) {
-            cur_ref = m_cell[cur_ref].m_right.m_ref;
-            cur_bin.to_right();
-        } else {
-            bitmap = m_cell[cur_ref].m_right.m_bitmap;
-            cur_bin.to_right();
-            break;
-        }
-    }
+/**
+ * Constructor of a binmap with the cells in the arena
+ */
+template <class traits>
+basic_binmap_t<traits>::basic_binmap_t(binmap_arena_t & arena) : m_root_bin(bitmap_policy::LAYER_BITS) /* two bitmaps at offset 0 */ {
+
+    m_cell = &m_root_cell;
+    m_flags = &m_root_flags;
+    m_count = NULL;
+    m_file = NULL;
+    m_region = NULL;
+    m_arena = &arena;
+    m_compact_offset = 0;
+    m_is_compacting = false;
+    m_blocks_number = 0;
+    m_cells_number = 1;
+    m_free_top = ROOT_REF;
 
-    return trace_bin_on_bitmap(cur_bin, bitmap);
+    /* The root cell is kept in the object until the tree grows */
+    memset(&m_root_cell, 0, sizeof(m_root_cell));
+    memset(&m_root_flags, 0, sizeof(m_root_flags));
 }
 
 
 /**
- * Sets bins
+ * Copy constructor
  *
- * @param bin
- *             the bin
+ * The blocks are allocated at once and the cells are copied in
+ * pre-order, so the copy has no holes and is laid out for the walks
+ * from the root.
  */
-void binmap_t::set(bin_t bin) {
-    if( bin.is_none() )
-        return;
+template <class traits>
+basic_binmap_t<traits>::basic_binmap_t(const basic_binmap_t & source) : m_root_bin(bitmap_policy::LAYER_BITS) {
+
+    m_cell = &m_root_cell;
+    m_flags = &m_root_flags;
+    m_count = NULL;
+    m_file = NULL;
+    m_region = NULL;
+    m_arena = source.m_arena;
+    m_compact_offset = 0;
+    m_is_compacting = false;
+    m_blocks_number = 0;
+    m_cells_number = 1;
+    m_free_top = ROOT_REF;
 
-    /* Extending binmap if needed */
-    while( !m_root_bin.contains(bin) )
-        extend_root();
+    /* The root cell is kept in the object until the tree grows */
+    memset(&m_root_cell, 0, sizeof(m_root_cell));
+    memset(&m_root_flags, 0, sizeof(m_root_flags));
 
-    /* Store the trace history */
-    ref_t _trace_ref[64];
-    ref_t * trace_ref = _trace_ref;
+    /* A copy of the root alone stays in the object */
+    if( source.m_cells_number > 1 && extend_blocks((source.m_cells_number + 15) / 16) )
+        reset_free_cells();
 
-    /* Process first stage -- do not touch existed tree */
-    ref_t cur_ref = ROOT_REF;
-    bin_t cur_bin = m_root_bin;
+    if( source.m_count != NULL )
+        enable_counts();
 
-    *trace_ref++ = ROOT_REF;
-    while( cur_bin != bin ) {
-        if( bin < cur_bin ) {
-            if( m_cell[cur_ref].m_is_left_ref ) {
-                cur_ref = m_cell[cur_ref].m_left.m_ref;
-                cur_bin.to_left();
-            } else
-                break;
-        } else {
-            if( m_cell[cur_ref].m_is_right_ref ) {
-               cur_ref = m_cell[cur_ref].m_right.m_ref;
-               cur_bin.to_right();
-            } else
-                break;
-        }
+    copy_from(source);
+}
 
-        assert( trace_ref < _trace_ref + sizeof(_trace_ref) / sizeof(_trace_ref[0]) );
-        *trace_ref++ = cur_ref;
-    }
 
-    assert( cur_bin.layer_bits() > BITMAP_LAYER_BITS );
+/**
+ * Destructor
+ */
+template <class traits>
+basic_binmap_t<traits>::~basic_binmap_t() {
+    if( m_count )
+        resize_counts(0);
+    if( m_file ) {
+        write_file_header();
+        close_mapped_file(m_file);
+    } else
+        free_blocks();
+}
+
 
-    /* If the bin cell was found */
-    if( cur_bin == bin ) {  /* special */
-        if( m_cell[cur_ref].m_is_left_ref )
-            free_cell(m_cell[cur_ref].m_left.m_ref);
-        if( m_cell[cur_ref].m_is_right_ref )
-            free_cell(m_cell[cur_ref].m_right.m_ref);
+/**
+ * Resize the cell and the flag buffers to the number of blocks,
+ * on the heap or in the file
+ *
+ * The flags follow the cells in the file, so they are moved with the
+ * end of the cells. A buffer failed to shrink is kept bigger.
+ *
+ * @return false on error, the buffers stay valid then
+ */
+template <class traits>
+bool basic_binmap_t<traits>::realloc_blocks(size_t new_size) {
+    const size_t old_size = m_blocks_number;
+    const size_t cells_size = 16 * new_size * sizeof(cell_t);
+
+    if( m_arena != NULL ) {
+        const size_t old_cells_size = 16 * old_size * sizeof(cell_t);
+
+        /* The buffers of the same size are kept */
+        if( old_size > 0 && binmap_arena_t::buffer_size(cells_size) == binmap_arena_t::buffer_size(old_cells_size)
+            && binmap_arena_t::buffer_size(new_size * sizeof(flags_t)) == binmap_arena_t::buffer_size(old_size * sizeof(flags_t)) )
+            return true;
+
+        cell_t * const cell = static_cast<cell_t *>(m_arena->alloc_buffer(cells_size));
+        flags_t * const flags = static_cast<flags_t *>(m_arena->alloc_buffer(new_size * sizeof(flags_t)));
+
+        if( cell == NULL || flags == NULL ) {
+            if( cell != NULL )
+                m_arena->free_buffer(cell, cells_size);
+            if( flags != NULL )
+                m_arena->free_buffer(flags, new_size * sizeof(flags_t));
+            return false /* MEMORY ERROR */;
+        }
 
-        m_cell[cur_ref].m_is_left_ref = false;
-        m_cell[cur_ref].m_is_right_ref = false;
+        const size_t size = (new_size < old_size) ? new_size : old_size;
+        if( size > 0 ) {
+            memcpy(cell, m_cell, 16 * size * sizeof(cell_t));
+            memcpy(flags, m_flags, size * sizeof(flags_t));
+        }
 
-        m_cell[cur_ref].m_left.m_bitmap = BITMAP_FILLED;
-        m_cell[cur_ref].m_right.m_bitmap = BITMAP_FILLED;
+        free_blocks();
 
-        pack_cells(trace_ref - 1);
+        m_cell = cell;
+        m_flags = flags;
 
-        return;
+        return true;
     }
 
-    /* Process second stage */
+    if( m_region != NULL ) {
+        /* A full range is moved to one twice as big */
+        if( new_size > m_region->m_max_blocks
+            && !reserve_region((new_size > 2 * m_region->m_max_blocks) ? new_size : 2 * m_region->m_max_blocks, m_region->m_is_huge_pages) )
+            return false /* RESERVE ERROR */;
 
-    /* Gets the bin bitmap type */
-    const int bin_bitmap_idx = bin.toUInt() & BITMAP_LAYER_BITS;
-    const bitmap_t bin_bitmap = BITMAP[ bin_bitmap_idx ] /* special */;
+        if( !commit_region(new_size, m_region->m_count_size / sizeof(uint_t)) )
+            return false /* COMMIT ERROR */;
 
-    /* Otherwise checking, are we need to do anything? */
-    if( bin < cur_bin ) {
-        if( (m_cell[cur_ref].m_left.m_bitmap & bin_bitmap) == bin_bitmap ) /* special */
-            return;
-    } else {
-        if( (m_cell[cur_ref].m_right.m_bitmap & bin_bitmap) == bin_bitmap ) /* special */
-            return;
+        m_cell = reinterpret_cast<cell_t *>(m_region->m_data);
+        m_flags = reinterpret_cast<flags_t *>(m_region->m_data + m_region->m_flags_offset);
+
+        return true;
     }
 
-    /* Get the pre-bin */
-    bin_t pre_bin = bin.parent();   /* OPTIMIZE IT! */
-    while( pre_bin.layer_bits() <= BITMAP_LAYER_BITS )
-        pre_bin = pre_bin.parent();
+    if( m_file == NULL ) {
+        cell_t * const cell = static_cast<cell_t *>(realloc(m_cell, cells_size));
+        if( cell != NULL )
+            m_cell = cell;
+        else if( new_size > old_size )
+            return false /* MEMORY ERROR */;
 
-    /* Continue to trace -- unpack the tree if needed */
-    while( cur_bin != pre_bin ) {
-        if( pre_bin < cur_bin ) {
-            cur_ref = unpack_left_half(cur_ref);
-            cur_bin.to_left();
-        } else {
-            cur_ref = unpack_right_half(cur_ref);
-            cur_bin.to_right();
-        }
+        flags_t * const flags = static_cast<flags_t *>(realloc(m_flags, new_size * sizeof(flags_t)));
+        if( flags != NULL )
+            m_flags = flags;
+        else if( new_size > old_size )
+            return false /* MEMORY ERROR */;
 
-        if( cur_ref == ROOT_REF ) {
-            pack_cells(trace_ref - 1);
-            return; /* UNPACK HALF ERROR */
-        }
+        return true;
+    }
 
-        *trace_ref++ = cur_ref;
+    const size_t old_flags_offset = FILE_HEADER_SIZE + 16 * old_size * sizeof(cell_t);
+    const size_t new_flags_offset = FILE_HEADER_SIZE + cells_size;
+
+    /* The cells of the released blocks are overwritten */
+    if( new_size < old_size )
+        memmove(static_cast<char *>(m_file->m_data) + new_flags_offset, static_cast<char *>(m_file->m_data) + old_flags_offset, new_size * sizeof(flags_t));
+
+    if( !resize_mapped_file(m_file, new_flags_offset + new_size * sizeof(flags_t)) ) {
+        if( new_size < old_size )
+            memmove(static_cast<char *>(m_file->m_data) + old_flags_offset, static_cast<char *>(m_file->m_data) + new_flags_offset, new_size * sizeof(flags_t));
+        return false /* FILE ERROR */;
     }
 
-    assert( cur_bin == pre_bin );
-    assert( cur_bin.layer_bits() > BITMAP_LAYER_BITS );
+    char * const data = static_cast<char *>(m_file->m_data);
 
-    /* Complete setting */
-    if( bin < cur_bin )
-        m_cell[cur_ref].m_left.m_bitmap |= bin_bitmap; /* special */
-    else
-        m_cell[cur_ref].m_right.m_bitmap |= bin_bitmap; /* special */
+    if( new_size > old_size )
+        memmove(data + new_flags_offset, data + old_flags_offset, old_size * sizeof(flags_t));
 
-    pack_cells(trace_ref - 1); /* FIXME: Some times this step is unnecessary */
+    m_cell = reinterpret_cast<cell_t *>(data + FILE_HEADER_SIZE);
+    m_flags = reinterpret_cast<flags_t *>(data + new_flags_offset);
+
+    return true;
 }
 
 
 /**
- * Resets bins
+ * Move the buffers to an address range reserved for the number of
+ * blocks, from the heap or from a smaller range
  *
- * @param bin
- *             the bin
+ * The counts are moved with the buffers when they are enabled first.
+ * The cells are advised to be on the transparent huge pages if asked.
+ *
+ * @return false on error, the buffers stay in place then
  */
-void binmap_t::reset(bin_t bin) {
-    if( bin.is_none() )
-        return;
+template <class traits>
+bool basic_binmap_t<traits>::reserve_region(size_t max_blocks, bool is_huge_pages) {
+    const size_t old_size = m_blocks_number;
+    assert( max_blocks >= old_size );
+
+    /* Up to the limit of references */
+    const uint64_t ref_blocks = static_cast<uint64_t>(static_cast<ref_t>(-1)) / 16 + 1;
+    if( max_blocks > ref_blocks )
+        max_blocks = static_cast<size_t>(ref_blocks);
+
+    /* Check for the address space */
+    const bool has_counts = (m_region != NULL) ? m_region->m_has_counts : (m_count != NULL);
+    const size_t block_size = 16 * sizeof(cell_t) + sizeof(flags_t) + (has_counts ? 16 * sizeof(uint_t) : 0);
+    if( max_blocks > (static_cast<size_t>(-1) - 3 * page_size()) / block_size )
+        return false /* ADDRESS SPACE ERROR */;
+
+    binmap_region_t * const region = static_cast<binmap_region_t *>(malloc(sizeof(binmap_region_t)));
+    if( region == NULL )
+        return false /* MEMORY ERROR */;
+
+    region->m_max_blocks = max_blocks;
+    region->m_flags_offset = round_to_pages(max_blocks * 16 * sizeof(cell_t));
+    region->m_count_offset = region->m_flags_offset + round_to_pages(max_blocks * sizeof(flags_t));
+    region->m_size = region->m_count_offset + (has_counts ? round_to_pages(max_blocks * 16 * sizeof(uint_t)) : 0);
+    region->m_cell_size = 0;
+    region->m_flags_size = 0;
+    region->m_count_size = 0;
+    region->m_has_counts = has_counts;
+    region->m_is_huge_pages = is_huge_pages;
+
+    region->m_data = static_cast<char *>(reserve_pages(region->m_size));
+    if( region->m_data == NULL ) {
+        free(region);
+        return false /* RESERVE ERROR */;
+    }
 
-    /* Extending binmap if needed */
-    while( !m_root_bin.contains(bin) )
-        extend_root();
+#if !defined(_WIN32) && defined(MADV_HUGEPAGE)
+    /* The cells are walked at random, fewer pages take fewer TLB misses */
+    if( is_huge_pages )
+        madvise(region->m_data, region->m_flags_offset, MADV_HUGEPAGE);
+#endif
+
+    /* The inline root has one count */
+    size_t count_size = 0;
+    if( has_counts && m_count != NULL )
+        count_size = (m_region != NULL) ? m_region->m_count_size / sizeof(uint_t) : old_size ? 16 * old_size : 1;
+
+    binmap_region_t * const old_region = m_region;
+    m_region = region;
+
+    if( !commit_region(old_size, count_size) ) {
+        m_region = old_region;
+        release_pages(region->m_data, region->m_size);
+        free(region);
+        return false /* COMMIT ERROR */;
+    }
 
-    /* Store the trace history */
-    ref_t _trace_ref[64];
-    ref_t * trace_ref = _trace_ref;
+    cell_t * const cell = reinterpret_cast<cell_t *>(region->m_data);
+    flags_t * const flags = reinterpret_cast<flags_t *>(region->m_data + region->m_flags_offset);
+    uint_t * const count = reinterpret_cast<uint_t *>(region->m_data + region->m_count_offset);
 
-    /* Process first stage -- do not touch existed tree */
-    ref_t cur_ref = ROOT_REF;
-    bin_t cur_bin = m_root_bin;
+    if( old_size > 0 ) {
+        memcpy(cell, m_cell, 16 * old_size * sizeof(cell_t));
+        memcpy(flags, m_flags, old_size * sizeof(flags_t));
+    }
 
-    *trace_ref++ = ROOT_REF;
-    while( cur_bin != bin ) {
-        if( bin < cur_bin ) {
-            if( m_cell[cur_ref].m_is_left_ref ) {
-                cur_ref = m_cell[cur_ref].m_left.m_ref;
-                cur_bin.to_left();
-            } else
-                break;
-        } else {
-            if( m_cell[cur_ref].m_is_right_ref ) {
-               cur_ref = m_cell[cur_ref].m_right.m_ref;
-               cur_bin.to_right();
-            } else
-                break;
+    if( count_size > 0 )
+        memcpy(count, m_count, count_size * sizeof(uint_t));
+
+    if( old_region != NULL ) {
+        release_pages(old_region->m_data, old_region->m_size);
+        free(old_region);
+    } else {
+        if( old_size > 0 ) {
+            free(m_cell);
+            free(m_flags);
         }
+        if( count_size > 0 )
+            free(m_count);
+    }
 
-        assert( trace_ref < _trace_ref + sizeof(_trace_ref) / sizeof(_trace_ref[0]) );
-        *trace_ref++ = cur_ref;
+    /* The inline root stays in the object */
+    if( old_size > 0 ) {
+        m_cell = cell;
+        m_flags = flags;
     }
 
-    assert( cur_bin.layer_bits() > BITMAP_LAYER_BITS );
+    if( count_size > 0 )
+        m_count = count;
+
+    return true;
+}
 
-    /* If the bin cell was found */
-    if( cur_bin == bin ) {  /* special */
-        if( m_cell[cur_ref].m_is_left_ref )
-            free_cell(m_cell[cur_ref].m_left.m_ref);
-        if( m_cell[cur_ref].m_is_right_ref )
-            free_cell(m_cell[cur_ref].m_right.m_ref);
 
-        m_cell[cur_ref].m_is_left_ref = false;
-        m_cell[cur_ref].m_is_right_ref = false;
+/**
+ * Commit the pages of the reserved range for the number of blocks and
+ * the number of counts, the pages above them are released
+ */
+template <class traits>
+bool basic_binmap_t<traits>::commit_region(size_t new_size, size_t count_size) {
+    assert( new_size <= m_region->m_max_blocks );
 
-        m_cell[cur_ref].m_left.m_bitmap = BITMAP_EMPTY;
-        m_cell[cur_ref].m_right.m_bitmap = BITMAP_EMPTY;
+    char * const data = m_region->m_data;
 
-        pack_cells(trace_ref - 1);
+    return commit_pages(data, m_region->m_cell_size, 16 * new_size * sizeof(cell_t))
+        && commit_pages(data + m_region->m_flags_offset, m_region->m_flags_size, new_size * sizeof(flags_t))
+        && commit_pages(data + m_region->m_count_offset, m_region->m_count_size, count_size * sizeof(uint_t));
+}
 
-        return;
+
+/**
+ * Resize the count buffer, 0 releases it
+ */
+template <class traits>
+bool basic_binmap_t<traits>::resize_counts(size_t size) {
+    if( m_region != NULL && m_region->m_has_counts ) {
+        /* A full range is moved to one twice as big */
+        if( size > 16 * m_region->m_max_blocks
+            && !reserve_region(((size + 15) / 16 > 2 * m_region->m_max_blocks) ? (size + 15) / 16 : 2 * m_region->m_max_blocks, m_region->m_is_huge_pages) )
+            return false /* RESERVE ERROR */;
+
+        if( !commit_region(m_blocks_number, size) )
+            return false /* COMMIT ERROR */;
+
+        m_count = (size > 0) ? reinterpret_cast<uint_t *>(m_region->m_data + m_region->m_count_offset) : NULL;
+        return true;
     }
 
-    /* Process second stage */
+    if( size == 0 ) {
+        free(m_count);
+        m_count = NULL;
+        return true;
+    }
 
-    /* Gets the bin bitmap type */
-    const int bin_bitmap_idx = bin.toUInt() & BITMAP_LAYER_BITS;
-    const bitmap_t bin_bitmap = BITMAP[ bin_bitmap_idx ] /* special */;
+    uint_t * const count = static_cast<uint_t *>(realloc(m_count, size * sizeof(m_count[0])));
+    if( count == NULL )
+        return false /* MEMORY ERROR */;
 
-    /* Otherwise checking, are we need to do anything? */
-    if( bin < cur_bin ) {
-        if( (m_cell[cur_ref].m_left.m_bitmap & bin_bitmap) == 0 ) /* special */
-            return;
+    m_count = count;
+
+    return true;
+}
+
+
+/**
+ * Release the cell and the flag buffers, on the heap or in the arena
+ */
+template <class traits>
+void basic_binmap_t<traits>::free_blocks() {
+    if( m_region != NULL ) {
+        /* The counts go to the heap */
+        if( m_count != NULL && m_region->m_has_counts ) {
+            uint_t * const count = static_cast<uint_t *>(malloc(m_region->m_count_size));
+            if( count != NULL )
+                memcpy(count, m_count, m_region->m_count_size);
+            else
+                fprintf(stderr, "Warning: binmap_t: COUNTS ARE DISABLED\n");
+
+            m_count = count;
+        }
+
+        release_pages(m_region->m_data, m_region->m_size);
+        free(m_region);
+
+        m_region = NULL;
+
+        /* The inline root stays in the object */
+        if( m_blocks_number > 0 ) {
+            m_cell = NULL;
+            m_flags = NULL;
+        }
+        return;
+    }
+
+    /* The inline root */
+    if( m_blocks_number == 0 )
+        return;
+
+    if( m_arena != NULL ) {
+        if( m_cell != NULL )
+            m_arena->free_buffer(m_cell, 16 * m_blocks_number * sizeof(cell_t));
+        if( m_flags != NULL )
+            m_arena->free_buffer(m_flags, m_blocks_number * sizeof(flags_t));
     } else {
-        if( (m_cell[cur_ref].m_right.m_bitmap & bin_bitmap) == 0 ) /* special */
-            return;
+        if( m_cell != NULL )
+            free(m_cell);
+        if( m_flags != NULL )
+            free(m_flags);
     }
 
-    /* Get the pre-bin */
-    bin_t pre_bin = bin.parent();   /* OPTIMIZE IT! */
-    while( pre_bin.layer_bits() <= BITMAP_LAYER_BITS )
-        pre_bin = pre_bin.parent();
+    m_cell = NULL;
+    m_flags = NULL;
+}
 
-    /* Continue to trace -- unpack the tree if needed */
-    while( cur_bin != pre_bin ) {
-        if( pre_bin < cur_bin ) {
-            cur_ref = unpack_left_half(cur_ref);
-            cur_bin.to_left();
-        } else {
-            cur_ref = unpack_right_half(cur_ref);
-            cur_bin.to_right();
-        }
 
-        if( cur_ref == ROOT_REF ) {
-            pack_cells(trace_ref - 1);
-            return; /* UNPACK HALF ERROR */
+/**
+ * Extend the cell buffer to the number of blocks, the new cells
+ * are put in front of the free cell list
+ */
+template <class traits>
+bool basic_binmap_t<traits>::extend_blocks(size_t new_size) {
+    const size_t old_size = m_blocks_number;
+    assert( new_size > old_size );
+
+    /* Check for reference capacity */
+    if( static_cast<ref_t>(16 * new_size - 1) != 16 * new_size - 1 ) {
+        fprintf(stderr, "Warning: binmap_t::extend_blocks: REFERENCE LIMIT ERROR\n");
+        return false /* REFERENCE LIMIT ERROR */;
+    }
+
+    const size_t size1 = 16 * new_size * sizeof(m_cell[0]) + new_size * sizeof(m_flags[0]);
+
+    /* Check for integer overflow */
+    if( size1 / (16 * sizeof(m_cell[0]) + sizeof(m_flags[0])) != new_size ) {
+        fprintf(stderr, "Warning: binmap_t::extend_blocks: INTEGER OVERFLOW\n");
+        return false /* INTEGER OVERFLOW */;
+    }
+
+    /* Reallocate memory */
+    if( m_count != NULL && !resize_counts(16 * new_size) ) {
+        fprintf(stderr, "Warning: binmap_t::extend_blocks: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    /* The inline root goes to the first block */
+    const bool is_inline = (old_size == 0);
+    if( is_inline ) {
+        m_cell = NULL;
+        m_flags = NULL;
+    }
+
+    if( !realloc_blocks(new_size) ) {
+        if( is_inline ) {
+            /* A heap buffer may be allocated alone */
+            if( m_arena == NULL ) {
+                free(m_cell);
+                free(m_flags);
+            }
+
+            m_cell = &m_root_cell;
+            m_flags = &m_root_flags;
         }
 
-        *trace_ref++ = cur_ref;
+        fprintf(stderr, "Warning: binmap_t::extend_blocks: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
     }
 
-    assert( cur_bin == pre_bin );
-    assert( cur_bin.layer_bits() > BITMAP_LAYER_BITS );
+    m_blocks_number = new_size;
 
-    /* Complete setting */
-    if( bin < cur_bin )
-        m_cell[cur_ref].m_left.m_bitmap &= ~bin_bitmap; /* special */
+    if( is_inline ) {
+        m_cell[ROOT_REF] = m_root_cell;
+        m_flags[0] = m_root_flags;
+    }
+
+    /* Insert new cells to the free cell list */
+    const size_t first_idx = is_inline ? 1 : 16 * old_size;
+    const size_t stop_idx = first_idx - 1;
+    size_t idx = 16 * new_size - 1;
+
+    set_free(idx, true);
+    m_cell[ idx ].m_free_next = m_free_top;
+    m_cell[ idx ].m_free_prev = static_cast<ref_t>(idx - 1);
+
+    if( m_free_top != ROOT_REF )
+        m_cell[ m_free_top ].m_free_prev = static_cast<ref_t>(idx);
+
+    for(--idx; idx != stop_idx; --idx) {
+        set_free(idx, true);
+        m_cell[ idx ].m_free_next = static_cast<ref_t>(idx + 1);
+        m_cell[ idx ].m_free_prev = static_cast<ref_t>(idx - 1);
+    }
+
+    m_free_top = static_cast<ref_t>(first_idx);
+    m_cell[ m_free_top ].m_free_prev = ROOT_REF;
+
+    return true;
+}
+
+
+/**
+ * Allocates one cell
+ */
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::alloc_cell() {
+    /* The cells left by the compaction are not listed */
+    if( m_free_top == ROOT_REF && m_is_compacting )
+        reset_free_cells();
+
+    if( m_free_top == ROOT_REF ) {
+        size_t new_size = m_blocks_number ? 2 * m_blocks_number : 1;
+
+        /* A reserved buffer grows in place by steps, to fill the range
+           before it is moved */
+        if( m_region != NULL && new_size > m_blocks_number + REGION_STEP_BLOCKS )
+            new_size = m_blocks_number + REGION_STEP_BLOCKS;
+        if( m_region != NULL && m_blocks_number < m_region->m_max_blocks && new_size > m_region->m_max_blocks )
+            new_size = m_region->m_max_blocks;
+
+        /* Extend the buffer */
+        if( !extend_blocks(new_size) )
+            return ROOT_REF /* ALLOC ERROR */;
+    }
+
+    return take_free_cell(m_free_top);
+}
+
+
+/**
+ * Allocates one cell for a child of the cell, in the block of the
+ * parent if it has a free cell
+ *
+ * The traces from the root then stay in fewer cache lines.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::alloc_child_cell(ref_t parent) {
+    const uint16_t free_mask = m_flags[parent / 16].m_is_free;
+
+    /* The cells left by the compaction are not listed */
+    if( free_mask == 0 || m_is_compacting )
+        return alloc_cell();
+
+    size_t idx = 0;
+    while( !((free_mask >> idx) & 1) )
+        ++idx;
+
+    return take_free_cell(static_cast<ref_t>(parent / 16 * 16 + idx));
+}
+
+
+/**
+ * Remove the cell from the free cell list
+ */
+template <class traits>
+void basic_binmap_t<traits>::unlink_free_cell(ref_t ref) {
+    const ref_t next = m_cell[ref].m_free_next;
+    const ref_t prev = m_cell[ref].m_free_prev;
+
+    if( prev != ROOT_REF )
+        m_cell[prev].m_free_next = next;
     else
-        m_cell[cur_ref].m_right.m_bitmap &= ~bin_bitmap; /* special */
+        m_free_top = next;
 
-    pack_cells(trace_ref - 1); /* FIXME: Some times this step is unnecessary */
+    if( next != ROOT_REF )
+        m_cell[next].m_free_prev = prev;
 }
 
 
 /**
- * Get blocks number
+ * Take the free cell to use it
  */
-size_t binmap_t::blocks_number() const {
-    return m_blocks_number;
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::take_free_cell(ref_t ref) {
+    assert( is_free(ref) );
+
+    unlink_free_cell(ref);
+
+    /* Clean it */
+    memset(&m_cell[ref], 0, sizeof(m_cell[ref]));
+    set_left_ref(ref, false);
+    set_right_ref(ref, false);
+    set_free(ref, false);
+
+    ++m_cells_number;
+
+    return ref;
 }
 
 
 /**
- * Get cells number
+ * Whether the left half of the cell is a reference
  */
-size_t binmap_t::cells_number() const {
-    return m_cells_number;
+template <class traits>
+inline bool basic_binmap_t<traits>::is_left_ref(ref_t ref) const {
+    return (m_flags[ref / 16].m_is_left_ref >> (ref % 16)) & 1;
 }
 
 
 /**
- * Get total size of the binmap
+ * Whether the right half of the cell is a reference
  */
-size_t binmap_t::total_size() const {
-    return sizeof(*this) + 16 * sizeof(cell_t) * blocks_number();
+template <class traits>
+inline bool basic_binmap_t<traits>::is_right_ref(ref_t ref) const {
+    return (m_flags[ref / 16].m_is_right_ref >> (ref % 16)) & 1;
 }
 
 
+/**
+ * Whether the half of the cell is a reference
+ */
+template <class traits>
+inline bool basic_binmap_t<traits>::is_half_ref(ref_t ref, bool right) const {
+    return right ? is_right_ref(ref) : is_left_ref(ref);
+}
+
 
 /**
- * Echo the binmap status to stdout
+ * Mark the left half of the cell as a reference or a bitmap
  */
-void binmap_t::status() const {
-    printf("bitmap:\n");
-    for(int i = 0; i < 16; ++i) {
-        for(int j = 0; j < 64; ++j)
-            printf("%d", get(bin_t(i * 64 + j)));
-        printf("\n");
-    }
+template <class traits>
+inline void basic_binmap_t<traits>::set_left_ref(ref_t ref, bool is_ref) {
+    const uint16_t bit = static_cast<uint16_t>(1U << (ref % 16));
+    if( is_ref )
+        m_flags[ref / 16].m_is_left_ref |= bit;
+    else
+        m_flags[ref / 16].m_is_left_ref &= static_cast<uint16_t>(~bit);
+}
 
-    printf("size: %u bytes\n", total_size());
-    printf("cells number: %u (of %u)\n", cells_number(), 16 * blocks_number());
-    printf("root bin: %llu\n", static_cast<unsigned long long>(m_root_bin.toUInt()));
 
-//    ref_t _nil_cell[256];
-//    bin_t _nil_bin[256];
-//    ref_t * top_cell = _nil_cell;
-//    bin_t * top_bin = _nil_bin;
+/**
+ * Mark the right half of the cell as a reference or a bitmap
+ */
+template <class traits>
+inline void basic_binmap_t<traits>::set_right_ref(ref_t ref, bool is_ref) {
+    const uint16_t bit = static_cast<uint16_t>(1U << (ref % 16));
+    if( is_ref )
+        m_flags[ref / 16].m_is_right_ref |= bit;
+    else
+        m_flags[ref / 16].m_is_right_ref &= static_cast<uint16_t>(~bit);
+}
+
+
+/**
+ * Whether the cell is free
+ */
+template <class traits>
+inline bool basic_binmap_t<traits>::is_free(ref_t ref) const {
+    return (m_flags[ref / 16].m_is_free >> (ref % 16)) & 1;
+}
+
+
+/**
+ * Mark the cell as free or used
+ */
+template <class traits>
+inline void basic_binmap_t<traits>::set_free(ref_t ref, bool is_free) {
+    const uint16_t bit = static_cast<uint16_t>(1U << (ref % 16));
+    if( is_free )
+        m_flags[ref / 16].m_is_free |= bit;
+    else
+        m_flags[ref / 16].m_is_free &= static_cast<uint16_t>(~bit);
+}
+
+
+/**
+ * Copy the cell of a binmap with its reference flags, the cell is used
+ */
+template <class traits>
+inline void basic_binmap_t<traits>::copy_cell(ref_t ref, const basic_binmap_t & source, ref_t source_ref) {
+    m_cell[ref] = source.m_cell[source_ref];
+    set_left_ref(ref, source.is_left_ref(source_ref));
+    set_right_ref(ref, source.is_right_ref(source_ref));
+    set_free(ref, false);
+}
+
+
+/**
+ * Releases the cell
+ */
+template <class traits>
+void basic_binmap_t<traits>::free_cell(ref_t ref) {
+    assert( ref > 0 );
+    assert( !is_free(ref) );
+
+    if( is_left_ref(ref) )
+        free_cell(m_cell[ref].m_left.m_ref);
+    if( is_right_ref(ref) )
+        free_cell(m_cell[ref].m_right.m_ref);
+
+    set_free(ref, true);
+    m_cell[ref].m_free_next = m_free_top;
+    m_cell[ref].m_free_prev = ROOT_REF;
+
+    if( m_free_top != ROOT_REF )
+        m_cell[m_free_top].m_free_prev = ref;
+
+    m_free_top = ref;
+
+    --m_cells_number;
+}
+
+
+/**
+ * Parse the header of a stream
+ */
+template <class traits>
+bool basic_binmap_t<traits>::parse_header(const unsigned char * header, bin_t & root_bin) {
+    if( header[0] != STREAM_SIGNATURE[0] || header[1] != STREAM_SIGNATURE[1] || header[2] != STREAM_VERSION ) {
+        fprintf(stderr, "Warning: binmap_t::parse_header: FORMAT ERROR\n");
+        return false /* FORMAT ERROR */;
+    }
+
+    if( header[3] != sizeof(bitmap_t) || header[4] != sizeof(uint_t) ) {
+        fprintf(stderr, "Warning: binmap_t::parse_header: TYPE ERROR\n");
+        return false /* TYPE ERROR */;
+    }
+
+    uint_t root = 0;
+    for(size_t i = 0; i < sizeof(uint_t); ++i)
+        root |= static_cast<uint_t>(header[STREAM_HEADER_SIZE + i]) << (8 * i);
+
+    /* The root bin starts at the offset 0 and is above the leaf halves */
+    root_bin = bin_t(root);
+    if( root_bin.is_none() || (root & (root + 1)) != 0 || root_bin.layer_bits() <= bitmap_policy::LAYER_BITS ) {
+        fprintf(stderr, "Warning: binmap_t::parse_header: FORMAT ERROR\n");
+        return false /* FORMAT ERROR */;
+    }
+
+    return true;
+}
+
+
+/**
+ * Rebuild the list of free cells in the ascending order
+ *
+ * The cells allocated next follow each other in memory.
+ */
+template <class traits>
+void basic_binmap_t<traits>::reset_free_cells() {
+    m_free_top = ROOT_REF;
+
+    for(size_t idx = 16 * m_blocks_number; idx-- > 1; ) {
+        if( is_free(idx) ) {
+            m_cell[idx].m_free_next = m_free_top;
+            m_cell[idx].m_free_prev = ROOT_REF;
+
+            if( m_free_top != ROOT_REF )
+                m_cell[m_free_top].m_free_prev = static_cast<ref_t>(idx);
+
+            m_free_top = static_cast<ref_t>(idx);
+        }
+    }
+}
+
+
+/**
+ * Extend root
+ */
+template <class traits>
+void basic_binmap_t<traits>::extend_root() {
+    assert( m_root_bin != bin_t::ALL );
+
+    if( m_cell[ROOT_REF].m_left.m_bitmap == m_cell[ROOT_REF].m_right.m_bitmap ) {
+        /* Setup the root cell */
+        m_cell[ROOT_REF].m_right.m_bitmap = bitmap_policy::EMPTY;
+
+    } else {
+        /* Allocate new cell */
+        const ref_t ref = alloc_child_cell(ROOT_REF);
+        if( ref == ROOT_REF )
+            return /* ALLOC ERROR */;
+
+        /* Move old root to the cell */
+        copy_cell(ref, *this, ROOT_REF);
+        if( m_count != NULL )
+            m_count[ref] = m_count[ROOT_REF];
+
+        /* Setup new root */
+        set_left_ref(ROOT_REF, true);
+        set_right_ref(ROOT_REF, false);
+
+        m_cell[ROOT_REF].m_left.m_ref = ref;
+        m_cell[ROOT_REF].m_right.m_bitmap = bitmap_policy::EMPTY;
+    }
+
+    /* Reset bin */
+    m_root_bin = m_root_bin.parent();
+
+    recount_cell(ROOT_REF, m_root_bin);
+}
+
+
+/**
+ * Unpack the left half of a cell
+ */
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::unpack_left_half(ref_t ref) {
+    assert( !is_left_ref(ref) );
+
+    const ref_t left_ref = alloc_child_cell(ref);
+    if( left_ref == ROOT_REF )
+        return ROOT_REF /* ALLOC ERROR */;
+
+    m_cell[left_ref].m_left.m_bitmap = m_cell[ref].m_left.m_bitmap;
+    m_cell[left_ref].m_right.m_bitmap = m_cell[ref].m_left.m_bitmap;
+
+    set_left_ref(ref, true);
+    m_cell[ref].m_left.m_ref = left_ref;
+
+    return left_ref;
+}
+
+
+/**
+ * Unpack the right half of a cell
+ */
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::unpack_right_half(ref_t ref) {
+    assert( !is_right_ref(ref) );
+
+    const ref_t right_ref = alloc_child_cell(ref);
+    if( right_ref == ROOT_REF )
+        return ROOT_REF /* ALLOC ERROR */;
+
+    m_cell[right_ref].m_left.m_bitmap = m_cell[ref].m_right.m_bitmap;
+    m_cell[right_ref].m_right.m_bitmap = m_cell[ref].m_right.m_bitmap;
+
+    set_right_ref(ref, true);
+    m_cell[ref].m_right.m_ref = right_ref;
+
+    return right_ref;
+}
+
+
+/**
+ * Pack a trace of cells
+ */
+template <class traits>
+void basic_binmap_t<traits>::pack_cells(ref_t * trace_ref) {
+    ref_t ref = *trace_ref--;
+    if( ref == ROOT_REF )
+        return;
+
+    /* A bin above the leaf layer may have been set next to a subtree */
+    if( is_left_ref(ref) || is_right_ref(ref) )
+        return;
+
+    if( m_cell[ref].m_left.m_bitmap != m_cell[ref].m_right.m_bitmap )
+        return;
+
+    const bitmap_t bitmap = m_cell[ref].m_left.m_bitmap;
+
+    do {
+        ref = *trace_ref--;
+
+        if( !is_left_ref(ref) ) {
+            if( m_cell[ref].m_left.m_bitmap != bitmap )
+                break;
+
+        } else if( !is_right_ref(ref) ) {
+            if( m_cell[ref].m_right.m_bitmap != bitmap )
+                break;
+
+        } else
+            break;
+
+    } while( ref != ROOT_REF );
+
+    const ref_t par_ref = trace_ref[2];
+
+    if( is_left_ref(ref) && m_cell[ref].m_left.m_ref == par_ref ) {
+        set_left_ref(ref, false);
+        m_cell[ref].m_left.m_bitmap = bitmap;
+    } else {
+        set_right_ref(ref, false);
+        m_cell[ref].m_right.m_bitmap = bitmap;
+    }
+
+    free_cell(par_ref);
+}
+
+
+/**
+ * Assignment operator
+ */
+template <class traits>
+basic_binmap_t<traits> & basic_binmap_t<traits>::operator = (const basic_binmap_t & source) {
+    if( &source != this ) {
+        basic_binmap_t copy(source);
+        swap(copy);
+    }
+
+    return *this;
+}
+
+
+/**
+ * Swap the bins with another binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::swap(basic_binmap_t & other) {
+    cell_t * const cell = m_cell;
+    m_cell = other.m_cell;
+    other.m_cell = cell;
+
+    flags_t * const flags = m_flags;
+    m_flags = other.m_flags;
+    other.m_flags = flags;
+
+    const size_t blocks_number = m_blocks_number;
+    m_blocks_number = other.m_blocks_number;
+    other.m_blocks_number = blocks_number;
+
+    const size_t cells_number = m_cells_number;
+    m_cells_number = other.m_cells_number;
+    other.m_cells_number = cells_number;
+
+    const ref_t free_top = m_free_top;
+    m_free_top = other.m_free_top;
+    other.m_free_top = free_top;
+
+    const bin_t root_bin = m_root_bin;
+    m_root_bin = other.m_root_bin;
+    other.m_root_bin = root_bin;
+
+    uint_t * const count = m_count;
+    m_count = other.m_count;
+    other.m_count = count;
+
+    binmap_file_t * const file = m_file;
+    m_file = other.m_file;
+    other.m_file = file;
+
+    binmap_arena_t * const arena = m_arena;
+    m_arena = other.m_arena;
+    other.m_arena = arena;
+
+    binmap_region_t * const region = m_region;
+    m_region = other.m_region;
+    other.m_region = region;
+
+    /* The inline roots are swapped with the rest */
+    const cell_t root_cell = m_root_cell;
+    m_root_cell = other.m_root_cell;
+    other.m_root_cell = root_cell;
+
+    const flags_t root_flags = m_root_flags;
+    m_root_flags = other.m_root_flags;
+    other.m_root_flags = root_flags;
+
+    if( m_blocks_number == 0 ) {
+        m_cell = &m_root_cell;
+        m_flags = &m_root_flags;
+    }
+
+    if( other.m_blocks_number == 0 ) {
+        other.m_cell = &other.m_root_cell;
+        other.m_flags = &other.m_root_flags;
+    }
+
+    const uint_t compact_offset = m_compact_offset;
+    m_compact_offset = other.m_compact_offset;
+    other.m_compact_offset = compact_offset;
+
+    const bool is_compacting = m_is_compacting;
+    m_is_compacting = other.m_is_compacting;
+    other.m_is_compacting = is_compacting;
+}
+
+
+/**
+ * Get bins
+ *
+ * @param bin
+ *             the bin
+ * @return fill type of the bin
+ */
+template <class traits>
+bool basic_binmap_t<traits>::get(bin_t bin) const {
+    if( !m_root_bin.contains(bin) )
+        return false;
+
+    /* Trace the bin */
+    ref_t cur_ref = ROOT_REF;
+    bin_t cur_bin = m_root_bin;
+
+    for( ;; ) {
+        if( bin == cur_bin )
+            break;
+
+        if( bin < cur_bin ) {
+            if( is_left_ref(cur_ref) ) {
+                cur_ref = m_cell[cur_ref].m_left.m_ref;
+                cur_bin.to_left();
+            } else
+                break;
+        } else {
+            if( is_right_ref(cur_ref) ) {
+                cur_ref = m_cell[cur_ref].m_right.m_ref;
+                cur_bin.to_right();
+            } else
+                break;
+        }
+    }
+
+    assert( cur_bin.layer_bits() > bitmap_policy::LAYER_BITS );
+
+    /* Proccess common case */
+    if( bin.layer_bits() > bitmap_policy::LAYER_BITS ) {
+        if( bin == cur_bin )
+            return m_cell[cur_ref].m_left.m_bitmap == bitmap_policy::FILLED && m_cell[cur_ref].m_right.m_bitmap == bitmap_policy::FILLED;
+        if( bin < cur_bin )
+            return m_cell[cur_ref].m_left.m_bitmap == bitmap_policy::FILLED;
+        return m_cell[cur_ref].m_right.m_bitmap == bitmap_policy::FILLED;
+    }
+
+    /* Process low-layers case */
+    assert( bin != cur_bin );
+
+    const bitmap_t bm1 = bitmap_policy::bin(bitmap_policy::LAYER_BITS & bin.toUInt());
+    const bitmap_t bm2 = (bin < cur_bin) ? m_cell[cur_ref].m_left.m_bitmap : m_cell[cur_ref].m_right.m_bitmap;
+
+    return (bm1 & bm2) == bm1;
+}
+
+
+/**
+ * Find first empty bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_empty() const {
+    /* Trace the bin */
+    bitmap_t bitmap = bitmap_policy::FILLED;
+
+    ref_t cur_ref = ROOT_REF;
+    bin_t cur_bin = m_root_bin;
+
+//    if( m_cell[cur_ref].m_left.m_bitmap == bitmap_policy::EMPTY && m_cell[cur_ref].m_right.m_bitmap == bitmap_policy::EMPTY )
+//        return bin_t::ALL;
+
+    for( ;; ) {
+        if( is_left_ref(cur_ref) ) {
+            cur_ref = m_cell[cur_ref].m_left.m_ref;
+            cur_bin.to_left();
+        } else if( m_cell[cur_ref].m_left.m_bitmap != bitmap_policy::FILLED ) {
+            bitmap = m_cell[cur_ref].m_left.m_bitmap;
+            cur_bin.to_left();
+            break;
+        } else if( is_right_ref(cur_ref) ) {
+            cur_ref = m_cell[cur_ref].m_right.m_ref;
+            cur_bin.to_right();
+        } else {
+            bitmap = m_cell[cur_ref].m_right.m_bitmap;
+            cur_bin.to_right();
+            break;
+        }
+    }
+
+    return trace_bin_on_bitmap(cur_bin, bitmap);
+}
+
+
+/**
+ * Find the leftmost empty bin within the bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_empty(bin_t within) const {
+    if( within.is_none() )
+        return bin_t::NONE;
+
+    return find_value(within.base_offset(), within.base_offset() + within.base_length(), bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the leftmost empty bin at or after the base offset
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_empty_after(uint_t offset) const {
+    return find_value(offset, bin_t::ALL.base_length(), bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the leftmost filled bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_filled() const {
+    return find_value(0, m_root_bin.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Find the leftmost filled bin within the bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_filled(bin_t within) const {
+    if( within.is_none() )
+        return bin_t::NONE;
+
+    return find_value(within.base_offset(), within.base_offset() + within.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Find the leftmost filled bin at or after the base offset
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_filled_after(uint_t offset) const {
+    return find_value(offset, bin_t::ALL.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Trace the half of the bin inside of the root
+ *
+ * @return whether the half is a reference (the root cell for the root bin)
+ */
+template <class traits>
+bool basic_binmap_t<traits>::trace_half(bin_t target, half_t & half) const {
+    ref_t ref = ROOT_REF;
+    bin_t bin = m_root_bin;
+
+    if( target == bin ) {
+        half.m_ref = ROOT_REF;
+        return true;
+    }
+
+    for( ;; ) {
+        const bool right = !(target < bin);
+        const bool is_ref = is_half_ref(ref, right);
+
+        half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+        bin = right ? bin.right() : bin.left();
+
+        if( !is_ref || bin == target )
+            return is_ref;
+
+        ref = half.m_ref;
+    }
+}
+
+
+/**
+ * Find the leftmost bin within [begin, end) under the halves of the bin
+ * filled in have but empty in mine
+ *
+ * A packed half stands for all its bin on both sides; the walk is
+ * pruned where have is empty or mine is filled, and falls back to a
+ * single tree search where the other side is uniform.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_complement_half(const basic_binmap_t & have, half_t have_half, bool have_is_ref, const basic_binmap_t & mine, half_t mine_half, bool mine_is_ref, bin_t bin, uint_t begin, uint_t end) {
+    const uint_t lo = bin.base_offset();
+    const uint_t hi = lo + bin.base_length();
+
+    if( hi <= begin || end <= lo )
+        return bin_t::NONE;
+
+    if( !have_is_ref && have_half.m_bitmap == bitmap_policy::EMPTY )
+        return bin_t::NONE;
+    if( !mine_is_ref && mine_half.m_bitmap == bitmap_policy::FILLED )
+        return bin_t::NONE;
+
+    if( !have_is_ref && !mine_is_ref )
+        return find_in_half(have_half.m_bitmap & ~mine_half.m_bitmap, bin, begin, end, bitmap_policy::FILLED);
+
+    if( !mine_is_ref && mine_half.m_bitmap == bitmap_policy::EMPTY )
+        return have.find_in_cell(have_half.m_ref, bin, begin, end, bitmap_policy::FILLED);
+    if( !have_is_ref && have_half.m_bitmap == bitmap_policy::FILLED )
+        return mine.find_in_cell(mine_half.m_ref, bin, begin, end, bitmap_policy::EMPTY);
+
+    for(int right = 0; right < 2; ++right) {
+        half_t have_child = have_half;
+        half_t mine_child = mine_half;
+        bool have_child_is_ref = false;
+        bool mine_child_is_ref = false;
+
+        if( have_is_ref ) {
+            const cell_t & cell = have.m_cell[have_half.m_ref];
+            have_child = right ? cell.m_right : cell.m_left;
+            have_child_is_ref = have.is_half_ref(have_half.m_ref, right);
+        }
+
+        if( mine_is_ref ) {
+            const cell_t & cell = mine.m_cell[mine_half.m_ref];
+            mine_child = right ? cell.m_right : cell.m_left;
+            mine_child_is_ref = mine.is_half_ref(mine_half.m_ref, right);
+        }
+
+        const bin_t found = find_complement_half(have, have_child, have_child_is_ref, mine, mine_child, mine_child_is_ref, right ? bin.right() : bin.left(), begin, end);
+        if( !found.is_none() )
+            return found;
+    }
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Find the leftmost bin within the bin filled in have but empty in mine
+ *
+ * Both trees are walked together without allocations.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_complement(const basic_binmap_t & have, const basic_binmap_t & mine, bin_t within) {
+    if( within.is_none() )
+        return bin_t::NONE;
+
+    const uint_t begin = within.base_offset();
+    uint_t end = begin + within.base_length();
+
+    /* The bins beyond the have root are empty */
+    const uint_t have_end = have.m_root_bin.base_length();
+    if( end > have_end )
+        end = have_end;
+
+    if( begin >= end )
+        return bin_t::NONE;
+
+    half_t have_half;
+    half_t mine_half;
+
+    if( mine.m_root_bin.contains(have.m_root_bin) ) {
+        have_half.m_ref = ROOT_REF;
+        const bool mine_is_ref = mine.trace_half(have.m_root_bin, mine_half);
+
+        return find_complement_half(have, have_half, true, mine, mine_half, mine_is_ref, have.m_root_bin, begin, end);
+    }
+
+    /* The bins beyond the mine root are empty there */
+    const uint_t mine_end = mine.m_root_bin.base_length();
+
+    mine_half.m_ref = ROOT_REF;
+    const bool have_is_ref = have.trace_half(mine.m_root_bin, have_half);
+
+    if( begin < mine_end ) {
+        const bin_t found = find_complement_half(have, have_half, have_is_ref, mine, mine_half, true, mine.m_root_bin, begin, (end < mine_end) ? end : mine_end);
+        if( !found.is_none() )
+            return found;
+    }
+
+    return have.find_value((begin > mine_end) ? begin : mine_end, end, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Get the biggest bin starting at the base offset begin inside of [begin, end)
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::aligned_bin(uint_t begin, uint_t end) {
+    int layer = 0;
+
+    while( layer + 1 < static_cast<int>(8 * sizeof(uint_t)) && !(begin & ((static_cast<uint_t>(2) << layer) - 1)) && end - begin >= (static_cast<uint_t>(2) << layer) )
+        ++layer;
+
+    return bin_t(2 * begin + (static_cast<uint_t>(1) << layer) - 1);
+}
+
+
+/**
+ * Find the leftmost bin of the value within [begin, end) under a packed half
+ *
+ * A packed half above the leaf layer repeats its bitmap, so the first
+ * match is in one of the first two bitmaps of the intersection.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_in_half(bitmap_t bitmap, bin_t bin, uint_t begin, uint_t end, bitmap_t value) {
+    const uint_t bin_begin = bin.base_offset();
+    const uint_t bin_end = bin_begin + bin.base_length();
+
+    const uint_t lo = (begin > bin_begin) ? begin : bin_begin;
+    const uint_t hi = (end < bin_end) ? end : bin_end;
+
+    const bitmap_t x = (value == bitmap_policy::FILLED) ? bitmap : ~bitmap;
+
+    if( x == bitmap_policy::EMPTY )
+        return bin_t::NONE;
+    if( x == bitmap_policy::FILLED )
+        return aligned_bin(lo, hi);
+
+    const uint_t bitmap_bits = 8 * sizeof(bitmap_t);
+
+    for(uint_t offset = lo - lo % bitmap_bits; offset < hi; offset += bitmap_bits) {
+        const uint_t b = (lo > offset) ? lo - offset : 0;
+        const uint_t e = (hi - offset < bitmap_bits) ? hi - offset : bitmap_bits;
+
+        const bitmap_t y = x & bitmap_policy::range(b, e);
+        if( y != bitmap_policy::EMPTY )
+            return bin_t(2 * offset + bitmap_policy::to_bin(y));
+    }
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Find the leftmost bin of the value within [begin, end) under the cell
+ *
+ * The subtrees of the cells are never uniform, so a subtree inside of
+ * [begin, end) always has a match, and only the subtrees crossing the
+ * bounds may be left without one: the search takes O(depth).
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_in_cell(ref_t ref, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const {
+    for(int right = 0; right < 2; ++right) {
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t lo = half_bin.base_offset();
+        const uint_t hi = lo + half_bin.base_length();
+
+        if( hi <= begin || end <= lo )
+            continue;
+
+        const bool is_ref = is_half_ref(ref, right);
+        const half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+        const bin_t found = is_ref ? find_in_cell(half.m_ref, half_bin, begin, end, value) : find_in_half(half.m_bitmap, half_bin, begin, end, value);
+        if( !found.is_none() )
+            return found;
+    }
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Find the leftmost bin of the value within the base bins [begin, end)
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::find_value(uint_t begin, uint_t end, bitmap_t value) const {
+    if( begin >= end )
+        return bin_t::NONE;
+
+    const uint_t root_end = m_root_bin.base_length();
+
+    if( begin < root_end ) {
+        const bin_t found = find_in_cell(ROOT_REF, m_root_bin, begin, end, value);
+        if( !found.is_none() )
+            return found;
+    }
+
+    /* The bins beyond the root are empty */
+    if( value == bitmap_policy::EMPTY && end > root_end )
+        return aligned_bin((begin > root_end) ? begin : root_end, end);
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Sets bins
+ *
+ * @param bin
+ *             the bin
+ */
+template <class traits>
+void basic_binmap_t<traits>::set(bin_t bin) {
+    if( bin.is_none() )
+        return;
+
+    /* Extending binmap if needed */
+    while( !m_root_bin.contains(bin) )
+        extend_root();
+
+    /* Store the trace history */
+    ref_t _trace_ref[64];
+    ref_t * trace_ref = _trace_ref;
+
+    /* Process first stage -- do not touch existed tree */
+    ref_t cur_ref = ROOT_REF;
+    bin_t cur_bin = m_root_bin;
+
+    *trace_ref++ = ROOT_REF;
+    while( cur_bin != bin ) {
+        if( bin < cur_bin ) {
+            if( is_left_ref(cur_ref) ) {
+                cur_ref = m_cell[cur_ref].m_left.m_ref;
+                cur_bin.to_left();
+            } else
+                break;
+        } else {
+            if( is_right_ref(cur_ref) ) {
+               cur_ref = m_cell[cur_ref].m_right.m_ref;
+               cur_bin.to_right();
+            } else
+                break;
+        }
+
+        assert( trace_ref < _trace_ref + sizeof(_trace_ref) / sizeof(_trace_ref[0]) );
+        *trace_ref++ = cur_ref;
+    }
+
+    assert( cur_bin.layer_bits() > bitmap_policy::LAYER_BITS );
+
+    /* If the bin cell was found */
+    if( cur_bin == bin ) {  /* special */
+        if( is_left_ref(cur_ref) )
+            free_cell(m_cell[cur_ref].m_left.m_ref);
+        if( is_right_ref(cur_ref) )
+            free_cell(m_cell[cur_ref].m_right.m_ref);
+
+        set_left_ref(cur_ref, false);
+        set_right_ref(cur_ref, false);
+
+        m_cell[cur_ref].m_left.m_bitmap = bitmap_policy::FILLED;
+        m_cell[cur_ref].m_right.m_bitmap = bitmap_policy::FILLED;
+
+        pack_cells(trace_ref - 1);
+        recount_trace(_trace_ref, trace_ref, bin);
+
+        return;
+    }
+
+    /* Process second stage */
+
+    /* Gets the bin bitmap type */
+    const unsigned int bin_bitmap_idx = bin.toUInt() & bitmap_policy::LAYER_BITS;
+    const bitmap_t bin_bitmap = bitmap_policy::bin(bin_bitmap_idx) /* special */;
+
+    /* Otherwise checking, are we need to do anything? */
+    if( bin < cur_bin ) {
+        if( (m_cell[cur_ref].m_left.m_bitmap & bin_bitmap) == bin_bitmap ) /* special */
+            return;
+    } else {
+        if( (m_cell[cur_ref].m_right.m_bitmap & bin_bitmap) == bin_bitmap ) /* special */
+            return;
+    }
+
+    /* Get the pre-bin */
+    bin_t pre_bin = bin.parent();   /* OPTIMIZE IT! */
+    while( pre_bin.layer_bits() <= bitmap_policy::LAYER_BITS )
+        pre_bin = pre_bin.parent();
+
+    /* Continue to trace -- unpack the tree if needed */
+    while( cur_bin != pre_bin ) {
+        if( pre_bin < cur_bin ) {
+            cur_ref = unpack_left_half(cur_ref);
+            cur_bin.to_left();
+        } else {
+            cur_ref = unpack_right_half(cur_ref);
+            cur_bin.to_right();
+        }
+
+        if( cur_ref == ROOT_REF ) {
+            pack_cells(trace_ref - 1);
+            recount_trace(_trace_ref, trace_ref, bin);
+            return; /* UNPACK HALF ERROR */
+        }
+
+        *trace_ref++ = cur_ref;
+    }
+
+    assert( cur_bin == pre_bin );
+    assert( cur_bin.layer_bits() > bitmap_policy::LAYER_BITS );
+
+    /* Complete setting */
+    if( bin < cur_bin )
+        m_cell[cur_ref].m_left.m_bitmap |= bin_bitmap; /* special */
+    else
+        m_cell[cur_ref].m_right.m_bitmap |= bin_bitmap; /* special */
+
+    pack_cells(trace_ref - 1); /* FIXME: Some times this step is unnecessary */
+    recount_trace(_trace_ref, trace_ref, bin);
+}
+
+
+/**
+ * Resets bins
+ *
+ * @param bin
+ *             the bin
+ */
+template <class traits>
+void basic_binmap_t<traits>::reset(bin_t bin) {
+    if( bin.is_none() )
+        return;
+
+    /* Extending binmap if needed */
+    while( !m_root_bin.contains(bin) )
+        extend_root();
+
+    /* Store the trace history */
+    ref_t _trace_ref[64];
+    ref_t * trace_ref = _trace_ref;
+
+    /* Process first stage -- do not touch existed tree */
+    ref_t cur_ref = ROOT_REF;
+    bin_t cur_bin = m_root_bin;
+
+    *trace_ref++ = ROOT_REF;
+    while( cur_bin != bin ) {
+        if( bin < cur_bin ) {
+            if( is_left_ref(cur_ref) ) {
+                cur_ref = m_cell[cur_ref].m_left.m_ref;
+                cur_bin.to_left();
+            } else
+                break;
+        } else {
+            if( is_right_ref(cur_ref) ) {
+               cur_ref = m_cell[cur_ref].m_right.m_ref;
+               cur_bin.to_right();
+            } else
+                break;
+        }
+
+        assert( trace_ref < _trace_ref + sizeof(_trace_ref) / sizeof(_trace_ref[0]) );
+        *trace_ref++ = cur_ref;
+    }
+
+    assert( cur_bin.layer_bits() > bitmap_policy::LAYER_BITS );
+
+    /* If the bin cell was found */
+    if( cur_bin == bin ) {  /* special */
+        if( is_left_ref(cur_ref) )
+            free_cell(m_cell[cur_ref].m_left.m_ref);
+        if( is_right_ref(cur_ref) )
+            free_cell(m_cell[cur_ref].m_right.m_ref);
+
+        set_left_ref(cur_ref, false);
+        set_right_ref(cur_ref, false);
+
+        m_cell[cur_ref].m_left.m_bitmap = bitmap_policy::EMPTY;
+        m_cell[cur_ref].m_right.m_bitmap = bitmap_policy::EMPTY;
+
+        pack_cells(trace_ref - 1);
+        recount_trace(_trace_ref, trace_ref, bin);
+
+        return;
+    }
+
+    /* Process second stage */
+
+    /* Gets the bin bitmap type */
+    const unsigned int bin_bitmap_idx = bin.toUInt() & bitmap_policy::LAYER_BITS;
+    const bitmap_t bin_bitmap = bitmap_policy::bin(bin_bitmap_idx) /* special */;
+
+    /* Otherwise checking, are we need to do anything? */
+    if( bin < cur_bin ) {
+        if( (m_cell[cur_ref].m_left.m_bitmap & bin_bitmap) == bitmap_policy::EMPTY ) /* special */
+            return;
+    } else {
+        if( (m_cell[cur_ref].m_right.m_bitmap & bin_bitmap) == bitmap_policy::EMPTY ) /* special */
+            return;
+    }
+
+    /* Get the pre-bin */
+    bin_t pre_bin = bin.parent();   /* OPTIMIZE IT! */
+    while( pre_bin.layer_bits() <= bitmap_policy::LAYER_BITS )
+        pre_bin = pre_bin.parent();
+
+    /* Continue to trace -- unpack the tree if needed */
+    while( cur_bin != pre_bin ) {
+        if( pre_bin < cur_bin ) {
+            cur_ref = unpack_left_half(cur_ref);
+            cur_bin.to_left();
+        } else {
+            cur_ref = unpack_right_half(cur_ref);
+            cur_bin.to_right();
+        }
+
+        if( cur_ref == ROOT_REF ) {
+            pack_cells(trace_ref - 1);
+            recount_trace(_trace_ref, trace_ref, bin);
+            return; /* UNPACK HALF ERROR */
+        }
+
+        *trace_ref++ = cur_ref;
+    }
+
+    assert( cur_bin == pre_bin );
+    assert( cur_bin.layer_bits() > bitmap_policy::LAYER_BITS );
+
+    /* Complete setting */
+    if( bin < cur_bin )
+        m_cell[cur_ref].m_left.m_bitmap &= ~bin_bitmap; /* special */
+    else
+        m_cell[cur_ref].m_right.m_bitmap &= ~bin_bitmap; /* special */
+
+    pack_cells(trace_ref - 1); /* FIXME: Some times this step is unnecessary */
+    recount_trace(_trace_ref, trace_ref, bin);
+}
+
+
+/**
+ * Base offsets of the items
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::item_begin(const bin_t & bin) {
+    return bin.base_offset();
+}
+
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::item_end(const bin_t & bin) {
+    return bin.base_offset() + bin.base_length();
+}
+
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::item_begin(const extent_t & extent) {
+    return extent.m_offset;
+}
+
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::item_end(const extent_t & extent) {
+    return extent.m_offset + extent.m_length;
+}
+
+
+/**
+ * Fill or clear the base bins of the sorted items under the cell
+ *
+ * The items are sorted by their base offsets. Only the cells on the
+ * boundaries of the items are visited: covered halves are replaced by
+ * the value as a whole, and the cells which become uniform are packed
+ * on the way back, once per cell.
+ */
+template <class traits>
+template <class item_t>
+void basic_binmap_t<traits>::update_items(ref_t ref, bin_t bin, const item_t * first, const item_t * last, bitmap_t value) {
+    const uint_t mid = bin.right().base_offset();
+
+    /* Split the items between the halves */
+    const item_t * left_last = first;
+    while( left_last != last && item_begin(*left_last) < mid )
+        ++left_last;
+
+    const item_t * right_first = first;
+    while( right_first != last && item_end(*right_first) <= mid )
+        ++right_first;
+
+    for(int right = 0; right < 2; ++right) {
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t lo = half_bin.base_offset();
+        const uint_t hi = lo + half_bin.base_length();
+
+        const item_t * half_first = right ? right_first : first;
+        const item_t * half_last = right ? last : left_last;
+
+        while( half_first != half_last && item_end(*half_first) <= lo )
+            ++half_first;
+        while( half_first != half_last && hi <= item_begin(half_last[-1]) )
+            --half_last;
+
+        if( half_first == half_last )
+            continue;
+
+        /* Check whether the half is covered by an item */
+        bool is_covered = false;
+        for(const item_t * item = half_first; item != half_last && !is_covered; ++item)
+            is_covered = item_begin(*item) <= lo && hi <= item_end(*item);
+
+        const bool is_ref = is_half_ref(ref, right);
+
+        if( is_covered ) {
+            if( right ) {
+                if( is_ref )
+                    free_cell(m_cell[ref].m_right.m_ref);
+                set_right_ref(ref, false);
+                m_cell[ref].m_right.m_bitmap = value;
+            } else {
+                if( is_ref )
+                    free_cell(m_cell[ref].m_left.m_ref);
+                set_left_ref(ref, false);
+                m_cell[ref].m_left.m_bitmap = value;
+            }
+            continue;
+        }
+
+        /* The half is a bitmap of base bins */
+        if( half_bin.layer_bits() == bitmap_policy::LAYER_BITS ) {
+            bitmap_t mask = bitmap_policy::EMPTY;
+
+            for(const item_t * item = half_first; item != half_last; ++item) {
+                const uint_t begin = item_begin(*item);
+                const uint_t end = item_end(*item);
+
+                if( begin < hi && lo < end )
+                    mask |= bitmap_policy::range((begin > lo ? begin : lo) - lo, (end < hi ? end : hi) - lo);
+            }
+
+            half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+            half.m_bitmap = (half.m_bitmap & ~mask) | (value & mask);
+            continue;
+        }
+
+        /* Continue to trace -- unpack the tree if needed */
+        ref_t child_ref;
+
+        if( is_ref ) {
+            child_ref = right ? m_cell[ref].m_right.m_ref : m_cell[ref].m_left.m_ref;
+        } else {
+            if( (right ? m_cell[ref].m_right.m_bitmap : m_cell[ref].m_left.m_bitmap) == value )
+                continue;
+
+            child_ref = right ? unpack_right_half(ref) : unpack_left_half(ref);
+            if( child_ref == ROOT_REF ) {
+                recount_cell(ref, bin);
+                return; /* UNPACK HALF ERROR */
+            }
+        }
+
+        update_items(child_ref, half_bin, half_first, half_last, value);
+
+        /* Pack the child cell */
+        if( is_left_ref(child_ref) || is_right_ref(child_ref) )
+            continue;
+        if( m_cell[child_ref].m_left.m_bitmap != m_cell[child_ref].m_right.m_bitmap )
+            continue;
+
+        const bitmap_t bitmap = m_cell[child_ref].m_left.m_bitmap;
+
+        free_cell(child_ref);
+
+        if( right ) {
+            set_right_ref(ref, false);
+            m_cell[ref].m_right.m_bitmap = bitmap;
+        } else {
+            set_left_ref(ref, false);
+            m_cell[ref].m_left.m_bitmap = bitmap;
+        }
+    }
+
+    recount_cell(ref, bin);
+}
+
+
+/**
+ * Set or reset the sorted items in a single pass
+ */
+template <class traits>
+template <class item_t>
+void basic_binmap_t<traits>::update_items(const item_t * items, size_t count, bitmap_t value) {
+    if( count == 0 )
+        return;
+
+    /* Extending binmap if needed */
+    if( value == bitmap_policy::FILLED ) {
+        uint_t end = 0;
+        for(size_t i = 0; i < count; ++i) {
+            if( end < item_end(items[i]) )
+                end = item_end(items[i]);
+        }
+
+        while( m_root_bin.base_offset() + m_root_bin.base_length() < end && !m_root_bin.is_all() )
+            extend_root();
+    }
+
+    update_items(ROOT_REF, m_root_bin, items, items + count, value);
+}
+
+
+/**
+ * Check the base bins [begin, end) under the cell for the value
+ */
+template <class traits>
+bool basic_binmap_t<traits>::check_range(ref_t ref, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const {
+    for(int right = 0; right < 2; ++right) {
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t lo = half_bin.base_offset();
+        const uint_t hi = lo + half_bin.base_length();
+
+        if( end <= lo || hi <= begin )
+            continue;
+
+        const half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+        if( !is_half_ref(ref, right) ) {
+            if( !check_half_range(half.m_bitmap, half_bin, begin, end, value) )
+                return false;
+
+        } else {
+            /* Referenced subtrees are never uniform */
+            if( begin <= lo && hi <= end )
+                return false;
+
+            if( !check_range(half.m_ref, half_bin, begin, end, value) )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * Check the base bins [begin, end) under a packed half for the value
+ *
+ * A packed half above the leaf layer stands for a subtree with all the
+ * bitmaps equal to its bitmap.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::check_half_range(bitmap_t bitmap, bin_t bin, uint_t begin, uint_t end, bitmap_t value) {
+    const uint_t lo = bin.base_offset();
+    const uint_t hi = lo + bin.base_length();
+
+    if( end <= lo || hi <= begin || bitmap == value )
+        return true;
+
+    if( bin.layer_bits() == bitmap_policy::LAYER_BITS ) {
+        const bitmap_t mask = bitmap_policy::range((begin > lo ? begin : lo) - lo, (end < hi ? end : hi) - lo);
+        return (bitmap & mask) == (value & mask);
+    }
+
+    if( begin <= lo && hi <= end )
+        return false;
+
+    return check_half_range(bitmap, bin.left(), begin, end, value) && check_half_range(bitmap, bin.right(), begin, end, value);
+}
+
+
+/**
+ * Set the base bins [begin, end) in a single pass
+ *
+ * @param begin
+ *             the first base offset
+ * @param end
+ *             the base offset after the last one
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_range(uint_t begin, uint_t end) {
+    if( begin >= end )
+        return;
+
+    const extent_t extent = { begin, end - begin };
+    update_items(&extent, 1, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Reset the base bins [begin, end) in a single pass
+ *
+ * @param begin
+ *             the first base offset
+ * @param end
+ *             the base offset after the last one
+ */
+template <class traits>
+void basic_binmap_t<traits>::reset_range(uint_t begin, uint_t end) {
+    if( begin >= end )
+        return;
+
+    const extent_t extent = { begin, end - begin };
+    update_items(&extent, 1, bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Set a sorted array of bins
+ *
+ * @param bins
+ *             the bins sorted by base offsets
+ * @param count
+ *             the number of bins
+ */
+template <class traits>
+void basic_binmap_t<traits>::set(const bin_t * bins, size_t count) {
+    update_items(bins, count, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Set a sorted array of extents
+ *
+ * @param extents
+ *             the extents sorted by base offsets
+ * @param count
+ *             the number of extents
+ */
+template <class traits>
+void basic_binmap_t<traits>::set(const extent_t * extents, size_t count) {
+    update_items(extents, count, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Reset a sorted array of bins
+ *
+ * @param bins
+ *             the bins sorted by base offsets
+ * @param count
+ *             the number of bins
+ */
+template <class traits>
+void basic_binmap_t<traits>::reset(const bin_t * bins, size_t count) {
+    update_items(bins, count, bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Reset a sorted array of extents
+ *
+ * @param extents
+ *             the extents sorted by base offsets
+ * @param count
+ *             the number of extents
+ */
+template <class traits>
+void basic_binmap_t<traits>::reset(const extent_t * extents, size_t count) {
+    update_items(extents, count, bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Subtree built by a thread
+ */
+template <class traits>
+struct basic_binmap_t<traits>::build_task_t {
+    basic_binmap_t * m_binmap;
+    bin_t m_bin;
+    half_t m_half;
+    bool m_is_ref;
+};
+
+
+/**
+ * Thread building the subtrees in its own binmap
+ */
+template <class traits>
+struct basic_binmap_t<traits>::build_worker_t {
+    basic_binmap_t * m_binmap;
+    build_task_t * m_tasks;
+    size_t m_tasks_number;
+    size_t m_first;
+    size_t m_step;
+    const unsigned char * m_bitmap;
+    uint_t m_bits;
+};
+
+
+/**
+ * Join two halves to the half of their parent bin
+ *
+ * Equal packed halves are packed to the parent half, so no cell is
+ * allocated that would be packed away later.
+ *
+ * @return whether the joint half is a reference
+ */
+template <class traits>
+bool basic_binmap_t<traits>::join_halves(half_t & half, bin_t bin, const half_t & left, bool is_left_ref, const half_t & right, bool is_right_ref) {
+    if( !is_left_ref && !is_right_ref && left.m_bitmap == right.m_bitmap ) {
+        half.m_bitmap = left.m_bitmap;
+        return false;
+    }
+
+    const ref_t ref = alloc_cell();
+    if( ref == ROOT_REF ) {
+        if( is_left_ref )
+            free_cell(left.m_ref);
+        if( is_right_ref )
+            free_cell(right.m_ref);
+
+        half.m_bitmap = bitmap_policy::EMPTY;
+        return false /* ALLOC ERROR */;
+    }
+
+    set_left_ref(ref, is_left_ref);
+    set_right_ref(ref, is_right_ref);
+    m_cell[ref].m_left = left;
+    m_cell[ref].m_right = right;
+
+    recount_cell(ref, bin);
+
+    half.m_ref = ref;
+    return true;
+}
+
+
+/**
+ * Build the half of the bin bottom-up from the bitmap
+ *
+ * The leaf halves are loaded from whole words of the bitmap, the halves
+ * beyond the bitmap are empty.
+ *
+ * @return whether the half is a reference
+ */
+template <class traits>
+bool basic_binmap_t<traits>::build_half(half_t & half, bin_t bin, const unsigned char * bitmap, uint_t bits) {
+    const uint_t lo = bin.base_offset();
+
+    if( lo >= bits ) {
+        half.m_bitmap = bitmap_policy::EMPTY;
+        return false;
+    }
+
+    if( bin.layer_bits() == bitmap_policy::LAYER_BITS ) {
+        if( bits - lo >= bin.base_length() ) {
+            half.m_bitmap = bitmap_policy::load(bitmap + lo / 8);
+
+        } else {
+            /* The tail of the bitmap */
+            unsigned char tail[sizeof(bitmap_t)];
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, bitmap + lo / 8, (bits - lo + 7) / 8);
+            if( bits & 7 )
+                tail[(bits - lo) / 8] &= static_cast<unsigned char>((1U << (bits & 7)) - 1);
+
+            half.m_bitmap = bitmap_policy::load(tail);
+        }
+
+        return false;
+    }
+
+    half_t left;
+    half_t right;
+
+    const bool is_left_ref = build_half(left, bin.left(), bitmap, bits);
+    const bool is_right_ref = build_half(right, bin.right(), bitmap, bits);
+
+    return join_halves(half, bin, left, is_left_ref, right, is_right_ref);
+}
+
+
+/**
+ * Build the half of the bin from the subtrees built by threads
+ *
+ * The tasks are the sub-bins of the bin, left to right.
+ *
+ * @return whether the half is a reference
+ */
+template <class traits>
+bool basic_binmap_t<traits>::stitch_half(half_t & half, bin_t bin, const build_task_t * tasks, size_t count) {
+    if( count == 1 ) {
+        if( !tasks->m_is_ref ) {
+            half.m_bitmap = tasks->m_half.m_bitmap;
+            return false;
+        }
+
+        half.m_ref = copy_cells(*tasks->m_binmap, tasks->m_half.m_ref, bin);
+        if( half.m_ref == ROOT_REF ) {
+            half.m_bitmap = bitmap_policy::EMPTY;
+            return false /* ALLOC ERROR */;
+        }
+
+        return true;
+    }
+
+    half_t left;
+    half_t right;
+
+    const bool is_left_ref = stitch_half(left, bin.left(), tasks, count / 2);
+    const bool is_right_ref = stitch_half(right, bin.right(), tasks + count / 2, count - count / 2);
+
+    return join_halves(half, bin, left, is_left_ref, right, is_right_ref);
+}
+
+
+/**
+ * Copy the subtree of the cell from another binmap
+ */
+template <class traits>
+typename basic_binmap_t<traits>::ref_t basic_binmap_t<traits>::copy_cells(const basic_binmap_t & source, ref_t source_ref, bin_t bin) {
+    const ref_t ref = alloc_cell();
+    if( ref == ROOT_REF )
+        return ROOT_REF /* ALLOC ERROR */;
+
+    copy_cell(ref, source, source_ref);
+
+    if( source.is_left_ref(source_ref) ) {
+        const ref_t left_ref = copy_cells(source, source.m_cell[source_ref].m_left.m_ref, bin.left());
+        if( left_ref == ROOT_REF ) {
+            set_left_ref(ref, false);
+            m_cell[ref].m_left.m_bitmap = bitmap_policy::EMPTY;
+        } else
+            m_cell[ref].m_left.m_ref = left_ref;
+    }
+
+    if( source.is_right_ref(source_ref) ) {
+        const ref_t right_ref = copy_cells(source, source.m_cell[source_ref].m_right.m_ref, bin.right());
+        if( right_ref == ROOT_REF ) {
+            set_right_ref(ref, false);
+            m_cell[ref].m_right.m_bitmap = bitmap_policy::EMPTY;
+        } else
+            m_cell[ref].m_right.m_ref = right_ref;
+    }
+
+    recount_cell(ref, bin);
+
+    return ref;
+}
+
+
+/**
+ * Build the subtrees of a thread
+ */
+template <class traits>
+void basic_binmap_t<traits>::build_worker(void * arg) {
+    const build_worker_t * const worker = static_cast<const build_worker_t *>(arg);
+
+    for(size_t i = worker->m_first; i < worker->m_tasks_number; i += worker->m_step) {
+        build_task_t & task = worker->m_tasks[i];
+
+        task.m_binmap = worker->m_binmap;
+        task.m_is_ref = worker->m_binmap->build_half(task.m_half, task.m_bin, worker->m_bitmap, worker->m_bits);
+    }
+}
+
+
+/**
+ * Assign the bitmap of the base bins [0, bits)
+ *
+ * The tree is built bottom-up from whole bitmap words: uniform runs
+ * become packed halves directly, and the cells are allocated only for
+ * the halves that differ. With several threads the subtrees under the
+ * root are built in separate binmaps in parallel and then stitched
+ * into this one.
+ */
+template <class traits>
+void basic_binmap_t<traits>::assign_from_bitmap(const void * bitmap, size_t bits, int threads) {
+    clear();
+
+    /* Check for the bin capacity */
+    const uint_t max_bits = bin_t::ALL.base_length();
+    if( bits > max_bits ) {
+        fprintf(stderr, "Warning: binmap_t::assign_from_bitmap: BITMAP IS TRUNCATED\n");
+        bits = max_bits;
+    }
+
+    const uint_t nbits = static_cast<uint_t>(bits);
+    const unsigned char * const data = static_cast<const unsigned char *>(bitmap);
+
+    while( m_root_bin.base_length() < nbits )
+        m_root_bin.to_parent();
+
+    /* Split the root into the tasks */
+    size_t tasks_number = 2;
+    bin_t task_bin = m_root_bin.left();
+
+    if( threads > MAX_THREADS )
+        threads = MAX_THREADS;
+
+    while( threads > 1 && tasks_number < 4 * static_cast<size_t>(threads) && task_bin.layer_bits() > bitmap_policy::LAYER_BITS ) {
+        tasks_number *= 2;
+        task_bin.to_left();
+    }
+
+    build_task_t * const tasks = (threads > 1 && tasks_number > 2) ? static_cast<build_task_t *>(malloc(tasks_number * sizeof(build_task_t))) : NULL;
+    basic_binmap_t * const binmaps = tasks ? new basic_binmap_t[threads] : NULL;
+
+    if( binmaps == NULL ) {
+        /* Single-threaded build */
+        free(tasks);
+
+        half_t left;
+        half_t right;
+
+        const bool is_left_ref = build_half(left, m_root_bin.left(), data, nbits);
+        const bool is_right_ref = build_half(right, m_root_bin.right(), data, nbits);
+
+        set_left_ref(ROOT_REF, is_left_ref);
+        set_right_ref(ROOT_REF, is_right_ref);
+        m_cell[ROOT_REF].m_left = left;
+        m_cell[ROOT_REF].m_right = right;
+
+        recount_cell(ROOT_REF, m_root_bin);
+
+        return;
+    }
+
+    for(size_t i = 0; i < tasks_number; ++i) {
+        tasks[i].m_bin = task_bin;
+        task_bin = bin_t(task_bin.toUInt() + task_bin.layer_bits() + 1);
+    }
+
+    /* Build the subtrees in parallel */
+    build_worker_t workers[MAX_THREADS];
+    thread_job_t jobs[MAX_THREADS];
+
+    for(int i = 0; i < threads; ++i) {
+        workers[i].m_binmap = &binmaps[i];
+        workers[i].m_tasks = tasks;
+        workers[i].m_tasks_number = tasks_number;
+        workers[i].m_first = i;
+        workers[i].m_step = threads;
+        workers[i].m_bitmap = data;
+        workers[i].m_bits = nbits;
+
+        jobs[i].m_run = build_worker;
+        jobs[i].m_arg = &workers[i];
+    }
+
+    run_jobs(jobs, threads);
+
+    /* Stitch the subtrees */
+    half_t left;
+    half_t right;
+
+    const bool is_left_ref = stitch_half(left, m_root_bin.left(), tasks, tasks_number / 2);
+    const bool is_right_ref = stitch_half(right, m_root_bin.right(), tasks + tasks_number / 2, tasks_number / 2);
+
+    set_left_ref(ROOT_REF, is_left_ref);
+    set_right_ref(ROOT_REF, is_right_ref);
+    m_cell[ROOT_REF].m_left = left;
+    m_cell[ROOT_REF].m_right = right;
+
+    recount_cell(ROOT_REF, m_root_bin);
+
+    delete [] binmaps;
+    free(tasks);
+}
+
+
+/**
+ * Copy the base bins [offset, offset + length) of a packed half to a bitmap
+ *
+ * The half repeats its bitmap over all its base bins. The offset is
+ * the offset within the half, it is aligned to the length.
+ */
+template <class traits>
+void basic_binmap_t<traits>::copy_half_to_bitmap(bitmap_t bitmap, uint_t offset, uint_t length, unsigned char * out) {
+    const uint_t bitmap_bits = 8 * sizeof(bitmap_t);
+
+    if( length >= bitmap_bits ) {
+        if( bitmap == bitmap_policy::EMPTY || bitmap == bitmap_policy::FILLED ) {
+            memset(out, (bitmap == bitmap_policy::EMPTY) ? 0x00 : 0xff, length / 8);
+            return;
+        }
+
+        for(uint_t i = 0; i < length; i += bitmap_bits, out += sizeof(bitmap_t))
+            bitmap_policy::store(bitmap, out);
+
+        return;
+    }
+
+    unsigned char buf[sizeof(bitmap_t)];
+    bitmap_policy::store(bitmap, buf);
+
+    offset %= bitmap_bits;
+
+    if( length >= 8 )
+        memcpy(out, buf + offset / 8, length / 8);
+    else
+        out[0] = static_cast<unsigned char>((buf[offset / 8] >> (offset % 8)) & ((1U << length) - 1));
+}
+
+
+/**
+ * Copy the base bins of the cell to a bitmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::copy_cell_to_bitmap(ref_t ref, bin_t bin, unsigned char * out) const {
+    const uint_t half_length = bin.base_length() / 2;
+
+    if( is_left_ref(ref) )
+        copy_cell_to_bitmap(m_cell[ref].m_left.m_ref, bin.left(), out);
+    else
+        copy_half_to_bitmap(m_cell[ref].m_left.m_bitmap, 0, half_length, out);
+
+    out += half_length / 8;
+
+    if( is_right_ref(ref) )
+        copy_cell_to_bitmap(m_cell[ref].m_right.m_ref, bin.right(), out);
+    else
+        copy_half_to_bitmap(m_cell[ref].m_right.m_bitmap, 0, half_length, out);
+}
+
+
+/**
+ * Copy the base bins of the range to a bitmap
+ *
+ * The tree is walked once: uniform halves are memset, leaf halves
+ * are copied as whole words.
+ */
+template <class traits>
+void basic_binmap_t<traits>::to_bitmap(bin_t range, void * bitmap) const {
+    if( range.is_none() )
+        return;
+
+    unsigned char * const out = static_cast<unsigned char *>(bitmap);
+
+    if( range.contains(m_root_bin) ) {
+        /* The bins beyond the root are empty */
+        const uint_t root_bytes = m_root_bin.base_length() / 8;
+        memset(out + root_bytes, 0, range.base_length() / 8 - root_bytes);
+
+        copy_cell_to_bitmap(ROOT_REF, m_root_bin, out);
+        return;
+    }
+
+    if( !m_root_bin.contains(range) ) {
+        memset(out, 0, (range.base_length() + 7) / 8);
+        return;
+    }
+
+    /* Trace the range */
+    ref_t ref = ROOT_REF;
+    bin_t bin = m_root_bin;
+
+    for( ;; ) {
+        const bin_t half_bin = (range < bin) ? bin.left() : bin.right();
+        const bool is_ref = (range < bin) ? is_left_ref(ref) : is_right_ref(ref);
+        const half_t & half = (range < bin) ? m_cell[ref].m_left : m_cell[ref].m_right;
+
+        if( !is_ref ) {
+            copy_half_to_bitmap(half.m_bitmap, range.base_offset() - half_bin.base_offset(), range.base_length(), out);
+            return;
+        }
+
+        if( half_bin == range ) {
+            copy_cell_to_bitmap(half.m_ref, half_bin, out);
+            return;
+        }
+
+        ref = half.m_ref;
+        bin = half_bin;
+    }
+}
+
+
+/**
+ * Reset all bins
+ */
+template <class traits>
+void basic_binmap_t<traits>::clear() {
+    if( is_left_ref(ROOT_REF) )
+        free_cell(m_cell[ROOT_REF].m_left.m_ref);
+    if( is_right_ref(ROOT_REF) )
+        free_cell(m_cell[ROOT_REF].m_right.m_ref);
+
+    set_left_ref(ROOT_REF, false);
+    set_right_ref(ROOT_REF, false);
+    m_cell[ROOT_REF].m_left.m_bitmap = bitmap_policy::EMPTY;
+    m_cell[ROOT_REF].m_right.m_bitmap = bitmap_policy::EMPTY;
+
+    m_root_bin = bin_t(bitmap_policy::LAYER_BITS);
+
+    recount_cell(ROOT_REF, m_root_bin);
+}
+
+
+/**
+ * Copy the bins of another binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::copy_from(const basic_binmap_t & source) {
+    assert( &source != this );
+
+    clear();
+
+    m_root_bin = source.m_root_bin;
+    copy_cell(ROOT_REF, source, ROOT_REF);
+
+    if( source.is_left_ref(ROOT_REF) ) {
+        const ref_t left_ref = copy_cells(source, source.m_cell[ROOT_REF].m_left.m_ref, m_root_bin.left());
+        if( left_ref == ROOT_REF ) {
+            set_left_ref(ROOT_REF, false);
+            m_cell[ROOT_REF].m_left.m_bitmap = bitmap_policy::EMPTY;
+        } else
+            m_cell[ROOT_REF].m_left.m_ref = left_ref;
+    }
+
+    if( source.is_right_ref(ROOT_REF) ) {
+        const ref_t right_ref = copy_cells(source, source.m_cell[ROOT_REF].m_right.m_ref, m_root_bin.right());
+        if( right_ref == ROOT_REF ) {
+            set_right_ref(ROOT_REF, false);
+            m_cell[ROOT_REF].m_right.m_bitmap = bitmap_policy::EMPTY;
+        } else
+            m_cell[ROOT_REF].m_right.m_ref = right_ref;
+    }
+
+    recount_cell(ROOT_REF, m_root_bin);
+}
+
+
+/**
+ * Apply the set operation to two bitmaps
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bitmap_t basic_binmap_t<traits>::apply_op(bitmap_t a, bitmap_t b, int op) {
+    switch( op ) {
+    case OP_UNION:
+        return a | b;
+    case OP_INTERSECTION:
+        return a & b;
+    case OP_DIFFERENCE:
+        return a & ~b;
+    default:
+        return a ^ b;
+    }
+}
+
+
+/**
+ * Set a half of the cell
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_half(ref_t ref, bool right, const half_t & half, bool is_ref) {
+    if( right ) {
+        set_right_ref(ref, is_ref);
+        m_cell[ref].m_right = half;
+    } else {
+        set_left_ref(ref, is_ref);
+        m_cell[ref].m_left = half;
+    }
+}
+
+
+/**
+ * Pack the half of the cell if its cell has equal bitmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::pack_half(ref_t ref, bool right) {
+    if( !is_half_ref(ref, right) )
+        return;
+
+    const ref_t child_ref = right ? m_cell[ref].m_right.m_ref : m_cell[ref].m_left.m_ref;
+
+    if( is_left_ref(child_ref) || is_right_ref(child_ref) )
+        return;
+    if( m_cell[child_ref].m_left.m_bitmap != m_cell[child_ref].m_right.m_bitmap )
+        return;
+
+    half_t half;
+    half.m_bitmap = m_cell[child_ref].m_left.m_bitmap;
+
+    free_cell(child_ref);
+    set_half(ref, right, half, false);
+}
+
+
+/**
+ * Apply the set operation with a packed half of the other binmap
+ * to all the halves under the cell
+ */
+template <class traits>
+void basic_binmap_t<traits>::apply_bitmap(ref_t ref, bin_t bin, bitmap_t bitmap, int op) {
+    if( is_left_ref(ref) ) {
+        apply_bitmap(m_cell[ref].m_left.m_ref, bin.left(), bitmap, op);
+        pack_half(ref, false);
+    } else
+        m_cell[ref].m_left.m_bitmap = apply_op(m_cell[ref].m_left.m_bitmap, bitmap, op);
+
+    if( is_right_ref(ref) ) {
+        apply_bitmap(m_cell[ref].m_right.m_ref, bin.right(), bitmap, op);
+        pack_half(ref, true);
+    } else
+        m_cell[ref].m_right.m_bitmap = apply_op(m_cell[ref].m_right.m_bitmap, bitmap, op);
+
+    recount_cell(ref, bin);
+}
+
+
+/**
+ * Apply the set operation with a half of the other binmap to a half of the cell
+ *
+ * Uniform halves on either side short-circuit without descending:
+ * the half is kept, cleared, filled or copied from the other binmap.
+ */
+template <class traits>
+void basic_binmap_t<traits>::combine_half(ref_t ref, bool right, bin_t half_bin, const basic_binmap_t & other, half_t other_half, bool other_is_ref, int op) {
+    const bool is_ref = is_half_ref(ref, right);
+    half_t half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+    if( !other_is_ref ) {
+        const bitmap_t bitmap = other_half.m_bitmap;
+
+        if( !is_ref ) {
+            half.m_bitmap = apply_op(half.m_bitmap, bitmap, op);
+            set_half(ref, right, half, false);
+            return;
+        }
+
+        /* The subtree is kept */
+        if( (bitmap == bitmap_policy::EMPTY && op != OP_INTERSECTION) || (bitmap == bitmap_policy::FILLED && op == OP_INTERSECTION) )
+            return;
+
+        /* The subtree becomes uniform */
+        if( (bitmap == bitmap_policy::FILLED && (op == OP_UNION || op == OP_DIFFERENCE)) || (bitmap == bitmap_policy::EMPTY && op == OP_INTERSECTION) ) {
+            free_cell(half.m_ref);
+            half.m_bitmap = apply_op(bitmap_policy::EMPTY, bitmap, op);
+            set_half(ref, right, half, false);
+            return;
+        }
+
+        apply_bitmap(half.m_ref, half_bin, bitmap, op);
+
+    } else {
+        if( !is_ref ) {
+            const bitmap_t bitmap = half.m_bitmap;
+
+            /* The half is kept */
+            if( (bitmap == bitmap_policy::FILLED && op == OP_UNION) || (bitmap == bitmap_policy::EMPTY && (op == OP_INTERSECTION || op == OP_DIFFERENCE)) )
+                return;
+
+            /* The half becomes the other subtree */
+            if( (bitmap == bitmap_policy::EMPTY && (op == OP_UNION || op == OP_XOR)) || (bitmap == bitmap_policy::FILLED && op == OP_INTERSECTION) ) {
+                half.m_ref = copy_cells(other, other_half.m_ref, half_bin);
+                if( half.m_ref != ROOT_REF )
+                    set_half(ref, right, half, true);
+                return;
+            }
+
+            half.m_ref = right ? unpack_right_half(ref) : unpack_left_half(ref);
+            if( half.m_ref == ROOT_REF )
+                return /* ALLOC ERROR */;
+        }
+
+        combine_cell(half.m_ref, half_bin, other, other_half.m_ref, op);
+    }
+
+    pack_half(ref, right);
+}
+
+
+/**
+ * Apply the set operation with a cell of the other binmap to the cell
+ */
+template <class traits>
+void basic_binmap_t<traits>::combine_cell(ref_t ref, bin_t bin, const basic_binmap_t & other, ref_t other_ref, int op) {
+    combine_half(ref, false, bin.left(), other, other.m_cell[other_ref].m_left, other.is_left_ref(other_ref), op);
+    combine_half(ref, true, bin.right(), other, other.m_cell[other_ref].m_right, other.is_right_ref(other_ref), op);
+
+    recount_cell(ref, bin);
+}
+
+
+/**
+ * Apply the set operation with the other binmap in place
+ *
+ * Both trees are walked at the same time, so the cost is proportional
+ * to the number of cells rather than the number of bins.
+ */
+template <class traits>
+void basic_binmap_t<traits>::combine(const basic_binmap_t & other, int op) {
+    if( &other == this ) {
+        if( op == OP_DIFFERENCE || op == OP_XOR )
+            clear();
+        return;
+    }
+
+    /* Extending binmap if needed */
+    if( op == OP_UNION || op == OP_XOR ) {
+        while( !m_root_bin.contains(other.m_root_bin) ) {
+            const bin_t root_bin = m_root_bin;
+            extend_root();
+            if( m_root_bin == root_bin )
+                return /* ALLOC ERROR */;
+        }
+    }
+
+    if( m_root_bin.contains(other.m_root_bin) ) {
+        if( m_root_bin == other.m_root_bin ) {
+            combine_cell(ROOT_REF, m_root_bin, other, ROOT_REF, op);
+            return;
+        }
+
+        /* Trace the other root, the leftmost sub-bin of the root */
+        ref_t _trace_ref[64];
+        ref_t * trace_ref = _trace_ref;
+
+        ref_t ref = ROOT_REF;
+        bin_t bin = m_root_bin;
+
+        *trace_ref = ROOT_REF;
+
+        while( bin.left() != other.m_root_bin ) {
+            if( !is_left_ref(ref) && unpack_left_half(ref) == ROOT_REF )
+                return /* ALLOC ERROR */;
+
+            ref = m_cell[ref].m_left.m_ref;
+            *++trace_ref = ref;
+            bin.to_left();
+        }
+
+        half_t other_root;
+        other_root.m_ref = ROOT_REF;
+
+        combine_half(ref, false, other.m_root_bin, other, other_root, true, op);
+
+        pack_cells(trace_ref);
+        recount_trace(_trace_ref, trace_ref + 1, other.m_root_bin);
+
+        /* The bins beyond the other root are empty there */
+        if( op == OP_INTERSECTION )
+            reset_range(other.m_root_bin.base_length(), m_root_bin.base_length());
+
+        return;
+    }
+
+    /* Trace the root in the other binmap */
+    ref_t other_ref = ROOT_REF;
+    bin_t other_bin = other.m_root_bin;
+
+    while( other_bin != m_root_bin ) {
+        if( !other.is_left_ref(other_ref) ) {
+            apply_bitmap(ROOT_REF, m_root_bin, other.m_cell[other_ref].m_left.m_bitmap, op);
+            return;
+        }
+
+        other_ref = other.m_cell[other_ref].m_left.m_ref;
+        other_bin.to_left();
+    }
+
+    combine_cell(ROOT_REF, m_root_bin, other, other_ref, op);
+}
+
+
+/**
+ * Assign the result of the set operation with two binmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::combine(const basic_binmap_t & a, const basic_binmap_t & b, int op) {
+    if( &a == this ) {
+        combine(b, op);
+
+    } else if( &b != this ) {
+        copy_from(a);
+        combine(b, op);
+
+    } else if( op != OP_DIFFERENCE ) {
+        combine(a, op);
+
+    } else {
+        basic_binmap_t result;
+        result.copy_from(a);
+        result.combine(b, op);
+        copy_from(result);
+    }
+}
+
+
+/**
+ * Set the bins filled in the other binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_union(const basic_binmap_t & other) {
+    combine(other, OP_UNION);
+}
+
+
+/**
+ * Reset the bins empty in the other binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_intersection(const basic_binmap_t & other) {
+    combine(other, OP_INTERSECTION);
+}
+
+
+/**
+ * Reset the bins filled in the other binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_difference(const basic_binmap_t & other) {
+    combine(other, OP_DIFFERENCE);
+}
+
+
+/**
+ * Flip the bins filled in the other binmap
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_symmetric_difference(const basic_binmap_t & other) {
+    combine(other, OP_XOR);
+}
+
+
+/**
+ * Assign the union of two binmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_union(const basic_binmap_t & a, const basic_binmap_t & b) {
+    combine(a, b, OP_UNION);
+}
+
+
+/**
+ * Assign the intersection of two binmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_intersection(const basic_binmap_t & a, const basic_binmap_t & b) {
+    combine(a, b, OP_INTERSECTION);
+}
+
+
+/**
+ * Assign the difference of two binmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_difference(const basic_binmap_t & a, const basic_binmap_t & b) {
+    combine(a, b, OP_DIFFERENCE);
+}
+
+
+/**
+ * Assign the symmetric difference of two binmaps
+ */
+template <class traits>
+void basic_binmap_t<traits>::set_symmetric_difference(const basic_binmap_t & a, const basic_binmap_t & b) {
+    combine(a, b, OP_XOR);
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are filled
+ */
+template <class traits>
+bool basic_binmap_t<traits>::is_filled_range(uint_t begin, uint_t end) const {
+    if( begin >= end )
+        return true;
+
+    if( m_root_bin.base_offset() + m_root_bin.base_length() < end )
+        return false;
+
+    return check_range(ROOT_REF, m_root_bin, begin, end, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are empty
+ */
+template <class traits>
+bool basic_binmap_t<traits>::is_empty_range(uint_t begin, uint_t end) const {
+    if( begin >= end )
+        return true;
+
+    return check_range(ROOT_REF, m_root_bin, begin, end, bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the k-th (from 0) set bit of the bitmap
+ */
+template <class bitmap_type>
+static unsigned int select_bit(const bitmap_type & bitmap, unsigned int k) {
+    typedef bitmap_traits<bitmap_type> policy;
+
+    unsigned int begin = 0;
+    unsigned int end = 8 * sizeof(bitmap_type);
+
+    while( end - begin > 1 ) {
+        const unsigned int mid = (begin + end) / 2;
+        const unsigned int left = policy::count(bitmap & policy::range(begin, mid));
+
+        if( k < left ) {
+            end = mid;
+        } else {
+            k -= left;
+            begin = mid;
+        }
+    }
+
+    return begin;
+}
+
+
+/**
+ * Get the number of filled base bins of a half
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::half_count(const half_t & half, bool is_ref, bin_t bin) const {
+    if( is_ref )
+        return cell_count(half.m_ref, bin);
+
+    return static_cast<uint_t>(bitmap_policy::count(half.m_bitmap)) * (bin.base_length() / (8 * sizeof(bitmap_t)));
+}
+
+
+/**
+ * Get the number of filled base bins of the cell
+ *
+ * Without the counts the subtree is walked.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::cell_count(ref_t ref, bin_t bin) const {
+    if( m_count != NULL )
+        return m_count[ref];
+
+    return half_count(m_cell[ref].m_left, is_left_ref(ref), bin.left()) + half_count(m_cell[ref].m_right, is_right_ref(ref), bin.right());
+}
+
+
+/**
+ * Recount the filled base bins of the cell from its halves
+ *
+ * The counts of the child cells must be up to date. The operations
+ * changing the tree recount the cells they touched bottom-up before
+ * they return (pack_cells, unpack_*_half and the like leave it to
+ * their callers).
+ */
+template <class traits>
+void basic_binmap_t<traits>::recount_cell(ref_t ref, bin_t bin) {
+    if( m_count == NULL )
+        return;
+
+    m_count[ref] = half_count(m_cell[ref].m_left, is_left_ref(ref), bin.left()) + half_count(m_cell[ref].m_right, is_right_ref(ref), bin.right());
+}
+
+
+/**
+ * Recount the cells of the subtree
+ */
+template <class traits>
+void basic_binmap_t<traits>::recount_cells(ref_t ref, bin_t bin) {
+    if( is_left_ref(ref) )
+        recount_cells(m_cell[ref].m_left.m_ref, bin.left());
+    if( is_right_ref(ref) )
+        recount_cells(m_cell[ref].m_right.m_ref, bin.right());
+
+    recount_cell(ref, bin);
+}
+
+
+/**
+ * Recount the live cells of a trace towards the bin, bottom-up
+ *
+ * The trace starts at the root; the cells packed away are skipped.
+ */
+template <class traits>
+void basic_binmap_t<traits>::recount_trace(const ref_t * first, const ref_t * last, bin_t bin) {
+    if( m_count == NULL )
+        return;
+
+    const size_t depth = last - first;
+    bin_t trace_bin[64];
+
+    trace_bin[0] = m_root_bin;
+    for(size_t i = 1; i < depth; ++i)
+        trace_bin[i] = (bin < trace_bin[i - 1]) ? trace_bin[i - 1].left() : trace_bin[i - 1].right();
+
+    for(size_t i = depth; i-- > 0; ) {
+        if( first[i] == ROOT_REF || !is_free(first[i]) )
+            recount_cell(first[i], trace_bin[i]);
+    }
+}
+
+
+/**
+ * Start maintaining the counts of filled base bins under the cells
+ */
+template <class traits>
+bool basic_binmap_t<traits>::enable_counts() {
+    if( m_count != NULL )
+        return true;
+
+    /* The inline root has one count */
+    const size_t count_size = m_blocks_number ? 16 * m_blocks_number : 1;
+
+    if( !resize_counts(count_size) ) {
+        fprintf(stderr, "Warning: binmap_t::enable_counts: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    recount_cells(ROOT_REF, m_root_bin);
+
+    return true;
+}
+
+
+/**
+ * Stop maintaining the counts
+ */
+template <class traits>
+void basic_binmap_t<traits>::disable_counts() {
+    resize_counts(0);
+}
+
+
+/**
+ * Whether the counts are maintained
+ */
+template <class traits>
+bool basic_binmap_t<traits>::is_counting() const {
+    return m_count != NULL;
+}
+
+
+/**
+ * Get the number of filled base bins
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::count() const {
+    return cell_count(ROOT_REF, m_root_bin);
+}
+
+
+/**
+ * Get the number of filled base bins of the bin
+ *
+ * O(depth) with the counts maintained.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::count(bin_t bin) const {
+    if( bin.is_none() )
+        return 0;
+    if( bin.contains(m_root_bin) )
+        return count();
+    if( !m_root_bin.contains(bin) )
+        return 0;
+
+    ref_t ref = ROOT_REF;
+    bin_t cur_bin = m_root_bin;
+
+    for( ;; ) {
+        const bool right = !(bin < cur_bin);
+        const bool is_ref = is_half_ref(ref, right);
+        const half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+        cur_bin = right ? cur_bin.right() : cur_bin.left();
+
+        if( is_ref ) {
+            if( cur_bin == bin )
+                return cell_count(half.m_ref, bin);
+
+            ref = half.m_ref;
+            continue;
+        }
+
+        /* A packed half repeats its bitmap */
+        const unsigned int bitmap_bits = 8 * sizeof(bitmap_t);
+
+        if( bin.base_length() >= bitmap_bits )
+            return static_cast<uint_t>(bitmap_policy::count(half.m_bitmap)) * (bin.base_length() / bitmap_bits);
+
+        const unsigned int begin = static_cast<unsigned int>(bin.base_offset() % bitmap_bits);
+        return bitmap_policy::count(half.m_bitmap & bitmap_policy::range(begin, begin + static_cast<unsigned int>(bin.base_length())));
+    }
+}
+
+
+/**
+ * Get the number of filled base bins before the base offset
+ *
+ * O(depth) with the counts maintained.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::rank(uint_t offset) const {
+    if( offset >= m_root_bin.base_length() )
+        return count();
+
+    uint_t rank = 0;
+
+    ref_t ref = ROOT_REF;
+    bin_t bin = m_root_bin;
+
+    for( ;; ) {
+        const bool right = offset >= bin.right().base_offset();
+
+        if( right )
+            rank += half_count(m_cell[ref].m_left, is_left_ref(ref), bin.left());
+
+        const bool is_ref = is_half_ref(ref, right);
+        const half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+        bin = right ? bin.right() : bin.left();
+
+        if( is_ref ) {
+            ref = half.m_ref;
+            continue;
+        }
+
+        /* A packed half repeats its bitmap */
+        const unsigned int bitmap_bits = 8 * sizeof(bitmap_t);
+        const uint_t length = offset - bin.base_offset();
+        const unsigned int rest = static_cast<unsigned int>(length % bitmap_bits);
+
+        rank += static_cast<uint_t>(bitmap_policy::count(half.m_bitmap)) * (length / bitmap_bits);
+        if( rest != 0 )
+            rank += bitmap_policy::count(half.m_bitmap & bitmap_policy::range(0, rest));
+
+        return rank;
+    }
+}
+
+
+/**
+ * Get the k-th (from 0) filled or empty base bin
+ *
+ * The bins beyond the root are empty. O(depth) with the counts maintained.
+ *
+ * @return the base bin, or NONE if there are not so many bins
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::select(uint_t k, bool filled) const {
+    const uint_t root_length = m_root_bin.base_length();
+    const uint_t root_count = filled ? count() : root_length - count();
+
+    if( k >= root_count ) {
+        if( filled || k - root_count >= bin_t::ALL.base_length() - root_length )
+            return bin_t::NONE;
+
+        return bin_t(2 * (root_length + (k - root_count)));
+    }
+
+    ref_t ref = ROOT_REF;
+    bin_t bin = m_root_bin;
+
+    for( ;; ) {
+        const bin_t left_bin = bin.left();
+        const uint_t left_filled = half_count(m_cell[ref].m_left, is_left_ref(ref), left_bin);
+        const uint_t left_count = filled ? left_filled : left_bin.base_length() - left_filled;
+
+        const bool right = (k >= left_count);
+        if( right )
+            k -= left_count;
+
+        const bool is_ref = is_half_ref(ref, right);
+        const half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+
+        bin = right ? bin.right() : left_bin;
+
+        if( is_ref ) {
+            ref = half.m_ref;
+            continue;
+        }
+
+        /* A packed half repeats its bitmap */
+        const unsigned int bitmap_bits = 8 * sizeof(bitmap_t);
+        const bitmap_t bitmap = filled ? half.m_bitmap : ~half.m_bitmap;
+        const uint_t per_bitmap = bitmap_policy::count(bitmap);
+
+        const uint_t offset = bin.base_offset() + (k / per_bitmap) * bitmap_bits + select_bit(bitmap, static_cast<unsigned int>(k % per_bitmap));
+
+        return bin_t(2 * offset);
+    }
+}
+
+
+/**
+ * Store the state of the binmap to the header of the file
+ */
+template <class traits>
+void basic_binmap_t<traits>::write_file_header() {
+    file_header_t * const header = static_cast<file_header_t *>(m_file->m_data);
+
+    memcpy(header->m_signature, FILE_SIGNATURE, sizeof(FILE_SIGNATURE));
+    header->m_byte_order = FILE_BYTE_ORDER;
+    header->m_cell_size = sizeof(cell_t);
+    header->m_bin_size = sizeof(uint_t);
+    header->m_ref_size = sizeof(ref_t);
+    header->m_root_bin = m_root_bin.toUInt();
+    header->m_free_top = m_free_top;
+    header->m_blocks_number = m_blocks_number;
+    header->m_cells_number = m_cells_number;
+}
+
+
+/**
+ * Keep the cells in the memory-mapped file
+ *
+ * The counts stay on the heap, they are recounted for an opened file.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::open_file(const char * path) {
+    if( m_file != NULL ) {
+        fprintf(stderr, "Warning: binmap_t::open_file: FILE IS ALREADY OPEN\n");
+        return false /* FILE IS ALREADY OPEN */;
+    }
+
+    /* The file keeps the inline root in a block */
+    if( m_blocks_number == 0 && !extend_blocks(1) ) {
+        fprintf(stderr, "Warning: binmap_t::open_file: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    binmap_file_t * const file = open_mapped_file(path);
+    if( file == NULL ) {
+        fprintf(stderr, "Warning: binmap_t::open_file: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    const size_t cells_size = 16 * m_blocks_number * sizeof(cell_t);
+    const size_t flags_size = m_blocks_number * sizeof(flags_t);
+
+    if( file->m_size == 0 ) {
+        /* The new file receives the current bins */
+        if( !resize_mapped_file(file, FILE_HEADER_SIZE + cells_size + flags_size) ) {
+            close_mapped_file(file);
+            fprintf(stderr, "Warning: binmap_t::open_file: FILE ERROR\n");
+            return false /* FILE ERROR */;
+        }
+
+        memcpy(static_cast<char *>(file->m_data) + FILE_HEADER_SIZE, m_cell, cells_size);
+        memcpy(static_cast<char *>(file->m_data) + FILE_HEADER_SIZE + cells_size, m_flags, flags_size);
+        free_blocks();
+
+    } else {
+        const file_header_t * const header = static_cast<const file_header_t *>(file->m_data);
+
+        /* The root bin starts at the offset 0 and is above the leaf halves */
+        const uint_t root = (file->m_size >= FILE_HEADER_SIZE) ? static_cast<uint_t>(header->m_root_bin) : 0;
+        const bin_t root_bin(root);
+
+        const bool is_valid = file->m_size >= FILE_HEADER_SIZE
+            && memcmp(header->m_signature, FILE_SIGNATURE, sizeof(FILE_SIGNATURE)) == 0
+            && header->m_byte_order == FILE_BYTE_ORDER
+            && header->m_cell_size == sizeof(cell_t)
+            && header->m_bin_size == sizeof(uint_t)
+            && header->m_ref_size == sizeof(ref_t)
+            && header->m_blocks_number > 0
+            && header->m_blocks_number <= (file->m_size - FILE_HEADER_SIZE) / (16 * sizeof(cell_t) + sizeof(flags_t))
+            && header->m_free_top < 16 * header->m_blocks_number
+            && header->m_cells_number <= 16 * header->m_blocks_number
+            && header->m_root_bin == root
+            && !root_bin.is_none()
+            && (root & (root + 1)) == 0
+            && root_bin.layer_bits() > bitmap_policy::LAYER_BITS;
+
+        if( !is_valid ) {
+            close_mapped_file(file);
+            fprintf(stderr, "Warning: binmap_t::open_file: FORMAT ERROR\n");
+            return false /* FORMAT ERROR */;
+        }
+
+        const size_t blocks_number = static_cast<size_t>(header->m_blocks_number);
+
+        if( m_count != NULL && !resize_counts(16 * blocks_number) ) {
+            close_mapped_file(file);
+            fprintf(stderr, "Warning: binmap_t::open_file: MEMORY ERROR\n");
+            return false /* MEMORY ERROR */;
+        }
+
+        free_blocks();
+
+        m_root_bin = root_bin;
+        m_free_top = static_cast<ref_t>(header->m_free_top);
+        m_blocks_number = blocks_number;
+        m_cells_number = static_cast<size_t>(header->m_cells_number);
+    }
+
+    m_file = file;
+    m_arena = NULL;
+    m_cell = reinterpret_cast<cell_t *>(static_cast<char *>(file->m_data) + FILE_HEADER_SIZE);
+    m_flags = reinterpret_cast<flags_t *>(static_cast<char *>(file->m_data) + FILE_HEADER_SIZE + 16 * m_blocks_number * sizeof(cell_t));
+
+    write_file_header();
+
+    if( m_count != NULL )
+        recount_cells(ROOT_REF, m_root_bin);
+
+    return true;
+}
+
+
+/**
+ * Write the changes of the file-backed binmap to the disk
+ */
+template <class traits>
+bool basic_binmap_t<traits>::sync() {
+    if( m_file == NULL )
+        return true;
+
+    write_file_header();
+
+    if( !sync_mapped_file(m_file) ) {
+        fprintf(stderr, "Warning: binmap_t::sync: FILE ERROR\n");
+        return false /* FILE ERROR */;
+    }
+
+    return true;
+}
+
+
+/**
+ * Whether the cells are kept in a file
+ */
+template <class traits>
+bool basic_binmap_t<traits>::is_file_backed() const {
+    return m_file != NULL;
+}
+
+
+/**
+ * Move the cell of the half to the front of the cell buffer
+ *
+ * The cell goes to the first listed free cell below the number of
+ * cells, so the cells above it can be released. The old place and the
+ * free cells skipped are marked free but not listed, until the list
+ * is rebuilt.
+ */
+template <class traits>
+void basic_binmap_t<traits>::move_cell(ref_t ref, bool right) {
+    half_t & half = right ? m_cell[ref].m_right : m_cell[ref].m_left;
+    const ref_t old_ref = half.m_ref;
+
+    if( old_ref < m_cells_number )
+        return;
+
+    /* The free cells above the number of cells are left to be released */
+    while( m_free_top != ROOT_REF && m_free_top >= m_cells_number )
+        unlink_free_cell(m_free_top);
+
+    if( m_free_top == ROOT_REF )
+        return;
+
+    const ref_t new_ref = m_free_top;
+    assert( is_free(new_ref) );
+
+    unlink_free_cell(new_ref);
+
+    copy_cell(new_ref, *this, old_ref);
+    if( m_count != NULL )
+        m_count[new_ref] = m_count[old_ref];
+
+    half.m_ref = new_ref;
+
+    set_free(old_ref, true);
+}
+
+
+/**
+ * Move the cells of the subtree from the compaction offset on
+ *
+ * Each cell visited costs a unit of the budget.
+ *
+ * @return false if the budget is spent, the compaction offset is set
+ *         to the subtree to continue with
+ */
+template <class traits>
+bool basic_binmap_t<traits>::compact_cells(ref_t ref, bin_t bin, size_t & budget) {
+    for(int right = 0; right < 2; ++right) {
+        if( !is_half_ref(ref, right) )
+            continue;
+
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t begin = half_bin.base_offset();
+
+        if( begin + half_bin.base_length() <= m_compact_offset )
+            continue;
+
+        if( begin >= m_compact_offset ) {
+            if( budget == 0 ) {
+                m_compact_offset = begin;
+                return false;
+            }
+
+            --budget;
+            move_cell(ref, right != 0);
+        }
+
+        const ref_t half_ref = right ? m_cell[ref].m_right.m_ref : m_cell[ref].m_left.m_ref;
+        if( !compact_cells(half_ref, half_bin, budget) )
+            return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Move a part of the cells to the front of the cell buffer
+ *
+ * A pass walks the tree left to right from the saved offset and moves
+ * the cells above the number of cells to the lowest free places. The
+ * free cell list is rebuilt in the ascending order at the beginning
+ * and at the end of the pass, these are sequential scans of the cells.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::compact_step(size_t max_cells) {
+    if( !m_is_compacting ) {
+        shrink_to_fit();
+
+        m_compact_offset = 0;
+        m_is_compacting = true;
+    }
+
+    if( !compact_cells(ROOT_REF, m_root_bin, max_cells) )
+        return false;
+
+    shrink_to_fit();
+
+    m_compact_offset = 0;
+    m_is_compacting = false;
+
+    return true;
+}
+
+
+/**
+ * Move the cells to the front of the cell buffer and release the rest
+ */
+template <class traits>
+void basic_binmap_t<traits>::compact() {
+    m_is_compacting = false;
+
+    compact_step(static_cast<size_t>(-1));
+}
+
+
+/**
+ * Release the free blocks at the end of the cell buffer
+ *
+ * The free cell list is rebuilt in the ascending order, so the cells
+ * allocated next are at the front.
+ */
+template <class traits>
+void basic_binmap_t<traits>::shrink_to_fit() {
+    if( m_blocks_number == 0 )
+        return;
+
+    size_t last = 16 * m_blocks_number - 1;
+    while( last > 0 && is_free(last) )
+        --last;
+
+    /* The root alone goes back to the object, a file keeps a block */
+    if( last == 0 && m_file == NULL ) {
+        m_root_cell = m_cell[ROOT_REF];
+        m_root_flags = m_flags[0];
+        m_root_flags.m_is_free = 0;
+
+        free_blocks();
+
+        m_cell = &m_root_cell;
+        m_flags = &m_root_flags;
+        m_blocks_number = 0;
+        m_free_top = ROOT_REF;
+        return;
+    }
+
+    const size_t new_size = last / 16 + 1;
+
+    if( new_size < m_blocks_number ) {
+        if( realloc_blocks(new_size) ) {
+            m_blocks_number = new_size;
+
+            /* A bigger count buffer is fine */
+            if( m_count != NULL )
+                resize_counts(16 * new_size);
+        }
+    }
+
+    reset_free_cells();
+}
+
+
+/**
+ * Allocate the blocks for the number of cells at once, the buffers on
+ * the heap go to a range reserved for them
+ */
+template <class traits>
+bool basic_binmap_t<traits>::reserve(size_t cells, bool is_huge_pages) {
+    const size_t blocks = (cells + 15) / 16;
+
+    if( m_arena == NULL && m_file == NULL && blocks > 0
+        && (m_region == NULL || blocks > m_region->m_max_blocks)
+        && !reserve_region((blocks > m_blocks_number) ? blocks : m_blocks_number, is_huge_pages || (m_region != NULL && m_region->m_is_huge_pages)) ) {
+        fprintf(stderr, "Warning: binmap_t::reserve: RESERVE ERROR\n");
+        return false /* RESERVE ERROR */;
+    }
+
+    if( blocks <= m_blocks_number )
+        return true;
+
+    return extend_blocks(blocks);
+}
+
+
+/**
+ * Put the cells of the top height levels of the subtree to the order
+ *
+ * The top half of the levels goes first, then each of the subtrees
+ * under it, recursively (the van Emde Boas order).
+ */
+template <class traits>
+void basic_binmap_t<traits>::order_cells(ref_t ref, size_t height, ref_t * order, size_t & number) const {
+    if( height == 1 ) {
+        order[number++] = ref;
+        return;
+    }
+
+    const size_t top = height / 2;
+
+    order_cells(ref, top, order, number);
+    order_subtrees(ref, top, height - top, order, number);
+}
+
+
+/**
+ * Put the subtrees of the given height at the given depth under the
+ * cell to the order
+ */
+template <class traits>
+void basic_binmap_t<traits>::order_subtrees(ref_t ref, size_t depth, size_t height, ref_t * order, size_t & number) const {
+    for(int right = 0; right < 2; ++right) {
+        if( !is_half_ref(ref, right) )
+            continue;
+
+        const ref_t child_ref = right ? m_cell[ref].m_right.m_ref : m_cell[ref].m_left.m_ref;
+
+        if( depth == 1 )
+            order_cells(child_ref, height, order, number);
+        else
+            order_subtrees(child_ref, depth - 1, height, order, number);
+    }
+}
+
+
+/**
+ * Lay the cells out in the van Emde Boas order
+ *
+ * The cells are copied in the order to a temporary buffer and back, so
+ * a file-backed binmap is laid out in its file.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::relayout() {
+    if( m_blocks_number == 0 )
+        return true;
+
+    const size_t cells_number = m_cells_number;
+    const size_t blocks_number = (cells_number + 15) / 16;
+
+    /* Number of the cell levels */
+    size_t height = 0;
+    for(bin_t bin = m_root_bin; bin.layer_bits() > bitmap_policy::LAYER_BITS; bin.to_left())
+        ++height;
+
+    ref_t * const order = static_cast<ref_t *>(malloc(cells_number * sizeof(ref_t)));
+    ref_t * const new_ref = static_cast<ref_t *>(malloc(16 * m_blocks_number * sizeof(ref_t)));
+    cell_t * const cell = static_cast<cell_t *>(malloc(cells_number * sizeof(cell_t)));
+    flags_t * const flags = static_cast<flags_t *>(calloc(blocks_number, sizeof(flags_t)));
+    uint_t * const count = (m_count != NULL) ? static_cast<uint_t *>(malloc(cells_number * sizeof(uint_t))) : NULL;
+
+    if( order == NULL || new_ref == NULL || cell == NULL || flags == NULL || (m_count != NULL && count == NULL) ) {
+        free(order);
+        free(new_ref);
+        free(cell);
+        free(flags);
+        free(count);
+        fprintf(stderr, "Warning: binmap_t::relayout: MEMORY ERROR\n");
+        return false /* MEMORY ERROR */;
+    }
+
+    size_t number = 0;
+    order_cells(ROOT_REF, height, order, number);
+
+    assert( number == cells_number && order[0] == ROOT_REF );
+
+    for(size_t i = 0; i < cells_number; ++i)
+        new_ref[order[i]] = static_cast<ref_t>(i);
+
+    /* Copy the cells in the order */
+    for(size_t i = 0; i < cells_number; ++i) {
+        const ref_t ref = order[i];
+        const uint16_t bit = static_cast<uint16_t>(1U << (i % 16));
+
+        cell[i] = m_cell[ref];
+
+        if( is_left_ref(ref) ) {
+            cell[i].m_left.m_ref = new_ref[cell[i].m_left.m_ref];
+            flags[i / 16].m_is_left_ref |= bit;
+        }
+        if( is_right_ref(ref) ) {
+            cell[i].m_right.m_ref = new_ref[cell[i].m_right.m_ref];
+            flags[i / 16].m_is_right_ref |= bit;
+        }
+
+        if( count != NULL )
+            count[i] = m_count[ref];
+    }
+
+    /* The rest of the cells are free */
+    if( cells_number % 16 != 0 )
+        flags[blocks_number - 1].m_is_free = static_cast<uint16_t>(0xffff << (cells_number % 16));
+
+    memcpy(m_cell, cell, cells_number * sizeof(cell_t));
+    memcpy(m_flags, flags, blocks_number * sizeof(flags_t));
+    if( count != NULL )
+        memcpy(m_count, count, cells_number * sizeof(uint_t));
+
+    for(size_t idx = blocks_number; idx < m_blocks_number; ++idx) {
+        m_flags[idx].m_is_left_ref = 0;
+        m_flags[idx].m_is_right_ref = 0;
+        m_flags[idx].m_is_free = 0xffff;
+    }
+
+    free(order);
+    free(new_ref);
+    free(cell);
+    free(flags);
+    free(count);
+
+    /* The pass of the compaction is over */
+    m_compact_offset = 0;
+    m_is_compacting = false;
+
+    shrink_to_fit();
+
+    return true;
+}
+
+
+/**
+ * Drop the base bins before the offset
+ *
+ * Each step moves the right half of the root to the root cell and
+ * shifts the offsets down by the half, so the left side of a long
+ * stream does not pile up as packed halves over the trace.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::drop_before(uint_t offset) {
+    uint_t shift = 0;
+
+    /* The root stays two bitmaps wide at least */
+    while( m_root_bin.left().layer_bits() > bitmap_policy::LAYER_BITS && offset - shift >= m_root_bin.base_length() / 2 ) {
+        if( is_left_ref(ROOT_REF) )
+            free_cell(m_cell[ROOT_REF].m_left.m_ref);
+
+        if( is_right_ref(ROOT_REF) ) {
+            const ref_t ref = m_cell[ROOT_REF].m_right.m_ref;
+            copy_cell(ROOT_REF, *this, ref);
+
+            /* The children go with the cell to the root */
+            set_left_ref(ref, false);
+            set_right_ref(ref, false);
+            free_cell(ref);
+        } else {
+            set_left_ref(ROOT_REF, false);
+            m_cell[ROOT_REF].m_left.m_bitmap = m_cell[ROOT_REF].m_right.m_bitmap;
+        }
+
+        shift += m_root_bin.base_length() / 2;
+        m_root_bin = m_root_bin.left();
+    }
+
+    if( shift > 0 )
+        recount_cell(ROOT_REF, m_root_bin);
+
+    /* The rest of the dropped bins */
+    const uint_t length = m_root_bin.base_length();
+    reset_range(0, (offset - shift < length) ? offset - shift : length);
+
+    return shift;
+}
+
+
+/**
+ * Get blocks number
+ */
+template <class traits>
+size_t basic_binmap_t<traits>::blocks_number() const {
+    return m_blocks_number;
+}
+
+
+/**
+ * Get the address of the cell buffer
+ */
+template <class traits>
+const void * basic_binmap_t<traits>::cell_buffer() const {
+    return m_cell;
+}
+
+
+/**
+ * Get cells number
+ */
+template <class traits>
+size_t basic_binmap_t<traits>::cells_number() const {
+    return m_cells_number;
+}
+
+
+/**
+ * Get total size of the binmap
+ */
+template <class traits>
+size_t basic_binmap_t<traits>::total_size() const {
+    return sizeof(*this) + (16 * (sizeof(cell_t) + (m_count ? sizeof(uint_t) : 0)) + sizeof(flags_t)) * blocks_number();
+}
+
+
+
+/**
+ * Echo the binmap status to stdout
+ */
+template <class traits>
+void basic_binmap_t<traits>::status() const {
+    printf("bitmap:\n");
+    for(int i = 0; i < 16; ++i) {
+        for(int j = 0; j < 64; ++j)
+            printf("%d", get(bin_t(i * 64 + j)));
+        printf("\n");
+    }
+
+    printf("size: %u bytes\n", total_size());
+    printf("cells number: %u (of %u)\n", cells_number(), 16 * blocks_number());
+    printf("root bin: %llu\n", static_cast<unsigned long long>(m_root_bin.toUInt()));
+
+//    ref_t _nil_cell[256];
+//    bin_t _nil_bin[256];
+//    ref_t * top_cell = _nil_cell;
+//    bin_t * top_bin = _nil_bin;
 //
 //    *top_cell++ = ROOT_REF;
 //    *top_bin++ = m_root_bin;
@@ -756,3 +4228,1344 @@ void binmap_t::status() const {
 //        }
 //    }
 }
+
+
+/**
+ * Find the first set bit of the bitmap in [begin, end), end if none
+ */
+template <class bitmap_type>
+static unsigned int first_bit(const bitmap_type & bitmap, unsigned int begin, unsigned int end) {
+    typedef bitmap_traits<bitmap_type> policy;
+
+    if( (bitmap & policy::range(begin, end)) == policy::EMPTY )
+        return end;
+
+    while( end - begin > 1 ) {
+        const unsigned int mid = (begin + end) / 2;
+        if( (bitmap & policy::range(begin, mid)) != policy::EMPTY )
+            end = mid;
+        else
+            begin = mid;
+    }
+
+    return begin;
+}
+
+
+/**
+ * Find the last set bit of the bitmap in [begin, end), end if none
+ */
+template <class bitmap_type>
+static unsigned int last_bit(const bitmap_type & bitmap, unsigned int begin, unsigned int end) {
+    typedef bitmap_traits<bitmap_type> policy;
+
+    if( (bitmap & policy::range(begin, end)) == policy::EMPTY )
+        return end;
+
+    while( end - begin > 1 ) {
+        const unsigned int mid = (begin + end) / 2;
+        if( (bitmap & policy::range(mid, end)) != policy::EMPTY )
+            begin = mid;
+        else
+            end = mid;
+    }
+
+    return begin;
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_t<traits>::run_iterator_t::run_iterator_t(const basic_binmap_t & binmap) : m_binmap(&binmap) {
+    first();
+}
+
+
+/**
+ * Go to the leftmost or the rightmost packed half under the current half
+ */
+template <class traits>
+void basic_binmap_t<traits>::run_iterator_t::descend(bool right) {
+    for( ;; ) {
+        const cell_t & cell = m_binmap->m_cell[ m_trace_ref[m_depth] ];
+        const bool is_ref = m_binmap->is_half_ref(m_trace_ref[m_depth], m_trace_right[m_depth]);
+
+        if( !is_ref )
+            return;
+
+        const bin_t bin = m_trace_right[m_depth] ? m_trace_bin[m_depth].right() : m_trace_bin[m_depth].left();
+
+        ++m_depth;
+        m_trace_ref[m_depth] = m_trace_right[m_depth - 1] ? cell.m_right.m_ref : cell.m_left.m_ref;
+        m_trace_bin[m_depth] = bin;
+        m_trace_right[m_depth] = right;
+    }
+}
+
+
+/**
+ * Go to the next or the previous packed half
+ *
+ * @return false if there is none; the trace is kept then
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::step(bool forward) {
+    int depth = m_depth;
+    while( depth >= 0 && m_trace_right[depth] == forward )
+        --depth;
+
+    if( depth < 0 )
+        return false;
+
+    m_depth = depth;
+    m_trace_right[m_depth] = forward;
+    descend(!forward);
+
+    return true;
+}
+
+
+/**
+ * Bounds and bitmap of the current packed half
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::half_begin() const {
+    const bin_t bin = m_trace_bin[m_depth];
+    return m_trace_right[m_depth] ? bin.base_offset() + bin.base_length() / 2 : bin.base_offset();
+}
+
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::half_end() const {
+    return half_begin() + m_trace_bin[m_depth].base_length() / 2;
+}
+
+template <class traits>
+typename basic_binmap_t<traits>::bitmap_t basic_binmap_t<traits>::run_iterator_t::half_bitmap() const {
+    const cell_t & cell = m_binmap->m_cell[ m_trace_ref[m_depth] ];
+    return m_trace_right[m_depth] ? cell.m_right.m_bitmap : cell.m_left.m_bitmap;
+}
+
+
+/**
+ * Get the base bin of the current packed half
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::get(uint_t pos) const {
+    const unsigned int idx = static_cast<unsigned int>((pos - half_begin()) % (8 * sizeof(bitmap_t)));
+    return (half_bitmap() & bitmap_policy::range(idx, idx + 1)) != bitmap_policy::EMPTY;
+}
+
+
+/**
+ * Find the end of the base bins of the value from pos in the current packed half
+ *
+ * A packed half above the leaf layer repeats its bitmap, so only two
+ * bitmaps are looked at.
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::scan_forward(uint_t pos, bool value) const {
+    const unsigned int bitmap_bits = 8 * sizeof(bitmap_t);
+    const bitmap_t other = value ? ~half_bitmap() : half_bitmap();
+
+    if( other == bitmap_policy::EMPTY )
+        return half_end();
+
+    const unsigned int idx = static_cast<unsigned int>((pos - half_begin()) % bitmap_bits);
+    uint_t offset = pos - idx;
+
+    unsigned int found = first_bit(other, idx, bitmap_bits);
+    if( found == bitmap_bits ) {
+        offset += bitmap_bits;
+        if( offset == half_end() )
+            return offset;
+
+        found = first_bit(other, 0, bitmap_bits);
+    }
+
+    return offset + found;
+}
+
+
+/**
+ * Find the beginning of the base bins of the value up to pos in the current packed half
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::scan_backward(uint_t pos, bool value) const {
+    const unsigned int bitmap_bits = 8 * sizeof(bitmap_t);
+    const bitmap_t other = value ? ~half_bitmap() : half_bitmap();
+
+    if( other == bitmap_policy::EMPTY )
+        return half_begin();
+
+    const unsigned int idx = static_cast<unsigned int>((pos - half_begin()) % bitmap_bits);
+    uint_t offset = pos - idx;
+
+    unsigned int found = last_bit(other, 0, idx + 1);
+    if( found == idx + 1 ) {
+        if( offset == half_begin() )
+            return offset;
+        offset -= bitmap_bits;
+
+        found = last_bit(other, 0, bitmap_bits);
+    }
+
+    return offset + found + 1;
+}
+
+
+/**
+ * Read the run starting at pos, the trace is at pos
+ *
+ * The run is extended over the following packed halves while their
+ * first base bin has the same value.
+ */
+template <class traits>
+void basic_binmap_t<traits>::run_iterator_t::read_forward(uint_t pos) {
+    const bool value = get(pos);
+    uint_t end = scan_forward(pos, value);
+
+    while( end == half_end() && step(true) ) {
+        if( get(end) != value ) {
+            step(false);
+            break;
+        }
+        end = scan_forward(end, value);
+    }
+
+    m_offset = pos;
+    m_end = end;
+    m_is_filled = value;
+    m_is_at_end = true;
+}
+
+
+/**
+ * Read the run ending at pos (inclusive), the trace is at pos
+ */
+template <class traits>
+void basic_binmap_t<traits>::run_iterator_t::read_backward(uint_t pos) {
+    const bool value = get(pos);
+    uint_t begin = scan_backward(pos, value);
+
+    while( begin == half_begin() && step(false) ) {
+        if( get(begin - 1) != value ) {
+            step(true);
+            break;
+        }
+        begin = scan_backward(begin - 1, value);
+    }
+
+    m_offset = begin;
+    m_end = pos + 1;
+    m_is_filled = value;
+    m_is_at_end = false;
+}
+
+
+/**
+ * Go to the first run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::first() {
+    m_depth = 0;
+    m_trace_ref[0] = ROOT_REF;
+    m_trace_bin[0] = m_binmap->m_root_bin;
+    m_trace_right[0] = false;
+    descend(false);
+
+    read_forward(0);
+
+    return true;
+}
+
+
+/**
+ * Go to the last run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::last() {
+    m_depth = 0;
+    m_trace_ref[0] = ROOT_REF;
+    m_trace_bin[0] = m_binmap->m_root_bin;
+    m_trace_right[0] = true;
+    descend(true);
+
+    read_backward(m_binmap->m_root_bin.base_length() - 1);
+
+    return true;
+}
+
+
+/**
+ * Go to the next run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::next() {
+    if( !m_is_at_end ) {
+        while( half_end() < m_end )
+            step(true);
+    }
+
+    if( m_end == half_end() && !step(true) )
+        return false;
+
+    read_forward(m_end);
+
+    return true;
+}
+
+
+/**
+ * Go to the previous run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::prev() {
+    if( m_is_at_end ) {
+        while( half_begin() > m_offset )
+            step(false);
+    }
+
+    if( m_offset == half_begin() && !step(false) )
+        return false;
+
+    read_backward(m_offset - 1);
+
+    return true;
+}
+
+
+/**
+ * Get the base offset of the run
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::offset() const {
+    return m_offset;
+}
+
+
+/**
+ * Get the number of base bins in the run
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::run_iterator_t::length() const {
+    return m_end - m_offset;
+}
+
+
+/**
+ * Whether the run is filled
+ */
+template <class traits>
+bool basic_binmap_t<traits>::run_iterator_t::is_filled() const {
+    return m_is_filled;
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_t<traits>::encoder_t::encoder_t(const basic_binmap_t & binmap) : m_binmap(&binmap) {
+    unsigned char * p = m_record;
+
+    *p++ = STREAM_SIGNATURE[0];
+    *p++ = STREAM_SIGNATURE[1];
+    *p++ = STREAM_VERSION;
+    *p++ = static_cast<unsigned char>(sizeof(bitmap_t));
+    *p++ = static_cast<unsigned char>(sizeof(uint_t));
+
+    const uint_t root = binmap.m_root_bin.toUInt();
+    for(size_t i = 0; i < sizeof(uint_t); ++i)
+        *p++ = static_cast<unsigned char>(root >> (8 * i));
+
+    m_record_size = p - m_record;
+    m_record_pos = 0;
+
+    m_stack[0] = ROOT_REF;
+    m_depth = 1;
+
+    /* The sizes of all the subtrees in one pass, so encoding is linear */
+    const size_t cells_size = binmap.m_blocks_number ? 16 * binmap.m_blocks_number : 1;
+    m_sizes = static_cast<size_t *>(malloc(cells_size * sizeof(size_t)));
+    if( m_sizes != NULL )
+        measure(ROOT_REF);
+}
+
+
+/**
+ * Destructor
+ */
+template <class traits>
+basic_binmap_t<traits>::encoder_t::~encoder_t() {
+    free(m_sizes);
+}
+
+
+/**
+ * Put the record of the next cell
+ */
+template <class traits>
+void basic_binmap_t<traits>::encoder_t::next_record() {
+    assert( m_depth > 0 );
+
+    const ref_t ref = m_stack[--m_depth];
+    const cell_t & cell = m_binmap->m_cell[ref];
+    const bool is_left_ref = m_binmap->is_left_ref(ref);
+    const bool is_right_ref = m_binmap->is_right_ref(ref);
+
+    /* The left half is encoded first */
+    if( is_right_ref )
+        m_stack[m_depth++] = cell.m_right.m_ref;
+    if( is_left_ref )
+        m_stack[m_depth++] = cell.m_left.m_ref;
+
+    assert( m_depth <= sizeof(m_stack) / sizeof(m_stack[0]) );
+
+    /* The size of the left subtree lets readers skip it */
+    if( is_left_ref && is_right_ref ) {
+        m_record[0] = STREAM_REFS;
+        const size_t left_size = (m_sizes != NULL) ? m_sizes[cell.m_left.m_ref] : measure(cell.m_left.m_ref);
+        m_record_size = put_varint(m_record + 1, left_size) - m_record;
+        m_record_pos = 0;
+        return;
+    }
+
+    unsigned char * p = m_record + 1;
+    unsigned char flags = 0;
+
+    for(int i = 0; i < 2; ++i) {
+        const bool is_ref = i ? is_right_ref : is_left_ref;
+        const half_t & half = i ? cell.m_right : cell.m_left;
+
+        int type;
+        if( is_ref )
+            type = STREAM_REF;
+        else if( half.m_bitmap == bitmap_policy::EMPTY )
+            type = STREAM_EMPTY;
+        else if( half.m_bitmap == bitmap_policy::FILLED )
+            type = STREAM_FILLED;
+        else {
+            type = STREAM_BITMAP;
+            bitmap_policy::store(half.m_bitmap, p);
+            p += sizeof(bitmap_t);
+        }
+
+        flags |= static_cast<unsigned char>(type << (2 * i));
+    }
+
+    m_record[0] = flags;
+    m_record_size = p - m_record;
+    m_record_pos = 0;
+}
+
+
+/**
+ * Get the size of the stream of the subtree, post-order, and keep the
+ * sizes of its cells
+ */
+template <class traits>
+size_t basic_binmap_t<traits>::encoder_t::measure(ref_t ref) {
+    const cell_t & cell = m_binmap->m_cell[ref];
+    const bool is_left_ref = m_binmap->is_left_ref(ref);
+    const bool is_right_ref = m_binmap->is_right_ref(ref);
+
+    size_t size = 1;
+
+    if( is_left_ref && is_right_ref ) {
+        const size_t left_size = measure(cell.m_left.m_ref);
+        size += varint_size(left_size) + left_size + measure(cell.m_right.m_ref);
+    } else {
+        for(int i = 0; i < 2; ++i) {
+            const bool is_ref = i ? is_right_ref : is_left_ref;
+            const half_t & half = i ? cell.m_right : cell.m_left;
+
+            if( is_ref )
+                size += measure(half.m_ref);
+            else if( half.m_bitmap != bitmap_policy::EMPTY && half.m_bitmap != bitmap_policy::FILLED )
+                size += sizeof(bitmap_t);
+        }
+    }
+
+    if( m_sizes != NULL )
+        m_sizes[ref] = size;
+
+    return size;
+}
+
+
+/**
+ * Encode the next bytes of the stream to the buffer
+ */
+template <class traits>
+size_t basic_binmap_t<traits>::encoder_t::encode(void * buffer, size_t size) {
+    unsigned char * const out = static_cast<unsigned char *>(buffer);
+    size_t written = 0;
+
+    while( written < size ) {
+        if( m_record_pos == m_record_size ) {
+            if( m_depth == 0 )
+                break;
+            next_record();
+        }
+
+        size_t length = m_record_size - m_record_pos;
+        if( length > size - written )
+            length = size - written;
+
+        memcpy(out + written, m_record + m_record_pos, length);
+
+        m_record_pos += length;
+        written += length;
+    }
+
+    return written;
+}
+
+
+/**
+ * Whether the whole stream is encoded
+ */
+template <class traits>
+bool basic_binmap_t<traits>::encoder_t::is_done() const {
+    return m_depth == 0 && m_record_pos == m_record_size;
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_t<traits>::decoder_t::decoder_t(basic_binmap_t & binmap) : m_binmap(&binmap) {
+    binmap.clear();
+    binmap.reset_free_cells();
+
+    m_slots = 0;
+    m_record_size = 0;
+    m_record_need = STREAM_HEADER_SIZE + sizeof(uint_t);
+    m_is_header_read = false;
+    m_is_root_read = false;
+    m_is_failed = false;
+}
+
+
+/**
+ * Stop decoding on error
+ */
+template <class traits>
+bool basic_binmap_t<traits>::decoder_t::fail() {
+    m_is_failed = true;
+    m_slots = 0;
+    m_binmap->clear();
+
+    return false;
+}
+
+
+/**
+ * Read the header
+ */
+template <class traits>
+bool basic_binmap_t<traits>::decoder_t::read_header() {
+    bin_t root_bin;
+    if( !parse_header(m_record, root_bin) )
+        return false;
+
+    m_binmap->m_root_bin = root_bin;
+
+    return true;
+}
+
+
+/**
+ * Get the bin of the next cell
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::decoder_t::next_bin() const {
+    if( !m_is_root_read )
+        return m_binmap->m_root_bin;
+
+    return m_slot_bin[m_slots - 1];
+}
+
+
+/**
+ * Read the record of a cell
+ *
+ * The halves referencing the cells are linked when their cells are
+ * read, so the binmap stays consistent if the stream is broken.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::decoder_t::read_cell() {
+    const bin_t bin = next_bin();
+    const unsigned char flags = m_record[0];
+
+    ref_t ref = ROOT_REF;
+
+    if( m_is_root_read ) {
+        ref = m_binmap->alloc_cell();
+        if( ref == ROOT_REF )
+            return false /* ALLOC ERROR */;
+
+        --m_slots;
+
+        const ref_t parent_ref = m_slot_ref[m_slots];
+        cell_t & parent = m_binmap->m_cell[parent_ref];
+        if( m_slot_right[m_slots] ) {
+            m_binmap->set_right_ref(parent_ref, true);
+            parent.m_right.m_ref = ref;
+        } else {
+            m_binmap->set_left_ref(parent_ref, true);
+            parent.m_left.m_ref = ref;
+        }
+    }
+
+    m_is_root_read = true;
+
+    cell_t & cell = m_binmap->m_cell[ref];
+    const unsigned char * p = m_record + 1;
+
+    for(int i = 0; i < 2; ++i) {
+        half_t & half = i ? cell.m_right : cell.m_left;
+
+        switch( (flags >> (2 * i)) & 3 ) {
+        case STREAM_EMPTY:
+            half.m_bitmap = bitmap_policy::EMPTY;
+            break;
+        case STREAM_FILLED:
+            half.m_bitmap = bitmap_policy::FILLED;
+            break;
+        case STREAM_BITMAP:
+            half.m_bitmap = bitmap_policy::load(p);
+            p += sizeof(bitmap_t);
+            break;
+        default:
+            half.m_bitmap = bitmap_policy::EMPTY;
+            break;
+        }
+    }
+
+    /* Cells of two equal bitmaps are always packed */
+    if( ref != ROOT_REF && (flags & 3) != STREAM_REF && (flags >> 2) != STREAM_REF && cell.m_left.m_bitmap == cell.m_right.m_bitmap ) {
+        fprintf(stderr, "Warning: binmap_t::decoder_t::decode: FORMAT ERROR\n");
+        return false /* FORMAT ERROR */;
+    }
+
+    /* The left half is decoded first */
+    if( ((flags >> 2) & 3) == STREAM_REF ) {
+        m_slot_ref[m_slots] = ref;
+        m_slot_bin[m_slots] = bin.right();
+        m_slot_right[m_slots] = true;
+        ++m_slots;
+    }
+
+    if( (flags & 3) == STREAM_REF ) {
+        m_slot_ref[m_slots] = ref;
+        m_slot_bin[m_slots] = bin.left();
+        m_slot_right[m_slots] = false;
+        ++m_slots;
+    }
+
+    assert( m_slots <= sizeof(m_slot_ref) / sizeof(m_slot_ref[0]) );
+
+    /* The last cell */
+    if( m_slots == 0 && m_binmap->m_count != NULL )
+        m_binmap->recount_cells(ROOT_REF, m_binmap->m_root_bin);
+
+    return true;
+}
+
+
+/**
+ * Decode the next bytes of the stream
+ *
+ * The bytes are collected until the header or the record of a cell
+ * is complete: the flag byte of a record gives the number of its bitmaps,
+ * or tells that the size of the left subtree follows.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::decoder_t::decode(const void * buffer, size_t size) {
+    if( m_is_failed )
+        return false;
+
+    const unsigned char * in = static_cast<const unsigned char *>(buffer);
+
+    while( size > 0 ) {
+        if( is_done() ) {
+            fprintf(stderr, "Warning: binmap_t::decoder_t::decode: TRAILING DATA ERROR\n");
+            return fail() /* TRAILING DATA ERROR */;
+        }
+
+        size_t length = m_record_need - m_record_size;
+        if( length > size )
+            length = size;
+
+        memcpy(m_record + m_record_size, in, length);
+
+        m_record_size += length;
+        in += length;
+        size -= length;
+
+        if( m_record_size < m_record_need )
+            break;
+
+        if( !m_is_header_read ) {
+            if( !read_header() )
+                return fail();
+
+            m_is_header_read = true;
+            m_record_size = 0;
+            m_record_need = 1;
+            continue;
+        }
+
+        if( m_record[0] == STREAM_REFS && m_record_size > 1 && (m_record[m_record_size - 1] & 0x80) ) {
+            /* The size of the left subtree is not read yet */
+            if( m_record_size > MAX_VARINT_SIZE ) {
+                fprintf(stderr, "Warning: binmap_t::decoder_t::decode: FORMAT ERROR\n");
+                return fail() /* FORMAT ERROR */;
+            }
+
+            ++m_record_need;
+            continue;
+        }
+
+        if( m_record_size == 1 ) {
+            /* The flag byte */
+            const unsigned char flags = m_record[0];
+            const bin_t bin = next_bin();
+
+            if( (flags & 0xf0) != 0 ) {
+                fprintf(stderr, "Warning: binmap_t::decoder_t::decode: FORMAT ERROR\n");
+                return fail() /* FORMAT ERROR */;
+            }
+
+            for(int i = 0; i < 2; ++i) {
+                const int type = (flags >> (2 * i)) & 3;
+
+                if( type == STREAM_BITMAP )
+                    m_record_need += sizeof(bitmap_t);
+
+                /* The leaf halves are never references */
+                if( type == STREAM_REF && bin.layer_bits() >> 1 == bitmap_policy::LAYER_BITS ) {
+                    fprintf(stderr, "Warning: binmap_t::decoder_t::decode: FORMAT ERROR\n");
+                    return fail() /* FORMAT ERROR */;
+                }
+            }
+
+            if( flags == STREAM_REFS )
+                ++m_record_need;
+
+            if( m_record_size < m_record_need )
+                continue;
+        }
+
+        if( !read_cell() )
+            return fail();
+
+        m_record_size = 0;
+        m_record_need = 1;
+    }
+
+    return true;
+}
+
+
+/**
+ * Whether the whole stream is decoded
+ */
+template <class traits>
+bool basic_binmap_t<traits>::decoder_t::is_done() const {
+    return !m_is_failed && m_is_root_read && m_slots == 0;
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_t<traits>::const_view_t::const_view_t(const void * buffer, size_t size) : m_root_bin(bitmap_policy::LAYER_BITS) {
+    m_buffer = static_cast<const unsigned char *>(buffer);
+    m_size = size;
+    m_root_pos = STREAM_HEADER_SIZE + sizeof(uint_t);
+
+    if( size < m_root_pos || !parse_header(m_buffer, m_root_bin) ) {
+        /* Nothing is read */
+        m_root_bin = bin_t(bitmap_policy::LAYER_BITS);
+        m_root_pos = size;
+    }
+}
+
+
+/**
+ * Whether the header of the stream is valid
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::is_valid() const {
+    return m_root_pos < m_size;
+}
+
+
+/**
+ * Get the root bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::root_bin() const {
+    return m_root_bin;
+}
+
+
+/**
+ * Read the cell of the bin at the position of the stream
+ *
+ * A referenced half is at the end of the record, or after the left
+ * subtree whose size is in the record.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::read_cell(size_t pos, bin_t bin, view_cell_t & cell) const {
+    for(int i = 0; i < 2; ++i) {
+        cell.m_bitmap[i] = bitmap_policy::EMPTY;
+        cell.m_is_ref[i] = false;
+        cell.m_pos[i] = m_size;
+    }
+
+    if( pos >= m_size )
+        return false;
+
+    const unsigned char * const end = m_buffer + m_size;
+    const unsigned char * p = m_buffer + pos;
+
+    const unsigned char flags = *p++;
+    const bool is_leaf = (bin.layer_bits() >> 1 == bitmap_policy::LAYER_BITS);
+
+    if( (flags & 0xf0) != 0 )
+        return false;
+
+    if( flags == STREAM_REFS ) {
+        size_t left_size;
+
+        p = is_leaf ? NULL : get_varint(p, end, left_size);
+        if( p == NULL || left_size >= static_cast<size_t>(end - p) )
+            return false;
+
+        cell.m_is_ref[0] = cell.m_is_ref[1] = true;
+        cell.m_pos[0] = p - m_buffer;
+        cell.m_pos[1] = cell.m_pos[0] + left_size;
+
+        return true;
+    }
+
+    bitmap_t bitmap[2];
+    bool is_ref[2];
+
+    for(int i = 0; i < 2; ++i) {
+        bitmap[i] = bitmap_policy::EMPTY;
+        is_ref[i] = false;
+
+        switch( (flags >> (2 * i)) & 3 ) {
+        case STREAM_FILLED:
+            bitmap[i] = bitmap_policy::FILLED;
+            break;
+        case STREAM_BITMAP:
+            if( static_cast<size_t>(end - p) < sizeof(bitmap_t) )
+                return false;
+            bitmap[i] = bitmap_policy::load(p);
+            p += sizeof(bitmap_t);
+            break;
+        case STREAM_REF:
+            if( is_leaf )
+                return false;
+            is_ref[i] = true;
+            break;
+        }
+    }
+
+    for(int i = 0; i < 2; ++i) {
+        cell.m_bitmap[i] = bitmap[i];
+        cell.m_is_ref[i] = is_ref[i];
+        if( is_ref[i] )
+            cell.m_pos[i] = p - m_buffer;
+    }
+
+    return true;
+}
+
+
+/**
+ * Get bins
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::get(bin_t bin) const {
+    if( !m_root_bin.contains(bin) )
+        return false;
+
+    /* Trace the bin */
+    size_t pos = m_root_pos;
+    bin_t cur_bin = m_root_bin;
+    view_cell_t cell;
+
+    for( ;; ) {
+        read_cell(pos, cur_bin, cell);
+
+        if( bin == cur_bin )
+            return !cell.m_is_ref[0] && !cell.m_is_ref[1] && cell.m_bitmap[0] == bitmap_policy::FILLED && cell.m_bitmap[1] == bitmap_policy::FILLED;
+
+        const int right = (bin < cur_bin) ? 0 : 1;
+
+        if( !cell.m_is_ref[right] )
+            break;
+
+        pos = cell.m_pos[right];
+        if( right )
+            cur_bin.to_right();
+        else
+            cur_bin.to_left();
+    }
+
+    const bitmap_t bm2 = cell.m_bitmap[(bin < cur_bin) ? 0 : 1];
+
+    if( bin.layer_bits() > bitmap_policy::LAYER_BITS )
+        return bm2 == bitmap_policy::FILLED;
+
+    const bitmap_t bm1 = bitmap_policy::bin(bitmap_policy::LAYER_BITS & bin.toUInt());
+
+    return (bm1 & bm2) == bm1;
+}
+
+
+/**
+ * Check the base bins [begin, end) under the cell for the value
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::check_range(size_t pos, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const {
+    view_cell_t cell;
+    read_cell(pos, bin, cell);
+
+    for(int right = 0; right < 2; ++right) {
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t lo = half_bin.base_offset();
+        const uint_t hi = lo + half_bin.base_length();
+
+        if( end <= lo || hi <= begin )
+            continue;
+
+        if( !cell.m_is_ref[right] ) {
+            if( !check_half_range(cell.m_bitmap[right], half_bin, begin, end, value) )
+                return false;
+
+        } else {
+            /* Referenced subtrees are never uniform */
+            if( begin <= lo && hi <= end )
+                return false;
+
+            if( !check_range(cell.m_pos[right], half_bin, begin, end, value) )
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are filled
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::is_filled_range(uint_t begin, uint_t end) const {
+    if( begin >= end )
+        return true;
+
+    if( m_root_bin.base_offset() + m_root_bin.base_length() < end )
+        return false;
+
+    return check_range(m_root_pos, m_root_bin, begin, end, bitmap_policy::FILLED);
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are empty
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::is_empty_range(uint_t begin, uint_t end) const {
+    if( begin >= end )
+        return true;
+
+    return check_range(m_root_pos, m_root_bin, begin, end, bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the leftmost bin of the value within [begin, end) under the cell
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_in_cell(size_t pos, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const {
+    view_cell_t cell;
+    read_cell(pos, bin, cell);
+
+    for(int right = 0; right < 2; ++right) {
+        const bin_t half_bin = right ? bin.right() : bin.left();
+        const uint_t lo = half_bin.base_offset();
+        const uint_t hi = lo + half_bin.base_length();
+
+        if( hi <= begin || end <= lo )
+            continue;
+
+        const bin_t found = cell.m_is_ref[right] ? find_in_cell(cell.m_pos[right], half_bin, begin, end, value) : find_in_half(cell.m_bitmap[right], half_bin, begin, end, value);
+        if( !found.is_none() )
+            return found;
+    }
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Find the leftmost bin of the value within the base bins [begin, end)
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_value(uint_t begin, uint_t end, bitmap_t value) const {
+    if( begin >= end )
+        return bin_t::NONE;
+
+    const uint_t root_end = m_root_bin.base_length();
+
+    if( begin < root_end ) {
+        const bin_t found = find_in_cell(m_root_pos, m_root_bin, begin, end, value);
+        if( !found.is_none() )
+            return found;
+    }
+
+    /* The bins beyond the root are empty */
+    if( value == bitmap_policy::EMPTY && end > root_end )
+        return aligned_bin((begin > root_end) ? begin : root_end, end);
+
+    return bin_t::NONE;
+}
+
+
+/**
+ * Find first empty bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_empty() const {
+    const bin_t found = find_value(0, m_root_bin.base_length(), bitmap_policy::EMPTY);
+    if( !found.is_none() )
+        return found;
+
+    if( m_root_bin.is_all() )
+        return bin_t::NONE;
+
+    return m_root_bin.sibling();
+}
+
+
+/**
+ * Find the leftmost empty bin within the bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_empty(bin_t within) const {
+    if( within.is_none() )
+        return bin_t::NONE;
+
+    return find_value(within.base_offset(), within.base_offset() + within.base_length(), bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the leftmost empty bin at or after the base offset
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_empty_after(uint_t offset) const {
+    return find_value(offset, bin_t::ALL.base_length(), bitmap_policy::EMPTY);
+}
+
+
+/**
+ * Find the leftmost filled bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_filled() const {
+    return find_value(0, m_root_bin.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Find the leftmost filled bin within the bin
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_filled(bin_t within) const {
+    if( within.is_none() )
+        return bin_t::NONE;
+
+    return find_value(within.base_offset(), within.base_offset() + within.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Find the leftmost filled bin at or after the base offset
+ */
+template <class traits>
+typename basic_binmap_t<traits>::bin_t basic_binmap_t<traits>::const_view_t::find_filled_after(uint_t offset) const {
+    return find_value(offset, bin_t::ALL.base_length(), bitmap_policy::FILLED);
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_t<traits>::const_view_t::run_iterator_t::run_iterator_t(const const_view_t & view) : m_view(&view) {
+    m_offset = 0;
+    m_end = 0;
+    m_is_filled = false;
+}
+
+
+/**
+ * Read the run starting at the base offset
+ *
+ * The run is ended by the leftmost bin of the other value.
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::run_iterator_t::read(uint_t offset) {
+    const uint_t root_end = m_view->root_bin().base_length();
+    if( offset >= root_end )
+        return false;
+
+    const bin_t filled = m_view->find_filled_after(offset);
+
+    m_offset = offset;
+    m_is_filled = !filled.is_none() && filled.base_offset() == offset;
+
+    const bin_t other = m_is_filled ? m_view->find_empty_after(offset) : filled;
+
+    m_end = (other.is_none() || other.base_offset() > root_end) ? root_end : other.base_offset();
+
+    return true;
+}
+
+
+/**
+ * Go to the first run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::run_iterator_t::first() {
+    return read(0);
+}
+
+
+/**
+ * Go to the next run
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::run_iterator_t::next() {
+    return read(m_end);
+}
+
+
+/**
+ * Get the base offset of the run
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::const_view_t::run_iterator_t::offset() const {
+    return m_offset;
+}
+
+
+/**
+ * Get the number of base bins in the run
+ */
+template <class traits>
+typename basic_binmap_t<traits>::uint_t basic_binmap_t<traits>::const_view_t::run_iterator_t::length() const {
+    return m_end - m_offset;
+}
+
+
+/**
+ * Whether the run is filled
+ */
+template <class traits>
+bool basic_binmap_t<traits>::const_view_t::run_iterator_t::is_filled() const {
+    return m_is_filled;
+}
+
+
+/**
+ * Constructor
+ */
+template <class traits>
+basic_binmap_window_t<traits>::basic_binmap_window_t() {
+    m_base = 0;
+    m_shift = 0;
+}
+
+
+/**
+ * Move the range into the binmap, false if it is before the base
+ */
+template <class traits>
+bool basic_binmap_window_t<traits>::to_binmap(uint_t & begin, uint_t & end) const {
+    if( begin < m_base )
+        begin = m_base;
+
+    if( begin >= end )
+        return false;
+
+    begin -= m_shift;
+    end -= m_shift;
+
+    return true;
+}
+
+
+/**
+ * Set bins
+ *
+ * The bins not aligned in the binmap are set as ranges.
+ */
+template <class traits>
+void basic_binmap_window_t<traits>::set(bin_t bin) {
+    const uint_t begin = bin.base_offset();
+
+    if( begin >= m_base && (begin - m_shift) % bin.base_length() == 0 )
+        m_binmap.set(bin_t(bin.toUInt() - 2 * m_shift));
+    else
+        set_range(begin, begin + bin.base_length());
+}
+
+
+/**
+ * Reset bins
+ */
+template <class traits>
+void basic_binmap_window_t<traits>::reset(bin_t bin) {
+    const uint_t begin = bin.base_offset();
+
+    if( begin >= m_base && (begin - m_shift) % bin.base_length() == 0 )
+        m_binmap.reset(bin_t(bin.toUInt() - 2 * m_shift));
+    else
+        reset_range(begin, begin + bin.base_length());
+}
+
+
+/**
+ * Whether the bin is filled
+ */
+template <class traits>
+bool basic_binmap_window_t<traits>::get(bin_t bin) const {
+    const uint_t begin = bin.base_offset();
+
+    if( begin < m_base )
+        return false;
+
+    if( (begin - m_shift) % bin.base_length() == 0 )
+        return m_binmap.get(bin_t(bin.toUInt() - 2 * m_shift));
+
+    return m_binmap.is_filled_range(begin - m_shift, begin - m_shift + bin.base_length());
+}
+
+
+/**
+ * Set the base bins [begin, end)
+ */
+template <class traits>
+void basic_binmap_window_t<traits>::set_range(uint_t begin, uint_t end) {
+    if( to_binmap(begin, end) )
+        m_binmap.set_range(begin, end);
+}
+
+
+/**
+ * Reset the base bins [begin, end)
+ */
+template <class traits>
+void basic_binmap_window_t<traits>::reset_range(uint_t begin, uint_t end) {
+    if( to_binmap(begin, end) )
+        m_binmap.reset_range(begin, end);
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are filled
+ */
+template <class traits>
+bool basic_binmap_window_t<traits>::is_filled_range(uint_t begin, uint_t end) const {
+    if( begin >= end )
+        return true;
+
+    if( begin < m_base )
+        return false;
+
+    return m_binmap.is_filled_range(begin - m_shift, end - m_shift);
+}
+
+
+/**
+ * Whether all the base bins [begin, end) are empty
+ */
+template <class traits>
+bool basic_binmap_window_t<traits>::is_empty_range(uint_t begin, uint_t end) const {
+    if( !to_binmap(begin, end) )
+        return true;
+
+    return m_binmap.is_empty_range(begin, end);
+}
+
+
+/**
+ * Move the base of the window forward to the offset
+ */
+template <class traits>
+void basic_binmap_window_t<traits>::drop_before(uint_t offset) {
+    if( offset <= m_base )
+        return;
+
+    m_base = offset;
+    m_shift += m_binmap.drop_before(offset - m_shift);
+}
+
+
+/**
+ * Get the base offset of the window
+ */
+template <class traits>
+typename basic_binmap_window_t<traits>::uint_t basic_binmap_window_t<traits>::base() const {
+    return m_base;
+}
+
+
+/**
+ * Get the binmap
+ */
+template <class traits>
+const typename basic_binmap_window_t<traits>::binmap_type & basic_binmap_window_t<traits>::binmap() const {
+    return m_binmap;
+}
+
+
+/**
+ * Get the offset of the first base bin of the binmap
+ */
+template <class traits>
+typename basic_binmap_window_t<traits>::uint_t basic_binmap_window_t<traits>::shift() const {
+    return m_shift;
+}
+
+
+/* Explicit instantiations */
+template class basic_binmap_t< binmap_traits<bin_t, bitmap32_t> >;
+template class basic_binmap_t< binmap_traits<bin_t, bitmap64_t> >;
+template class basic_binmap_t< binmap_traits<bin_t, bitmap128_t> >;
+template class basic_binmap_t< binmap_traits<bin_t, bitmap256_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap32_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap64_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap128_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap256_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap32_t, uint64_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap64_t, uint64_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap128_t, uint64_t> >;
+template class basic_binmap_t< binmap_traits<bin64_t, bitmap256_t, uint64_t> >;
+
+template class basic_binmap_window_t< binmap_traits<bin_t> >;
+template class basic_binmap_window_t< binmap_traits<bin64_t> >;
@@ -3,196 +3,1829 @@
 
 #include <cstddef>
 #include "bin.h"
-
-#ifndef _MSC_VER
-#  include <stdint.h>
-#else
-typedef unsigned __int32 uint32_t;
-#endif
+#include "bitmap.h"
 
 
 /**
- * Type of bitmap
+ * Types the binmap is built on
  */
-typedef uint32_t bitmap_t;
+template <class bin_type, class bitmap_type = bitmap32_t, class ref_type = uint32_t>
+struct binmap_traits {
+    /**
+     * Type of bin
+     */
+    typedef bin_type bin_t;
 
-/**
- * Type of reference
- */
-typedef uint32_t ref_t;
+    /**
+     * Type of bitmap (see bitmap.h for the supported ones)
+     */
+    typedef bitmap_type bitmap_t;
 
+    /**
+     * Type of reference, uint64_t for the binmaps of more than 2^32 cells
+     */
+    typedef ref_type ref_t;
+};
 
-#pragma pack(push, 1)
 
 /**
  * Structure of cell halves
  */
-typedef struct {
+template <class traits>
+struct binmap_half_t {
     union {
-        bitmap_t m_bitmap;
-        ref_t m_ref;
+        typename traits::bitmap_t m_bitmap;
+        typename traits::ref_t m_ref;
     };
-} half_t;
+};
 
 
 /**
- * Structure of cells
+ * Structure of cells, aligned pairs of halves
  */
-typedef union {
+template <class traits>
+union binmap_cell_t {
+    struct {
+        binmap_half_t<traits> m_left;
+        binmap_half_t<traits> m_right;
+    };
     struct {
-        half_t m_left;
-        half_t m_right;
-        bool m_is_left_ref : 1;
-        bool m_is_right_ref : 1;
-        bool m_is_free : 1;
+        typename traits::ref_t m_free_next;
+        typename traits::ref_t m_free_prev;
     };
-    ref_t m_free_next;
-} cell_t;
+};
 
 
-#pragma pack(pop)
+/**
+ * Flags of the 16 cells of a block, one bit per cell
+ *
+ * They are kept apart from the cells, so a block of 16 cells of
+ * 32-bit halves takes two cache lines.
+ */
+typedef struct {
+    uint16_t m_is_left_ref;
+    uint16_t m_is_right_ref;
+    uint16_t m_is_free;
+} binmap_flags_t;
+
 
 /**
- * Binmap class
+ * Memory-mapped file of a binmap (see binmap.cpp)
+ */
+struct binmap_file_t;
+
+/**
+ * Reserved address range of a binmap (see binmap.cpp)
  */
-class binmap_t {
+struct binmap_region_t;
+
+
+/**
+ * Arena of cell buffers shared by many binmaps
+ *
+ * The buffers are carved from common slabs in power-of-two sizes and
+ * the released ones are kept in a free list per size, so both the
+ * allocation and the release take O(1). The buffers bigger than a
+ * quarter of a slab are allocated apart.
+ *
+ * The arena is not synchronized, and it must outlive its binmaps.
+ */
+class binmap_arena_t {
 public:
 
     /**
      * Constructor
+     *
+     * With huge pages the slabs and the big buffers are mapped on the
+     * huge pages if there are some, or on the transparent ones.
      */
-    binmap_t();
+    explicit binmap_arena_t(size_t slab_size = 1 << 20, bool is_huge_pages = false);
 
 
     /**
-     * Destructor
+     * Destructor, releases the slabs
      */
-    ~binmap_t();
+    ~binmap_arena_t();
 
 
     /**
-     * Get bins
+     * Allocate a buffer of the size
+     *
+     * @return NULL on error
      */
-    bool get(bin_t bin) const;
+    void * alloc_buffer(size_t size);
 
 
     /**
-     * Set bins
+     * Release a buffer of the size
      */
-    void set(bin_t bin);
+    void free_buffer(void * buffer, size_t size);
 
 
     /**
-     * Reset bins
+     * Get the size of the buffers allocated for the size
      */
-    void reset(bin_t bin);
+    static size_t buffer_size(size_t size);
 
 
     /**
-     * Find first empty bin
+     * Get the size of the slabs
      */
-    bin_t find_empty() const;
+    size_t total_size() const;
 
 
+private:
+
     /**
-     * Get blocks number
+     * Number of the buffer sizes
      */
-    size_t blocks_number() const;
+    enum { SIZES_NUMBER = 8 * sizeof(size_t) };
 
 
     /**
-     * Get cells number
+     * Get the index of the buffer size
      */
-    size_t cells_number() const;
+    static size_t size_index(size_t size);
 
 
     /**
-     * Get total size of the binmap
+     * Size of the slabs
      */
-    size_t total_size() const;
+    size_t m_slab_size;
 
+    /**
+     * Whether the slabs and the big buffers are on the huge pages
+     */
+    bool m_is_huge_pages;
 
     /**
-     * Echo the binmap status to stdout
+     * The slabs, each one starts with the next one
      */
-    void status() const;
+    void * m_slab;
 
+    /**
+     * Number of the slabs
+     */
+    size_t m_slabs_number;
 
-private:
+    /**
+     * Unused part of the last slab
+     */
+    char * m_slab_free;
+    size_t m_slab_free_size;
+
+    /**
+     * Released buffers of each size, each one starts with the next one
+     */
+    void * m_free[SIZES_NUMBER];
 
 
     /**
-     * Allocates one cell
+     * Copy constructor
      */
-    ref_t alloc_cell();
+    binmap_arena_t(const binmap_arena_t &); /* undefined */
+
+    /**
+     * Assignment operator
+     */
+    binmap_arena_t & operator = (const binmap_arena_t &); /* undefined */
+};
 
+/**
+ * Binmap class
+ */
+template <class traits>
+class basic_binmap_t {
+public:
 
     /**
-     * Releases the cell
+     * Type of bin
      */
-    void free_cell(ref_t cell);
+    typedef typename traits::bin_t bin_t;
 
+    /**
+     * Type of bitmap
+     */
+    typedef typename traits::bitmap_t bitmap_t;
 
     /**
-     * Extend root
+     * Type of reference
      */
-    void extend_root();
+    typedef typename traits::ref_t ref_t;
 
+    /**
+     * Type of base offsets
+     */
+    typedef typename bin_t::uint_t uint_t;
 
     /**
-     * Unpack the left half of a cell
+     * Extent of base bins
      */
-    ref_t unpack_left_half(ref_t cell);
+    typedef struct {
+        uint_t m_offset;
+        uint_t m_length;
+    } extent_t;
+
+    /**
+     * Structure of cell halves
+     */
+    typedef binmap_half_t<traits> half_t;
 
+    /**
+     * Structure of cells
+     */
+    typedef binmap_cell_t<traits> cell_t;
 
     /**
-     * Unpack the right half of a cell
+     * Structure of the flags of the blocks
      */
-    ref_t unpack_right_half(ref_t cell);
+    typedef binmap_flags_t flags_t;
 
 
     /**
-     * Pack a trace of cells
+     * Iterator over the maximal runs of filled or empty base bins
+     * of the root, forward and backward:
+     *
+     *   for(bool ok = it.first(); ok; ok = it.next())
+     *       ... it.offset(), it.length(), it.is_filled() ...
+     *
+     * The iterator is invalidated by any change of the binmap.
      */
-    void pack_cells(ref_t * cells);
+    class run_iterator_t {
+    public:
+
+        /**
+         * Constructor
+         */
+        explicit run_iterator_t(const basic_binmap_t & binmap);
+
+
+        /**
+         * Go to the first run
+         */
+        bool first();
+
+
+        /**
+         * Go to the last run
+         */
+        bool last();
+
+
+        /**
+         * Go to the next run
+         */
+        bool next();
+
+
+        /**
+         * Go to the previous run
+         */
+        bool prev();
+
+
+        /**
+         * Get the base offset of the run
+         */
+        uint_t offset() const;
+
+
+        /**
+         * Get the number of base bins in the run
+         */
+        uint_t length() const;
+
+
+        /**
+         * Whether the run is filled
+         */
+        bool is_filled() const;
+
+
+    private:
+
+        /**
+         * Go to the leftmost or the rightmost packed half under the current half
+         */
+        void descend(bool right);
+
+
+        /**
+         * Go to the next or the previous packed half
+         */
+        bool step(bool forward);
+
+
+        /**
+         * Bounds and bitmap of the current packed half
+         */
+        uint_t half_begin() const;
+        uint_t half_end() const;
+        bitmap_t half_bitmap() const;
+
+
+        /**
+         * Get the base bin of the current packed half
+         */
+        bool get(uint_t pos) const;
+
+
+        /**
+         * Find the end of the base bins of the value from pos in the current packed half
+         */
+        uint_t scan_forward(uint_t pos, bool value) const;
+
+
+        /**
+         * Find the beginning of the base bins of the value up to pos in the current packed half
+         */
+        uint_t scan_backward(uint_t pos, bool value) const;
+
+
+        /**
+         * Read the run starting (ending) at pos
+         */
+        void read_forward(uint_t pos);
+        void read_backward(uint_t pos);
+
+
+        /**
+         * The binmap
+         */
+        const basic_binmap_t * m_binmap;
+
+        /**
+         * Trace of the current packed half: cells, their bins and
+         * the halves taken
+         */
+        ref_t m_trace_ref[64];
+        bin_t m_trace_bin[64];
+        bool m_trace_right[64];
+        int m_depth;
+
+        /**
+         * The run
+         */
+        uint_t m_offset;
+        uint_t m_end;
+        bool m_is_filled;
+
+        /**
+         * Whether the trace is at the end of the run, or at the beginning
+         */
+        bool m_is_at_end;
+    };
+
+    friend class run_iterator_t;
 
 
     /**
-     * Trace the bin basing on bitmap
+     * Streaming encoder of the binmap:
+     *
+     *   while( (size = encoder.encode(buffer, sizeof(buffer))) > 0 )
+     *       ... write size bytes of the buffer ...
+     *
+     * The stream is the header (signature, version, sizes of the bitmap
+     * and of the bin, the root bin) followed by the cells in pre-order:
+     * a flag byte with the type of each half (empty, filled, bitmap or
+     * reference) and the bitmaps of the bitmap halves. A cell of two
+     * references is followed by the size of its left subtree instead,
+     * so the stream can be read in place by const_view_t.
+     *
+     * The encoder is invalidated by any change of the binmap.
      */
-    bin_t trace_bin_on_bitmap(const bin_t & bin, bitmap_t bitmap) const;
+    class encoder_t {
+    public:
+
+        /**
+         * Constructor
+         */
+        explicit encoder_t(const basic_binmap_t & binmap);
+
+
+        /**
+         * Destructor
+         */
+        ~encoder_t();
+
+
+        /**
+         * Encode the next bytes of the stream to the buffer
+         *
+         * @return the number of bytes written, 0 at the end of the stream
+         */
+        size_t encode(void * buffer, size_t size);
+
+
+        /**
+         * Whether the whole stream is encoded
+         */
+        bool is_done() const;
+
+
+    private:
+
+        /**
+         * Put the record of the next cell
+         */
+        void next_record();
+
+
+        /**
+         * Get the size of the stream of the subtree, and keep the sizes
+         * of its cells
+         */
+        size_t measure(ref_t ref);
+
+
+        /**
+         * The binmap
+         */
+        const basic_binmap_t * m_binmap;
+
+        /**
+         * Sizes of the streams of the subtrees by cell (NULL on memory
+         * error, they are measured on demand then)
+         */
+        size_t * m_sizes;
+
+        /**
+         * Cells to encode, the next one on the top
+         */
+        ref_t m_stack[128];
+        size_t m_depth;
+
+        /**
+         * The header or the record of the cell being written
+         */
+        unsigned char m_record[16 + 2 * sizeof(bitmap_t)];
+        size_t m_record_size;
+        size_t m_record_pos;
+
+
+        /**
+         * Copy constructor
+         */
+        encoder_t(const encoder_t &); /* undefined */
+
+        /**
+         * Assignment operator
+         */
+        encoder_t & operator = (const encoder_t &); /* undefined */
+    };
+
+    friend class encoder_t;
 
 
     /**
-     * Pointer to the list of blocks
+     * Streaming decoder of the binmap, the stream may be split into
+     * the buffers at any byte:
+     *
+     *   while( ... read size bytes to the buffer ... )
+     *       if( !decoder.decode(buffer, size) )
+     *           ... error ...
+     *   if( !decoder.is_done() )
+     *       ... truncated stream ...
+     *
+     * The binmap is cleared and the cells are allocated in pre-order.
+     * On error the binmap is cleared again; the binmap must not be
+     * used by others until the stream is decoded.
      */
-    cell_t * m_cell;
+    class decoder_t {
+    public:
+
+        /**
+         * Constructor
+         */
+        explicit decoder_t(basic_binmap_t & binmap);
+
+
+        /**
+         * Decode the next bytes of the stream
+         *
+         * @return false on error
+         */
+        bool decode(const void * buffer, size_t size);
+
+
+        /**
+         * Whether the whole stream is decoded
+         */
+        bool is_done() const;
+
+
+    private:
+
+        /**
+         * Get the bin of the next cell
+         */
+        bin_t next_bin() const;
+
+
+        /**
+         * Read the header or the record of a cell
+         */
+        bool read_header();
+        bool read_cell();
+
+
+        /**
+         * Stop decoding on error
+         */
+        bool fail();
+
+
+        /**
+         * The binmap
+         */
+        basic_binmap_t * m_binmap;
+
+        /**
+         * Halves waiting for their cells, the next one on the top
+         */
+        ref_t m_slot_ref[128];
+        bin_t m_slot_bin[128];
+        bool m_slot_right[128];
+        size_t m_slots;
+
+        /**
+         * The header or the record of the cell being read
+         */
+        unsigned char m_record[16 + 2 * sizeof(bitmap_t)];
+        size_t m_record_size;
+        size_t m_record_need;
+
+        /**
+         * Decoding state
+         */
+        bool m_is_header_read;
+        bool m_is_root_read;
+        bool m_is_failed;
+    };
+
+    friend class decoder_t;
+
 
     /**
-     * Number of allocated blocks (16 * cell)
+     * Read-only view of a stream of the encoder: the queries walk the
+     * buffer in place, nothing is allocated or copied, so the buffer may
+     * be a memory-mapped file shared by processes.
+     *
+     * The buffer must hold the whole stream and outlive the view. The
+     * broken parts of the stream read as empty.
      */
-    size_t m_blocks_number;
+    class const_view_t {
+    public:
+
+        /**
+         * Iterator over the maximal runs of filled or empty base bins
+         * of the root, forward
+         */
+        class run_iterator_t {
+        public:
+
+            /**
+             * Constructor
+             */
+            explicit run_iterator_t(const const_view_t & view);
+
+
+            /**
+             * Go to the first run
+             */
+            bool first();
+
+
+            /**
+             * Go to the next run
+             */
+            bool next();
+
+
+            /**
+             * Get the base offset of the run
+             */
+            uint_t offset() const;
+
+
+            /**
+             * Get the number of base bins in the run
+             */
+            uint_t length() const;
+
+
+            /**
+             * Whether the run is filled
+             */
+            bool is_filled() const;
+
+
+        private:
+
+            /**
+             * Read the run starting at the base offset
+             */
+            bool read(uint_t offset);
+
+
+            /**
+             * The view
+             */
+            const const_view_t * m_view;
+
+            /**
+             * The run
+             */
+            uint_t m_offset;
+            uint_t m_end;
+            bool m_is_filled;
+        };
+
+
+        /**
+         * Constructor
+         */
+        const_view_t(const void * buffer, size_t size);
+
+
+        /**
+         * Whether the header of the stream is valid
+         */
+        bool is_valid() const;
+
+
+        /**
+         * Get the root bin
+         */
+        bin_t root_bin() const;
+
+
+        /**
+         * Get bins
+         */
+        bool get(bin_t bin) const;
+
+
+        /**
+         * Whether all the base bins [begin, end) are filled
+         */
+        bool is_filled_range(uint_t begin, uint_t end) const;
+
+
+        /**
+         * Whether all the base bins [begin, end) are empty
+         */
+        bool is_empty_range(uint_t begin, uint_t end) const;
+
+
+        /**
+         * Find first empty bin
+         */
+        bin_t find_empty() const;
+
+
+        /**
+         * Find the leftmost empty bin within the bin
+         */
+        bin_t find_empty(bin_t within) const;
+
+
+        /**
+         * Find the leftmost empty bin at or after the base offset
+         */
+        bin_t find_empty_after(uint_t offset) const;
+
+
+        /**
+         * Find the leftmost filled bin
+         */
+        bin_t find_filled() const;
+
+
+        /**
+         * Find the leftmost filled bin within the bin
+         */
+        bin_t find_filled(bin_t within) const;
+
+
+        /**
+         * Find the leftmost filled bin at or after the base offset
+         */
+        bin_t find_filled_after(uint_t offset) const;
+
+
+    private:
+
+        /**
+         * Cell read from the stream
+         */
+        typedef struct {
+            bitmap_t m_bitmap[2];
+            bool m_is_ref[2];
+            size_t m_pos[2];
+        } view_cell_t;
+
+
+        /**
+         * Read the cell of the bin at the position of the stream
+         *
+         * @return false if the record is broken
+         */
+        bool read_cell(size_t pos, bin_t bin, view_cell_t & cell) const;
+
+
+        /**
+         * Find the leftmost bin of the value within the base bins [begin, end)
+         */
+        bin_t find_value(uint_t begin, uint_t end, bitmap_t value) const;
+
+
+        /**
+         * Find the leftmost bin of the value within [begin, end) under the cell
+         */
+        bin_t find_in_cell(size_t pos, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const;
+
+
+        /**
+         * Check the base bins [begin, end) under the cell for the value
+         */
+        bool check_range(size_t pos, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const;
+
+
+        /**
+         * The stream
+         */
+        const unsigned char * m_buffer;
+        size_t m_size;
+
+        /**
+         * Position of the root cell, and the root bin
+         */
+        size_t m_root_pos;
+        bin_t m_root_bin;
+    };
+
+    friend class const_view_t;
+
 
     /**
-     * Number of allocated cells
+     * Constructor
      */
-    size_t m_cells_number;
+    basic_binmap_t();
+
 
     /**
-     * Front of the free cell list
+     * Constructor of a binmap with the cells in the arena, the copies
+     * share the arena
      */
-    ref_t m_free_top;
+    explicit basic_binmap_t(binmap_arena_t & arena);
+
 
     /**
-     * The root bin
+     * Copy constructor, the copy is compact
      */
-    bin_t m_root_bin;
+    basic_binmap_t(const basic_binmap_t & source);
 
 
     /**
-     * Copy constructor
+     * Destructor
      */
-    binmap_t(const binmap_t &); /* undefined */
-};
+    ~basic_binmap_t();
+
+
+    /**
+     * Assignment operator
+     */
+    basic_binmap_t & operator = (const basic_binmap_t & source);
+
+
+#if __cplusplus >= 201103L
+
+    /**
+     * Move constructor
+     */
+    basic_binmap_t(basic_binmap_t && source);
+
+
+    /**
+     * Move assignment operator
+     */
+    basic_binmap_t & operator = (basic_binmap_t && source);
+
+#endif
+
+
+    /**
+     * Swap the bins with another binmap
+     */
+    void swap(basic_binmap_t & other);
+
+
+    /**
+     * Get bins
+     */
+    bool get(bin_t bin) const;
+
+
+    /**
+     * Set bins
+     */
+    void set(bin_t bin);
+
+
+    /**
+     * Reset bins
+     */
+    void reset(bin_t bin);
+
+
+    /**
+     * Set the base bins [begin, end)
+     */
+    void set_range(uint_t begin, uint_t end);
+
+
+    /**
+     * Reset the base bins [begin, end)
+     */
+    void reset_range(uint_t begin, uint_t end);
+
+
+    /**
+     * Set a sorted array of bins
+     */
+    void set(const bin_t * bins, size_t count);
+
+
+    /**
+     * Set a sorted array of extents
+     */
+    void set(const extent_t * extents, size_t count);
+
+
+    /**
+     * Reset a sorted array of bins
+     */
+    void reset(const bin_t * bins, size_t count);
+
+
+    /**
+     * Reset a sorted array of extents
+     */
+    void reset(const extent_t * extents, size_t count);
+
+
+    /**
+     * Reset all bins
+     */
+    void clear();
+
+
+    /**
+     * Set the bins filled in the other binmap (union)
+     */
+    void set_union(const basic_binmap_t & other);
+
+
+    /**
+     * Reset the bins empty in the other binmap (intersection)
+     */
+    void set_intersection(const basic_binmap_t & other);
+
+
+    /**
+     * Reset the bins filled in the other binmap (difference)
+     */
+    void set_difference(const basic_binmap_t & other);
+
+
+    /**
+     * Flip the bins filled in the other binmap (symmetric difference)
+     */
+    void set_symmetric_difference(const basic_binmap_t & other);
+
+
+    /**
+     * Assign the union of two binmaps
+     */
+    void set_union(const basic_binmap_t & a, const basic_binmap_t & b);
+
+
+    /**
+     * Assign the intersection of two binmaps
+     */
+    void set_intersection(const basic_binmap_t & a, const basic_binmap_t & b);
+
+
+    /**
+     * Assign the difference of two binmaps
+     */
+    void set_difference(const basic_binmap_t & a, const basic_binmap_t & b);
+
+
+    /**
+     * Assign the symmetric difference of two binmaps
+     */
+    void set_symmetric_difference(const basic_binmap_t & a, const basic_binmap_t & b);
+
+
+    /**
+     * Assign the bitmap of the base bins [0, bits), the bit k of
+     * the byte i is the base bin 8 * i + k
+     */
+    void assign_from_bitmap(const void * bitmap, size_t bits, int threads = 1);
+
+
+    /**
+     * Copy the base bins of the range to a bitmap of
+     * (range.base_length() + 7) / 8 bytes, the bit k of the byte i
+     * is the base bin range.base_offset() + 8 * i + k
+     */
+    void to_bitmap(bin_t range, void * bitmap) const;
+
+
+    /**
+     * Whether all the base bins [begin, end) are filled
+     */
+    bool is_filled_range(uint_t begin, uint_t end) const;
+
+
+    /**
+     * Whether all the base bins [begin, end) are empty
+     */
+    bool is_empty_range(uint_t begin, uint_t end) const;
+
+
+    /**
+     * Find first empty bin
+     */
+    bin_t find_empty() const;
+
+
+    /**
+     * Find the leftmost empty bin within the bin
+     */
+    bin_t find_empty(bin_t within) const;
+
+
+    /**
+     * Find the leftmost empty bin at or after the base offset
+     */
+    bin_t find_empty_after(uint_t offset) const;
+
+
+    /**
+     * Find the leftmost filled bin
+     */
+    bin_t find_filled() const;
+
+
+    /**
+     * Find the leftmost filled bin within the bin
+     */
+    bin_t find_filled(bin_t within) const;
+
+
+    /**
+     * Find the leftmost filled bin at or after the base offset
+     */
+    bin_t find_filled_after(uint_t offset) const;
+
+
+    /**
+     * Find the leftmost bin within the bin filled in have but empty in mine
+     */
+    static bin_t find_complement(const basic_binmap_t & have, const basic_binmap_t & mine, bin_t within);
+
+
+    /**
+     * Start maintaining the counts of filled base bins under the cells
+     *
+     * @return false on memory error
+     */
+    bool enable_counts();
+
+
+    /**
+     * Stop maintaining the counts
+     */
+    void disable_counts();
+
+
+    /**
+     * Whether the counts are maintained
+     */
+    bool is_counting() const;
+
+
+    /**
+     * Get the number of filled base bins
+     */
+    uint_t count() const;
+
+
+    /**
+     * Get the number of filled base bins of the bin
+     */
+    uint_t count(bin_t bin) const;
+
+
+    /**
+     * Get the number of filled base bins before the base offset
+     */
+    uint_t rank(uint_t offset) const;
+
+
+    /**
+     * Get the k-th (from 0) filled or empty base bin
+     */
+    bin_t select(uint_t k, bool filled = true) const;
+
+
+    /**
+     * Keep the cells in the memory-mapped file: an existing binmap file
+     * is opened and replaces the bins, a new or empty file receives the
+     * current bins. The file grows with the binmap and is closed by
+     * the destructor; it can be read by the same build only.
+     *
+     * @return false on error, the binmap is unchanged then
+     */
+    bool open_file(const char * path);
+
+
+    /**
+     * Write the changes of the file-backed binmap to the disk
+     *
+     * @return false on error
+     */
+    bool sync();
+
+
+    /**
+     * Whether the cells are kept in a file
+     */
+    bool is_file_backed() const;
+
+
+    /**
+     * Move the cells to the front of the cell buffer and release the rest
+     */
+    void compact();
+
+
+    /**
+     * Move a part of the cells to the front of the cell buffer, visiting
+     * at most max_cells cells; the binmap may change between the calls.
+     * The rest of the buffer is released when the pass is complete.
+     *
+     * @return whether the pass is complete
+     */
+    bool compact_step(size_t max_cells);
+
+
+    /**
+     * Release the free blocks at the end of the cell buffer
+     */
+    void shrink_to_fit();
+
+
+    /**
+     * Allocate the blocks for the number of cells at once
+     *
+     * The buffers on the heap are moved to an address range reserved
+     * for the number of cells, and grow in place up to it. Past it, the
+     * buffers are moved to a range twice as big.
+     *
+     * With huge pages the cells are advised to be on the transparent
+     * ones, the range keeps the advice as it moves.
+     *
+     * @return false on error
+     */
+    bool reserve(size_t cells, bool is_huge_pages = false);
+
+
+    /**
+     * Lay the cells out in the van Emde Boas order and release the rest
+     * of the cell buffer, so the traces from the root touch few blocks
+     *
+     * @return false on error, the binmap is not changed then
+     */
+    bool relayout();
+
+
+    /**
+     * Drop the base bins before the offset: the root moves down onto its
+     * right half while the left half is before the offset, and the rest
+     * of the dropped bins is reset
+     *
+     * The changes logged after it are in the shifted offsets, so a
+     * binmap with a log is dropped through basic_binlog_t::drop_before()
+     * for the replay to shift them too.
+     *
+     * @return the number of base bins the offsets are shifted down by
+     */
+    uint_t drop_before(uint_t offset);
+
+
+    /**
+     * Get blocks number, 0 while the root cell is kept in the object
+     */
+    size_t blocks_number() const;
+
+
+    /**
+     * Get the address of the cell buffer, kept while the cells grow in
+     * a reserved range
+     */
+    const void * cell_buffer() const;
+
+
+    /**
+     * Get cells number
+     */
+    size_t cells_number() const;
+
+
+    /**
+     * Get total size of the binmap
+     */
+    size_t total_size() const;
+
+
+    /**
+     * Echo the binmap status to stdout
+     */
+    void status() const;
+
+
+private:
+
+    /**
+     * Leaf bitmap policy
+     */
+    typedef bitmap_traits<bitmap_t> bitmap_policy;
+
+
+    /**
+     * Resize the cell and the flag buffers to the number of blocks,
+     * on the heap or in the file
+     */
+    bool realloc_blocks(size_t new_size);
+
+
+    /**
+     * Release the cell and the flag buffers, on the heap or in the arena
+     */
+    void free_blocks();
+
+
+    /**
+     * Move the buffers to an address range reserved for the number
+     * of blocks
+     */
+    bool reserve_region(size_t max_blocks, bool is_huge_pages);
+
+
+    /**
+     * Commit the pages of the reserved range for the number of blocks
+     * and the number of counts
+     */
+    bool commit_region(size_t new_size, size_t count_size);
+
+
+    /**
+     * Resize the count buffer, 0 releases it
+     */
+    bool resize_counts(size_t size);
+
+
+    /**
+     * Whether the left half of the cell is a reference
+     */
+    bool is_left_ref(ref_t ref) const;
+
+
+    /**
+     * Whether the right half of the cell is a reference
+     */
+    bool is_right_ref(ref_t ref) const;
+
+
+    /**
+     * Whether the half of the cell is a reference
+     */
+    bool is_half_ref(ref_t ref, bool right) const;
+
+
+    /**
+     * Mark the left half of the cell as a reference or a bitmap
+     */
+    void set_left_ref(ref_t ref, bool is_ref);
+
+
+    /**
+     * Mark the right half of the cell as a reference or a bitmap
+     */
+    void set_right_ref(ref_t ref, bool is_ref);
+
+
+    /**
+     * Whether the cell is free
+     */
+    bool is_free(ref_t ref) const;
+
+
+    /**
+     * Mark the cell as free or used
+     */
+    void set_free(ref_t ref, bool is_free);
+
+
+    /**
+     * Copy the cell of a binmap with its reference flags
+     */
+    void copy_cell(ref_t ref, const basic_binmap_t & source, ref_t source_ref);
+
+
+    /**
+     * Store the state of the binmap to the header of the file
+     */
+    void write_file_header();
+
+
+    /**
+     * Extend the cell buffer to the number of blocks
+     */
+    bool extend_blocks(size_t new_size);
+
+
+    /**
+     * Allocates one cell
+     */
+    ref_t alloc_cell();
+
+
+    /**
+     * Allocates one cell for a child of the cell
+     */
+    ref_t alloc_child_cell(ref_t parent);
+
+
+    /**
+     * Remove the cell from the free cell list
+     */
+    void unlink_free_cell(ref_t ref);
+
+
+    /**
+     * Take the free cell to use it
+     */
+    ref_t take_free_cell(ref_t ref);
+
+
+    /**
+     * Move the cells of the subtree from the compaction offset on
+     */
+    bool compact_cells(ref_t ref, bin_t bin, size_t & budget);
+
+
+    /**
+     * Move the cell of the half to the front of the cell buffer
+     */
+    void move_cell(ref_t ref, bool right);
+
+
+    /**
+     * Put the cells of the top height levels of the subtree to the order
+     */
+    void order_cells(ref_t ref, size_t height, ref_t * order, size_t & number) const;
+
+
+    /**
+     * Put the subtrees of the given height at the given depth under the
+     * cell to the order
+     */
+    void order_subtrees(ref_t ref, size_t depth, size_t height, ref_t * order, size_t & number) const;
+
+
+    /**
+     * Releases the cell
+     */
+    void free_cell(ref_t cell);
+
+
+    /**
+     * Extend root
+     */
+    void extend_root();
+
+
+    /**
+     * Parse the header of a stream
+     */
+    static bool parse_header(const unsigned char * header, bin_t & root_bin);
+
+
+    /**
+     * Rebuild the list of free cells in the ascending order
+     */
+    void reset_free_cells();
+
+
+    /**
+     * Unpack the left half of a cell
+     */
+    ref_t unpack_left_half(ref_t cell);
+
+
+    /**
+     * Unpack the right half of a cell
+     */
+    ref_t unpack_right_half(ref_t cell);
+
+
+    /**
+     * Pack a trace of cells
+     */
+    void pack_cells(ref_t * cells);
+
+
+    /**
+     * Trace the bin basing on bitmap
+     */
+    bin_t trace_bin_on_bitmap(const bin_t & bin, bitmap_t bitmap) const;
+
+
+    /**
+     * Fill or clear the base bins of the sorted items under the cell
+     */
+    template <class item_t>
+    void update_items(ref_t ref, bin_t bin, const item_t * first, const item_t * last, bitmap_t value);
+
+
+    /**
+     * Set or reset the sorted items in a single pass
+     */
+    template <class item_t>
+    void update_items(const item_t * items, size_t count, bitmap_t value);
+
+
+    /**
+     * Base offsets of the items
+     */
+    static uint_t item_begin(const bin_t & bin);
+    static uint_t item_end(const bin_t & bin);
+    static uint_t item_begin(const extent_t & extent);
+    static uint_t item_end(const extent_t & extent);
+
+
+    /**
+     * Check the base bins [begin, end) under the cell for the value
+     */
+    bool check_range(ref_t ref, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const;
+
+
+    /**
+     * Check the base bins [begin, end) under a packed half for the value
+     */
+    static bool check_half_range(bitmap_t bitmap, bin_t bin, uint_t begin, uint_t end, bitmap_t value);
+
+
+    /**
+     * Find the leftmost bin of the value within the base bins [begin, end)
+     */
+    bin_t find_value(uint_t begin, uint_t end, bitmap_t value) const;
+
+
+    /**
+     * Find the leftmost bin of the value within [begin, end) under the cell
+     */
+    bin_t find_in_cell(ref_t ref, bin_t bin, uint_t begin, uint_t end, bitmap_t value) const;
+
+
+    /**
+     * Find the leftmost bin of the value within [begin, end) under a packed half
+     */
+    static bin_t find_in_half(bitmap_t bitmap, bin_t bin, uint_t begin, uint_t end, bitmap_t value);
+
+
+    /**
+     * Trace the half of the bin inside of the root
+     */
+    bool trace_half(bin_t target, half_t & half) const;
+
+
+    /**
+     * Find the leftmost bin within [begin, end) under the halves of the bin
+     * filled in have but empty in mine
+     */
+    static bin_t find_complement_half(const basic_binmap_t & have, half_t have_half, bool have_is_ref, const basic_binmap_t & mine, half_t mine_half, bool mine_is_ref, bin_t bin, uint_t begin, uint_t end);
+
+
+    /**
+     * Get the biggest bin starting at the base offset begin inside of [begin, end)
+     */
+    static bin_t aligned_bin(uint_t begin, uint_t end);
+
+
+    /**
+     * Get the number of filled base bins of a half
+     */
+    uint_t half_count(const half_t & half, bool is_ref, bin_t bin) const;
+
+
+    /**
+     * Get the number of filled base bins of the cell
+     */
+    uint_t cell_count(ref_t ref, bin_t bin) const;
+
+
+    /**
+     * Recount the filled base bins of the cell from its halves
+     */
+    void recount_cell(ref_t ref, bin_t bin);
+
+
+    /**
+     * Recount the cells of the subtree
+     */
+    void recount_cells(ref_t ref, bin_t bin);
+
+
+    /**
+     * Recount the live cells of a trace towards the bin, bottom-up
+     */
+    void recount_trace(const ref_t * first, const ref_t * last, bin_t bin);
+
+
+    /**
+     * Set operations
+     */
+    enum {
+        OP_UNION,
+        OP_INTERSECTION,
+        OP_DIFFERENCE,
+        OP_XOR
+    };
+
+
+    /**
+     * Copy the bins of another binmap
+     */
+    void copy_from(const basic_binmap_t & source);
+
+
+    /**
+     * Apply the set operation to two bitmaps
+     */
+    static bitmap_t apply_op(bitmap_t a, bitmap_t b, int op);
+
+
+    /**
+     * Set a half of the cell
+     */
+    void set_half(ref_t ref, bool right, const half_t & half, bool is_ref);
+
+
+    /**
+     * Pack the half of the cell if its cell has equal bitmaps
+     */
+    void pack_half(ref_t ref, bool right);
+
+
+    /**
+     * Apply the set operation with a packed half of the other binmap
+     * to all the halves under the cell
+     */
+    void apply_bitmap(ref_t ref, bin_t bin, bitmap_t bitmap, int op);
+
+
+    /**
+     * Apply the set operation with a half of the other binmap to a half of the cell
+     */
+    void combine_half(ref_t ref, bool right, bin_t half_bin, const basic_binmap_t & other, half_t other_half, bool other_is_ref, int op);
+
+
+    /**
+     * Apply the set operation with a cell of the other binmap to the cell
+     */
+    void combine_cell(ref_t ref, bin_t bin, const basic_binmap_t & other, ref_t other_ref, int op);
+
+
+    /**
+     * Apply the set operation with the other binmap in place
+     */
+    void combine(const basic_binmap_t & other, int op);
+
+
+    /**
+     * Assign the result of the set operation with two binmaps
+     */
+    void combine(const basic_binmap_t & a, const basic_binmap_t & b, int op);
+
+
+    /**
+     * Subtree built by a thread, and the thread
+     */
+    struct build_task_t;
+    struct build_worker_t;
+
+
+    /**
+     * Build the half of the bin bottom-up from the bitmap
+     */
+    bool build_half(half_t & half, bin_t bin, const unsigned char * bitmap, uint_t bits);
+
+
+    /**
+     * Build the half of the bin from the subtrees built by threads
+     */
+    bool stitch_half(half_t & half, bin_t bin, const build_task_t * tasks, size_t count);
+
+
+    /**
+     * Join two halves to the half of their parent bin
+     */
+    bool join_halves(half_t & half, bin_t bin, const half_t & left, bool is_left_ref, const half_t & right, bool is_right_ref);
+
+
+    /**
+     * Copy the subtree of the cell from another binmap
+     */
+    ref_t copy_cells(const basic_binmap_t & source, ref_t ref, bin_t bin);
+
+
+    /**
+     * Build the subtrees of a thread
+     */
+    static void build_worker(void * arg);
+
+
+    /**
+     * Copy the base bins of the cell to a bitmap
+     */
+    void copy_cell_to_bitmap(ref_t ref, bin_t bin, unsigned char * out) const;
+
+
+    /**
+     * Copy the base bins [offset, offset + length) of a packed half
+     * (repeating the bitmap) to a bitmap
+     */
+    static void copy_half_to_bitmap(bitmap_t bitmap, uint_t offset, uint_t length, unsigned char * out);
+
+
+    /**
+     * Pointer to the list of blocks
+     */
+    cell_t * m_cell;
+
+    /**
+     * Flags of the blocks
+     */
+    flags_t * m_flags;
+
+    /**
+     * Number of allocated blocks (16 * cell)
+     */
+    size_t m_blocks_number;
+
+    /**
+     * Number of allocated cells
+     */
+    size_t m_cells_number;
+
+    /**
+     * Front of the free cell list
+     */
+    ref_t m_free_top;
+
+    /**
+     * The root bin
+     */
+    bin_t m_root_bin;
+
+    /**
+     * Numbers of filled base bins under the cells (NULL if not counting)
+     */
+    uint_t * m_count;
+
+    /**
+     * File of the cells (NULL if the cells are on the heap)
+     */
+    binmap_file_t * m_file;
+
+    /**
+     * Arena of the cells (NULL if the cells are on the heap)
+     */
+    binmap_arena_t * m_arena;
+
+    /**
+     * Reserved range of the cells (NULL if the cells are not in one)
+     */
+    binmap_region_t * m_region;
+
+    /**
+     * The root cell and its flags while no blocks are allocated
+     */
+    cell_t m_root_cell;
+    flags_t m_root_flags;
+
+    /**
+     * Base offset of the subtrees to compact next, and whether
+     * the compaction pass has started
+     */
+    uint_t m_compact_offset;
+    bool m_is_compacting;
+};
+
+
+#if __cplusplus >= 201103L
+
+/**
+ * Move constructor, the source is left empty
+ *
+ * Defined here, so it is available when the library is built as C++98.
+ */
+template <class traits>
+inline basic_binmap_t<traits>::basic_binmap_t(basic_binmap_t && source) : basic_binmap_t() {
+    swap(source);
+}
+
+
+/**
+ * Move assignment operator, the source gets the old bins
+ */
+template <class traits>
+inline basic_binmap_t<traits> & basic_binmap_t<traits>::operator = (basic_binmap_t && source) {
+    swap(source);
+    return *this;
+}
+
+#endif
+
+
+/**
+ * Binmap over a sliding window of base bins, for live streams
+ *
+ * The base of the window only moves forward, drop_before() releases the
+ * bins before it and keeps the depth and the size of the binmap bounded
+ * by the window. The bins before the base read as empty and the changes
+ * of them are ignored.
+ */
+template <class traits>
+class basic_binmap_window_t {
+public:
+
+    /**
+     * Type of the binmap
+     */
+    typedef basic_binmap_t<traits> binmap_type;
+
+    /**
+     * Type of bin
+     */
+    typedef typename binmap_type::bin_t bin_t;
+
+    /**
+     * Type of base offsets
+     */
+    typedef typename binmap_type::uint_t uint_t;
+
+
+    /**
+     * Constructor
+     */
+    basic_binmap_window_t();
+
+
+    /**
+     * Set bins
+     */
+    void set(bin_t bin);
+
+
+    /**
+     * Reset bins
+     */
+    void reset(bin_t bin);
+
+
+    /**
+     * Whether the bin is filled
+     */
+    bool get(bin_t bin) const;
+
+
+    /**
+     * Set the base bins [begin, end)
+     */
+    void set_range(uint_t begin, uint_t end);
+
+
+    /**
+     * Reset the base bins [begin, end)
+     */
+    void reset_range(uint_t begin, uint_t end);
+
+
+    /**
+     * Whether all the base bins [begin, end) are filled
+     */
+    bool is_filled_range(uint_t begin, uint_t end) const;
+
+
+    /**
+     * Whether all the base bins [begin, end) are empty
+     */
+    bool is_empty_range(uint_t begin, uint_t end) const;
+
+
+    /**
+     * Move the base of the window forward to the offset
+     */
+    void drop_before(uint_t offset);
+
+
+    /**
+     * Get the base offset of the window
+     */
+    uint_t base() const;
+
+
+    /**
+     * Get the binmap, its base bins start at the offset shift()
+     */
+    const binmap_type & binmap() const;
+
+
+    /**
+     * Get the offset of the first base bin of the binmap
+     */
+    uint_t shift() const;
+
+
+private:
+
+    /**
+     * Move the range into the binmap, false if it is before the base
+     */
+    bool to_binmap(uint_t & begin, uint_t & end) const;
+
+
+    /**
+     * The binmap
+     */
+    binmap_type m_binmap;
+
+    /**
+     * Base offset of the window
+     */
+    uint_t m_base;
+
+    /**
+     * Offset of the first base bin of the binmap
+     */
+    uint_t m_shift;
+
+
+    /**
+     * Copy constructor
+     */
+    basic_binmap_window_t(const basic_binmap_window_t &); /* undefined */
+
+    /**
+     * Assignment operator
+     */
+    basic_binmap_window_t & operator = (const basic_binmap_window_t &); /* undefined */
+};
+
+
+/**
+ * Binmap over 32-bit bins
+ */
+typedef basic_binmap_t< binmap_traits<bin_t> > binmap_t;
+
+/**
+ * Binmap over 64-bit bins
+ */
+typedef basic_binmap_t< binmap_traits<bin64_t> > binmap64_t;
+
+/**
+ * Binmap over 64-bit bins with 64-bit references, for the binmaps of
+ * more than 2^32 cells
+ */
+typedef basic_binmap_t< binmap_traits<bin64_t, bitmap32_t, uint64_t> > wide_binmap64_t;
+
+/**
+ * Sliding windows over 32-bit and 64-bit bins
+ */
+typedef basic_binmap_window_t< binmap_traits<bin_t> > binmap_window_t;
+typedef basic_binmap_window_t< binmap_traits<bin64_t> > binmap64_window_t;
+
+/**
+ * Read-only views of the streams of the binmaps
+ */
+typedef binmap_t::const_view_t const_binmap_view_t;
+typedef binmap64_t::const_view_t const_binmap64_view_t;
 
 #endif // BINMAP_H
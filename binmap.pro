@@ -7,7 +7,11 @@ TEMPLATE = lib
 CONFIG  += staticlib
 DEFINES += BINMAP_LIBRARY
 SOURCES += bin.cpp \
-           binmap.cpp
+           bitmap.cpp \
+           binmap.cpp \
+           binlog.cpp
 HEADERS += bin.h \
-           binmap.h
+           bitmap.h \
+           binmap.h \
+           binlog.h
 
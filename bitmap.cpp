@@ -0,0 +1,351 @@
+/*
+ *  bitmap.cpp
+ *  binmap
+ *
+ *  Leaf bitmap policies.
+ *
+ */
+#include <cassert>
+
+#include "bitmap.h"
+
+
+/* Constants */
+const bitmap32_t bitmap_traits<bitmap32_t>::EMPTY;
+const bitmap32_t bitmap_traits<bitmap32_t>::FILLED;
+const unsigned int bitmap_traits<bitmap32_t>::LAYER_BITS;
+
+const bitmap64_t bitmap_traits<bitmap64_t>::EMPTY;
+const bitmap64_t bitmap_traits<bitmap64_t>::FILLED;
+const unsigned int bitmap_traits<bitmap64_t>::LAYER_BITS;
+
+const bitmap128_t bitmap_traits<bitmap128_t>::EMPTY = { { 0, 0 } };
+const bitmap128_t bitmap_traits<bitmap128_t>::FILLED = { { ~0ULL, ~0ULL } };
+const unsigned int bitmap_traits<bitmap128_t>::LAYER_BITS;
+
+const bitmap256_t bitmap_traits<bitmap256_t>::EMPTY = { { 0, 0, 0, 0 } };
+const bitmap256_t bitmap_traits<bitmap256_t>::FILLED = { { ~0ULL, ~0ULL, ~0ULL, ~0ULL } };
+const unsigned int bitmap_traits<bitmap256_t>::LAYER_BITS;
+
+const bitmap32_t bitmap_traits<bitmap32_t>::BITMAP[] = {
+    static_cast<bitmap32_t>(0x00000001), static_cast<bitmap32_t>(0x00000003),
+    static_cast<bitmap32_t>(0x00000002), static_cast<bitmap32_t>(0x0000000f),
+    static_cast<bitmap32_t>(0x00000004), static_cast<bitmap32_t>(0x0000000c),
+    static_cast<bitmap32_t>(0x00000008), static_cast<bitmap32_t>(0x000000ff),
+    static_cast<bitmap32_t>(0x00000010), static_cast<bitmap32_t>(0x00000030),
+    static_cast<bitmap32_t>(0x00000020), static_cast<bitmap32_t>(0x000000f0),
+    static_cast<bitmap32_t>(0x00000040), static_cast<bitmap32_t>(0x000000c0),
+    static_cast<bitmap32_t>(0x00000080), static_cast<bitmap32_t>(0x0000ffff),
+    static_cast<bitmap32_t>(0x00000100), static_cast<bitmap32_t>(0x00000300),
+    static_cast<bitmap32_t>(0x00000200), static_cast<bitmap32_t>(0x00000f00),
+    static_cast<bitmap32_t>(0x00000400), static_cast<bitmap32_t>(0x00000c00),
+    static_cast<bitmap32_t>(0x00000800), static_cast<bitmap32_t>(0x0000ff00),
+    static_cast<bitmap32_t>(0x00001000), static_cast<bitmap32_t>(0x00003000),
+    static_cast<bitmap32_t>(0x00002000), static_cast<bitmap32_t>(0x0000f000),
+    static_cast<bitmap32_t>(0x00004000), static_cast<bitmap32_t>(0x0000c000),
+    static_cast<bitmap32_t>(0x00008000), static_cast<bitmap32_t>(0xffffffff),
+    static_cast<bitmap32_t>(0x00010000), static_cast<bitmap32_t>(0x00030000),
+    static_cast<bitmap32_t>(0x00020000), static_cast<bitmap32_t>(0x000f0000),
+    static_cast<bitmap32_t>(0x00040000), static_cast<bitmap32_t>(0x000c0000),
+    static_cast<bitmap32_t>(0x00080000), static_cast<bitmap32_t>(0x00ff0000),
+    static_cast<bitmap32_t>(0x00100000), static_cast<bitmap32_t>(0x00300000),
+    static_cast<bitmap32_t>(0x00200000), static_cast<bitmap32_t>(0x00f00000),
+    static_cast<bitmap32_t>(0x00400000), static_cast<bitmap32_t>(0x00c00000),
+    static_cast<bitmap32_t>(0x00800000), static_cast<bitmap32_t>(0xffff0000),
+    static_cast<bitmap32_t>(0x01000000), static_cast<bitmap32_t>(0x03000000),
+    static_cast<bitmap32_t>(0x02000000), static_cast<bitmap32_t>(0x0f000000),
+    static_cast<bitmap32_t>(0x04000000), static_cast<bitmap32_t>(0x0c000000),
+    static_cast<bitmap32_t>(0x08000000), static_cast<bitmap32_t>(0xff000000),
+    static_cast<bitmap32_t>(0x10000000), static_cast<bitmap32_t>(0x30000000),
+    static_cast<bitmap32_t>(0x20000000), static_cast<bitmap32_t>(0xf0000000),
+    static_cast<bitmap32_t>(0x40000000), static_cast<bitmap32_t>(0xc0000000),
+    static_cast<bitmap32_t>(0x80000000), /* special */ static_cast<bitmap32_t>(0xffffffff) /* special */
+};
+
+
+/**
+ * Get the leftmost bin that coresponded to bitmap (the bin is filled in bitmap)
+ */
+unsigned int bitmap_traits<bitmap32_t>::to_bin(register bitmap32_t b) {
+    static const unsigned char BITMAP_TO_BIN[] = {
+        -1, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        12, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        14, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         9, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        13, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+         8, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        10, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 3,
+        11, 0, 2, 1, 4, 0, 2, 1, 6, 0, 2, 1, 5, 0, 2, 7
+    };
+
+    assert( sizeof(bitmap32_t) <= 4 );
+    assert( b != EMPTY );
+
+    unsigned char t;
+
+    t = BITMAP_TO_BIN[ b & 0xff ];
+    if( t < 16 ) {
+        if( t != 7 )
+            return static_cast<unsigned int>(t);
+
+        b += 1;
+        b &= -b;
+        if( !b )
+            return LAYER_BITS / 2;
+        if( b >= 0x10000 )
+            return 15;
+        return 7;
+    }
+
+    b >>= 8;
+    t = BITMAP_TO_BIN[ b & 0xff ];
+    if( t <= 15 )
+            return 16 + t;
+
+    /* Recursion */
+    // return 32 + bitmap_to_bin( b >> 16 );
+
+    assert( sizeof(bitmap32_t) == 4 );
+
+    b >>= 8;
+    t = BITMAP_TO_BIN[ b & 0xff ];
+    if( t < 16 ) {
+        if( t != 7 )
+            return 32 + static_cast<unsigned int>(t);
+
+        b += 1;
+        b &= -b;
+        if( b >= 0x10000 )
+            return 47;
+        return 39;
+    }
+
+    return 48 + BITMAP_TO_BIN[ b >> 8 ];
+}
+
+
+/**
+ * Get the bitmap of the base bins [begin, end)
+ */
+bitmap32_t bitmap_traits<bitmap32_t>::range(unsigned int begin, unsigned int end) {
+    assert( begin < end && end <= 32 );
+
+    const bitmap32_t b = (end - begin == 32) ? FILLED : ((static_cast<bitmap32_t>(1) << (end - begin)) - 1);
+    return b << begin;
+}
+
+
+/* Word-based bitmaps */
+
+/**
+ * Count trailing zeros of a non-zero word
+ */
+static inline unsigned int ctz64(uint64_t w) {
+    assert( w != 0 );
+
+#if defined(__GNUC__)
+    return static_cast<unsigned int>(__builtin_ctzll(w));
+#else
+    unsigned int r = 0;
+    while( !(w & 1) ) {
+        w >>= 1;
+        ++r;
+    }
+    return r;
+#endif
+}
+
+
+/**
+ * Floor of log2 of a non-zero value
+ */
+static inline unsigned int log2_floor(uint64_t v) {
+    assert( v != 0 );
+
+    unsigned int r = 0;
+    while( v >>= 1 )
+        ++r;
+    return r;
+}
+
+
+/**
+ * Get the bitmap of the bin (idx = bin & LAYER_BITS) over n words
+ */
+static inline void words_bin(uint64_t * w, unsigned int n, unsigned int idx) {
+    const unsigned int layer = ctz64(~static_cast<uint64_t>(idx));
+
+    if( (1U << layer) >= 64 * n ) {
+        for(unsigned int i = 0; i < n; ++i)
+            w[i] = ~0ULL;
+        return;
+    }
+
+    const unsigned int begin = (idx >> (layer + 1)) << layer;
+    const unsigned int end = begin + (1U << layer);
+
+    for(unsigned int i = 0; i < n; ++i) {
+        const unsigned int lo = 64 * i;
+        const unsigned int hi = lo + 64;
+
+        if( end <= lo || hi <= begin )
+            w[i] = 0;
+        else if( begin <= lo && hi <= end )
+            w[i] = ~0ULL;
+        else
+            w[i] = ((end - begin == 64) ? ~0ULL : ((1ULL << (end - begin)) - 1)) << (begin - lo);
+    }
+}
+
+
+/**
+ * Get the bitmap of the base bins [begin, end) over n words
+ */
+static inline void words_range(uint64_t * w, unsigned int n, unsigned int begin, unsigned int end) {
+    assert( begin < end && end <= 64 * n );
+
+    for(unsigned int i = 0; i < n; ++i) {
+        const unsigned int lo = (begin > 64 * i) ? begin - 64 * i : 0;
+        const unsigned int hi = (end < 64 * (i + 1)) ? end - 64 * i : 64;
+
+        if( end <= 64 * i || 64 * (i + 1) <= begin )
+            w[i] = 0;
+        else if( hi - lo == 64 )
+            w[i] = ~0ULL;
+        else
+            w[i] = ((1ULL << (hi - lo)) - 1) << lo;
+    }
+}
+
+
+/**
+ * Get the leftmost bin filled in the bitmap of n words
+ */
+static inline unsigned int words_to_bin(const uint64_t * w, unsigned int n) {
+    unsigned int i = 0;
+    while( w[i] == 0 ) {
+        ++i;
+        assert( i < n );
+    }
+
+    unsigned int layer;
+
+    if( w[i] != ~0ULL ) {
+        /* The bin is inside of the word */
+        const unsigned int p = ctz64(w[i]);
+        const uint64_t x = ~(w[i] >> p);
+
+        layer = log2_floor(ctz64(x));
+        if( p != 0 && ctz64(p) < layer )
+            layer = ctz64(p);
+
+        return 2 * (64 * i + p) + (1U << layer) - 1;
+    }
+
+    /* The bin is a run of filled words */
+    unsigned int k = 1;
+    while( i + k < n && w[i + k] == ~0ULL )
+        ++k;
+
+    layer = log2_floor(k);
+    if( i != 0 && ctz64(i) < layer )
+        layer = ctz64(i);
+    layer += 6;
+
+    return 2 * (64 * i) + (1U << layer) - 1;
+}
+
+
+/**
+ * Get the bitmap of the bin
+ */
+bitmap64_t bitmap_traits<bitmap64_t>::bin(unsigned int idx) {
+    bitmap64_t b;
+    words_bin(&b, 1, idx);
+    return b;
+}
+
+
+/**
+ * Get the bitmap of the base bins [begin, end)
+ */
+bitmap64_t bitmap_traits<bitmap64_t>::range(unsigned int begin, unsigned int end) {
+    bitmap64_t b;
+    words_range(&b, 1, begin, end);
+    return b;
+}
+
+
+/**
+ * Get the leftmost bin that coresponded to bitmap (the bin is filled in bitmap)
+ */
+unsigned int bitmap_traits<bitmap64_t>::to_bin(bitmap64_t b) {
+    assert( b != EMPTY );
+    return words_to_bin(&b, 1);
+}
+
+
+/**
+ * Get the bitmap of the bin
+ */
+bitmap128_t bitmap_traits<bitmap128_t>::bin(unsigned int idx) {
+    bitmap128_t b;
+    words_bin(b.m_w, 2, idx);
+    return b;
+}
+
+
+/**
+ * Get the bitmap of the base bins [begin, end)
+ */
+bitmap128_t bitmap_traits<bitmap128_t>::range(unsigned int begin, unsigned int end) {
+    bitmap128_t b;
+    words_range(b.m_w, 2, begin, end);
+    return b;
+}
+
+
+/**
+ * Get the leftmost bin that coresponded to bitmap (the bin is filled in bitmap)
+ */
+unsigned int bitmap_traits<bitmap128_t>::to_bin(const bitmap128_t & b) {
+    assert( b != EMPTY );
+    return words_to_bin(b.m_w, 2);
+}
+
+
+/**
+ * Get the bitmap of the bin
+ */
+bitmap256_t bitmap_traits<bitmap256_t>::bin(unsigned int idx) {
+    bitmap256_t b;
+    words_bin(b.m_w, 4, idx);
+    return b;
+}
+
+
+/**
+ * Get the bitmap of the base bins [begin, end)
+ */
+bitmap256_t bitmap_traits<bitmap256_t>::range(unsigned int begin, unsigned int end) {
+    bitmap256_t b;
+    words_range(b.m_w, 4, begin, end);
+    return b;
+}
+
+
+/**
+ * Get the leftmost bin that coresponded to bitmap (the bin is filled in bitmap)
+ */
+unsigned int bitmap_traits<bitmap256_t>::to_bin(const bitmap256_t & b) {
+    assert( b != EMPTY );
+    return words_to_bin(b.m_w, 4);
+}
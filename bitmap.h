@@ -0,0 +1,389 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "bin.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define BITMAP_SSE2
+#  include <emmintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#  define BITMAP_AVX2
+#  include <immintrin.h>
+#endif
+
+
+/**
+ * Leaf bitmaps of the binmap cells.
+ *
+ * A bitmap of W bits covers W base bins, so a cell (two halves) covers
+ * 2W base bins. Wider bitmaps mean fewer cells per tree level and
+ * shorter traces, at the cost of a bigger cell.
+ *
+ * Integer bitmaps (bitmap32_t, bitmap64_t) use the built-in operators,
+ * SIMD-register-sized bitmaps (bitmap128_t, bitmap256_t) are plain
+ * structures of 64-bit words with SSE2/AVX2 operators. The structures
+ * have no constructors, so they can be a part of the cell unions.
+ */
+
+/**
+ * 32-bit bitmap
+ */
+typedef uint32_t bitmap32_t;
+
+/**
+ * 64-bit bitmap
+ */
+typedef uint64_t bitmap64_t;
+
+/**
+ * 128-bit bitmap
+ */
+typedef struct {
+    uint64_t m_w[2];
+} bitmap128_t;
+
+/**
+ * 256-bit bitmap
+ */
+typedef struct {
+    uint64_t m_w[4];
+} bitmap256_t;
+
+
+/**
+ * Operators of 128-bit bitmaps
+ */
+#ifdef BITMAP_SSE2
+
+inline bitmap128_t operator & (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(r.m_w), _mm_and_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a.m_w)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.m_w))));
+    return r;
+}
+
+inline bitmap128_t operator | (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(r.m_w), _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a.m_w)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.m_w))));
+    return r;
+}
+
+inline bitmap128_t operator ^ (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r;
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(r.m_w), _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a.m_w)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.m_w))));
+    return r;
+}
+
+inline bool operator == (const bitmap128_t & a, const bitmap128_t & b) {
+    const __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a.m_w)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(b.m_w)));
+    return _mm_movemask_epi8(eq) == 0xffff;
+}
+
+#else
+
+inline bitmap128_t operator & (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r = { { a.m_w[0] & b.m_w[0], a.m_w[1] & b.m_w[1] } };
+    return r;
+}
+
+inline bitmap128_t operator | (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r = { { a.m_w[0] | b.m_w[0], a.m_w[1] | b.m_w[1] } };
+    return r;
+}
+
+inline bitmap128_t operator ^ (const bitmap128_t & a, const bitmap128_t & b) {
+    bitmap128_t r = { { a.m_w[0] ^ b.m_w[0], a.m_w[1] ^ b.m_w[1] } };
+    return r;
+}
+
+inline bool operator == (const bitmap128_t & a, const bitmap128_t & b) {
+    return a.m_w[0] == b.m_w[0] && a.m_w[1] == b.m_w[1];
+}
+
+#endif
+
+inline bitmap128_t operator ~ (const bitmap128_t & a) {
+    bitmap128_t r = { { ~a.m_w[0], ~a.m_w[1] } };
+    return r;
+}
+
+
+/**
+ * Operators of 256-bit bitmaps
+ */
+#ifdef BITMAP_AVX2
+
+inline bitmap256_t operator & (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r;
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(r.m_w), _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.m_w)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.m_w))));
+    return r;
+}
+
+inline bitmap256_t operator | (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r;
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(r.m_w), _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.m_w)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.m_w))));
+    return r;
+}
+
+inline bitmap256_t operator ^ (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r;
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(r.m_w), _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.m_w)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.m_w))));
+    return r;
+}
+
+inline bool operator == (const bitmap256_t & a, const bitmap256_t & b) {
+    const __m256i eq = _mm256_cmpeq_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a.m_w)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b.m_w)));
+    return _mm256_movemask_epi8(eq) == -1;
+}
+
+#else
+
+inline bitmap256_t operator & (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r = { { a.m_w[0] & b.m_w[0], a.m_w[1] & b.m_w[1], a.m_w[2] & b.m_w[2], a.m_w[3] & b.m_w[3] } };
+    return r;
+}
+
+inline bitmap256_t operator | (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r = { { a.m_w[0] | b.m_w[0], a.m_w[1] | b.m_w[1], a.m_w[2] | b.m_w[2], a.m_w[3] | b.m_w[3] } };
+    return r;
+}
+
+inline bitmap256_t operator ^ (const bitmap256_t & a, const bitmap256_t & b) {
+    bitmap256_t r = { { a.m_w[0] ^ b.m_w[0], a.m_w[1] ^ b.m_w[1], a.m_w[2] ^ b.m_w[2], a.m_w[3] ^ b.m_w[3] } };
+    return r;
+}
+
+inline bool operator == (const bitmap256_t & a, const bitmap256_t & b) {
+    return ((a.m_w[0] ^ b.m_w[0]) | (a.m_w[1] ^ b.m_w[1]) | (a.m_w[2] ^ b.m_w[2]) | (a.m_w[3] ^ b.m_w[3])) == 0;
+}
+
+#endif
+
+inline bitmap256_t operator ~ (const bitmap256_t & a) {
+    bitmap256_t r = { { ~a.m_w[0], ~a.m_w[1], ~a.m_w[2], ~a.m_w[3] } };
+    return r;
+}
+
+
+/**
+ * Derived operators of wide bitmaps
+ */
+inline bool operator != (const bitmap128_t & a, const bitmap128_t & b) {
+    return !(a == b);
+}
+
+inline bool operator != (const bitmap256_t & a, const bitmap256_t & b) {
+    return !(a == b);
+}
+
+inline bitmap128_t & operator &= (bitmap128_t & a, const bitmap128_t & b) {
+    return a = a & b;
+}
+
+inline bitmap128_t & operator |= (bitmap128_t & a, const bitmap128_t & b) {
+    return a = a | b;
+}
+
+inline bitmap256_t & operator &= (bitmap256_t & a, const bitmap256_t & b) {
+    return a = a & b;
+}
+
+inline bitmap256_t & operator |= (bitmap256_t & a, const bitmap256_t & b) {
+    return a = a | b;
+}
+
+
+/**
+ * Loads a 32-bit word of little-endian bytes
+ */
+inline uint32_t bitmap_load_le32(const unsigned char * p) {
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) | (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+/**
+ * Loads a 64-bit word of little-endian bytes
+ */
+inline uint64_t bitmap_load_le64(const unsigned char * p) {
+    return static_cast<uint64_t>(bitmap_load_le32(p)) | (static_cast<uint64_t>(bitmap_load_le32(p + 4)) << 32);
+}
+
+
+/**
+ * Stores a 32-bit word as little-endian bytes
+ */
+inline void bitmap_store_le32(uint32_t w, unsigned char * p) {
+    p[0] = static_cast<unsigned char>(w);
+    p[1] = static_cast<unsigned char>(w >> 8);
+    p[2] = static_cast<unsigned char>(w >> 16);
+    p[3] = static_cast<unsigned char>(w >> 24);
+}
+
+/**
+ * Stores a 64-bit word as little-endian bytes
+ */
+inline void bitmap_store_le64(uint64_t w, unsigned char * p) {
+    bitmap_store_le32(static_cast<uint32_t>(w), p);
+    bitmap_store_le32(static_cast<uint32_t>(w >> 32), p + 4);
+}
+
+
+/**
+ * Counts the set bits of a 64-bit word
+ */
+inline unsigned int bitmap_count64(uint64_t w) {
+#if defined(__GNUC__)
+    return static_cast<unsigned int>(__builtin_popcountll(w));
+#else
+    w = w - ((w >> 1) & 0x5555555555555555ULL);
+    w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+    w = (w + (w >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return static_cast<unsigned int>((w * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+
+/**
+ * Bitmap policy
+ *
+ * Specialized for each bitmap type:
+ *   EMPTY, FILLED  -- uniform bitmaps
+ *   LAYER_BITS     -- layer bits of a bin covering two bitmaps
+ *   bin(idx)       -- bitmap of the bin (idx = bin & LAYER_BITS)
+ *   range(b, e)    -- bitmap of the base bins [b, e)
+ *   to_bin(b)      -- the leftmost bin filled in the bitmap
+ *   load(p)        -- bitmap of sizeof(bitmap) bytes, the bit k of
+ *                     the byte i is the base bin 8 * i + k
+ *   store(b, p)    -- reverse of load
+ *   count(b)       -- number of the base bins filled in the bitmap
+ */
+template <typename bitmap_type>
+struct bitmap_traits;
+
+
+/**
+ * Policy of 32-bit bitmaps
+ */
+template <>
+struct bitmap_traits<bitmap32_t> {
+    static const bitmap32_t EMPTY = static_cast<bitmap32_t>(0);
+    static const bitmap32_t FILLED = static_cast<bitmap32_t>(-1);
+    static const unsigned int LAYER_BITS = 2 * 32 - 1;
+
+    static const bitmap32_t BITMAP[];
+
+    static bitmap32_t bin(unsigned int idx) {
+        return BITMAP[idx];
+    }
+
+    static bitmap32_t range(unsigned int begin, unsigned int end);
+
+    static unsigned int to_bin(bitmap32_t b);
+
+    static bitmap32_t load(const unsigned char * p) {
+        return bitmap_load_le32(p);
+    }
+
+    static void store(bitmap32_t b, unsigned char * p) {
+        bitmap_store_le32(b, p);
+    }
+
+    static unsigned int count(bitmap32_t b) {
+        return bitmap_count64(b);
+    }
+};
+
+
+/**
+ * Policy of 64-bit bitmaps
+ */
+template <>
+struct bitmap_traits<bitmap64_t> {
+    static const bitmap64_t EMPTY = static_cast<bitmap64_t>(0);
+    static const bitmap64_t FILLED = static_cast<bitmap64_t>(-1);
+    static const unsigned int LAYER_BITS = 2 * 64 - 1;
+
+    static bitmap64_t bin(unsigned int idx);
+
+    static bitmap64_t range(unsigned int begin, unsigned int end);
+
+    static unsigned int to_bin(bitmap64_t b);
+
+    static bitmap64_t load(const unsigned char * p) {
+        return bitmap_load_le64(p);
+    }
+
+    static void store(bitmap64_t b, unsigned char * p) {
+        bitmap_store_le64(b, p);
+    }
+
+    static unsigned int count(bitmap64_t b) {
+        return bitmap_count64(b);
+    }
+};
+
+
+/**
+ * Policy of 128-bit bitmaps
+ */
+template <>
+struct bitmap_traits<bitmap128_t> {
+    static const bitmap128_t EMPTY;
+    static const bitmap128_t FILLED;
+    static const unsigned int LAYER_BITS = 2 * 128 - 1;
+
+    static bitmap128_t bin(unsigned int idx);
+
+    static bitmap128_t range(unsigned int begin, unsigned int end);
+
+    static unsigned int to_bin(const bitmap128_t & b);
+
+    static bitmap128_t load(const unsigned char * p) {
+        bitmap128_t r = { { bitmap_load_le64(p), bitmap_load_le64(p + 8) } };
+        return r;
+    }
+
+    static void store(const bitmap128_t & b, unsigned char * p) {
+        bitmap_store_le64(b.m_w[0], p);
+        bitmap_store_le64(b.m_w[1], p + 8);
+    }
+
+    static unsigned int count(const bitmap128_t & b) {
+        return bitmap_count64(b.m_w[0]) + bitmap_count64(b.m_w[1]);
+    }
+};
+
+
+/**
+ * Policy of 256-bit bitmaps
+ */
+template <>
+struct bitmap_traits<bitmap256_t> {
+    static const bitmap256_t EMPTY;
+    static const bitmap256_t FILLED;
+    static const unsigned int LAYER_BITS = 2 * 256 - 1;
+
+    static bitmap256_t bin(unsigned int idx);
+
+    static bitmap256_t range(unsigned int begin, unsigned int end);
+
+    static unsigned int to_bin(const bitmap256_t & b);
+
+    static bitmap256_t load(const unsigned char * p) {
+        bitmap256_t r = { { bitmap_load_le64(p), bitmap_load_le64(p + 8), bitmap_load_le64(p + 16), bitmap_load_le64(p + 24) } };
+        return r;
+    }
+
+    static void store(const bitmap256_t & b, unsigned char * p) {
+        bitmap_store_le64(b.m_w[0], p);
+        bitmap_store_le64(b.m_w[1], p + 8);
+        bitmap_store_le64(b.m_w[2], p + 16);
+        bitmap_store_le64(b.m_w[3], p + 24);
+    }
+
+    static unsigned int count(const bitmap256_t & b) {
+        return bitmap_count64(b.m_w[0]) + bitmap_count64(b.m_w[1]) + bitmap_count64(b.m_w[2]) + bitmap_count64(b.m_w[3]);
+    }
+};
+
+#endif // BITMAP_H
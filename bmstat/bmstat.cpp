@@ -9,65 +9,47 @@
 
 
 void usage() {
-    fprintf(stderr, "usage: bitmap1 [bitmap2 [...]] ");
+    fprintf(stderr, "usage: [-j threads] bitmap1 [bitmap2 [...]] ");
     exit(-1);
 }
 
 
-void process(const char * filename, FILE * fin) {
+void process(const char * filename, FILE * fin, int threads) {
     binmap_t binmap;
 
     size_t size = 0;
     size_t count = 0;
 
+    /* Reading the whole bitmap */
+    unsigned char * bitmap = NULL;
+    size_t capacity = 0;
+
     for( ;; ) {
-        char buf[4096];
+        if( size == capacity ) {
+            capacity = capacity ? 2 * capacity : 4096;
+
+            unsigned char * const buf = static_cast<unsigned char *>(realloc(bitmap, capacity));
+            if( buf == NULL ) {
+                fprintf(stderr, "%s: out of memory\n", filename);
+                free(bitmap);
+                return;
+            }
+            bitmap = buf;
+        }
 
-        const size_t bytes = fread(buf, 1, sizeof(buf), fin);
+        const size_t bytes = fread(bitmap + size, 1, capacity - size, fin);
         if( bytes == 0 )
             break;
 
-        for(size_t i = 0; i < bytes; ++i) {
-            const size_t v = 16 * (size + i);
-            const char b = buf[i];
-
-            if( b & 0x01 ) {
-                binmap.set(bin_t(v +  0));
-                ++count;
-            }
-            if( b & 0x02 ) {
-                binmap.set(bin_t(v +  2));
-                ++count;
-            }
-            if( b & 0x04 ) {
-                binmap.set(bin_t(v +  4));
-                ++count;
-            }
-            if( b & 0x08 ) {
-                binmap.set(bin_t(v +  6));
-                ++count;
-            }
-            if( b & 0x10 ) {
-                binmap.set(bin_t(v +  8));
-                ++count;
-            }
-            if( b & 0x20 ) {
-                binmap.set(bin_t(v + 10));
-                ++count;
-            }
-            if( b & 0x40 ) {
-                binmap.set(bin_t(v + 12));
-                ++count;
-            }
-            if( b & 0x80 ) {
-                binmap.set(bin_t(v + 14));
-                ++count;
-            }
-        }
-
         size += bytes;
     }
 
+    binmap.assign_from_bitmap(bitmap, 8 * size, threads);
+
+    count = binmap.count();
+
+    free(bitmap);
+
     if( ferror(fin) ) {
         fprintf(stderr, "%s: %d: %s\n", filename, errno, strerror(errno));
 
@@ -81,8 +63,8 @@ void process(const char * filename, FILE * fin) {
         printf("  bitmap size: %u bytes\n", size);
         printf("  binmap size: %u bytes\n", binmap.total_size());
         printf("  binmap size efficiency: %.2f%%\n", 100.0 * binmap.total_size() / size);
-        printf("  binmap packed size: %u bytes\n", sizeof(binmap) + sizeof(cell_t) * binmap.cells_number());
-        printf("  binmap packed size efficiency: %.2f%%\n", 100.0 * (sizeof(binmap) + sizeof(cell_t) * binmap.cells_number()) / size);
+        printf("  binmap packed size: %u bytes\n", sizeof(binmap) + sizeof(binmap_t::cell_t) * binmap.cells_number());
+        printf("  binmap packed size efficiency: %.2f%%\n", 100.0 * (sizeof(binmap) + sizeof(binmap_t::cell_t) * binmap.cells_number()) / size);
 
         printf("\n");
     }
@@ -90,10 +72,18 @@ void process(const char * filename, FILE * fin) {
 
 
 int main(int argc, char ** argv) {
-    if( argc == 1 )
+    int threads = 1;
+    int first = 1;
+
+    if( argc > 2 && strcmp(argv[1], "-j") == 0 ) {
+        threads = atoi(argv[2]);
+        first = 3;
+    }
+
+    if( first == argc )
         usage();
 
-    for(int i = 1; i < argc; ++i) {
+    for(int i = first; i < argc; ++i) {
         FILE * const fin = fopen(argv[i], "rb");
 
         if( fin == NULL ) {
@@ -101,7 +91,7 @@ int main(int argc, char ** argv) {
             continue;
         }
 
-        process(argv[i], fin);
+        process(argv[i], fin, threads);
 
         fclose(fin);
     }
@@ -13,3 +13,4 @@ TEMPLATE = app
 SOURCES += bmstat.cpp
 INCLUDEPATH += ..
 LIBS        += -L.. -lbinmap
+unix:LIBS   += -lpthread
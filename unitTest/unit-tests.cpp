@@ -6,16 +6,77 @@
 #include <cstring>
 #include <ctime>
 
+#include <algorithm>
+#include <vector>
+
 #include <gtest/gtest.h>
 
+#ifndef _WIN32
+#  include <csignal>
+#  include <sys/resource.h>
+#endif
+
 #include "bin.h"
 #include "binmap.h"
+#include "binlog.h"
 #include "cRandom/crandom.h"
 
 
 struct cRandom * crandom = NULL;
 
 
+/**
+ * Get a random bin of the base bins [offset, offset + length), of a
+ * layer up to max_layer
+ */
+static bin_t::uint_t random_bin(bin_t::uint_t offset, bin_t::uint_t length, int max_layer) {
+    const bin_t::uint_t n = offset + equilikely(crandom, 0, length - 1);
+    const int layer = bernoulli(crandom, 0.8) ? 0 : equilikely(crandom, 0, max_layer);
+
+    return ((2 * n) | ((1U << layer) - 1)) & ~(1U << layer);
+}
+
+
+/**
+ * Set or reset count random bins of the base bins [offset, offset + length)
+ */
+template <class binmap_type>
+static void random_fill(binmap_type & binmap, size_t count, bin_t::uint_t offset, bin_t::uint_t length, int max_layer, double set_probability = 0.6) {
+    typedef typename binmap_type::bin_t bin_type;
+
+    for(size_t i = 0; i < count; ++i) {
+        const bin_t::uint_t v = random_bin(offset, length, max_layer);
+
+        if( bernoulli(crandom, set_probability) )
+            binmap.set(bin_type(v));
+        else
+            binmap.reset(bin_type(v));
+    }
+}
+
+
+/**
+ * Make the same random changes to the binmap and to the reference
+ */
+template <class binmap_type, class reference_type>
+static void random_fill(binmap_type & binmap, reference_type & reference, size_t count, bin_t::uint_t offset, bin_t::uint_t length, int max_layer, double set_probability = 0.6) {
+    typedef typename binmap_type::bin_t bin_type;
+    typedef typename reference_type::bin_t reference_bin_type;
+
+    for(size_t i = 0; i < count; ++i) {
+        const bin_t::uint_t v = random_bin(offset, length, max_layer);
+
+        if( bernoulli(crandom, set_probability) ) {
+            binmap.set(bin_type(v));
+            reference.set(reference_bin_type(v));
+        } else {
+            binmap.reset(bin_type(v));
+            reference.reset(reference_bin_type(v));
+        }
+    }
+}
+
+
 TEST(bin_test, layer) {
     EXPECT_EQ( 0, bin_t( 0).layer() );
     EXPECT_EQ( 1, bin_t( 1).layer() );
@@ -46,6 +107,23 @@ TEST(bin_test, layer) {
 }
 
 
+TEST(bin_test, layer64) {
+    EXPECT_EQ( 0, bin64_t( 0).layer() );
+    EXPECT_EQ( 4, bin64_t(15).layer() );
+    EXPECT_EQ( 8 * sizeof(bin64_t::uint_t) - 1, bin64_t::ALL.layer() );
+    EXPECT_EQ( -1, bin64_t::NONE.layer() );
+
+    int l = 5;
+    bin64_t::uint_t v = 31;
+    do {
+        EXPECT_EQ( l, bin64_t(v).layer() );
+        EXPECT_EQ( v + 1, bin64_t(v).base_length() );
+        l += 1;
+        v += v + 1;
+    } while( v + 1 != 0 );
+}
+
+
 TEST(bin_test, layer_bits) {
     EXPECT_EQ(  1, bin_t( 0).layer_bits() );
     EXPECT_EQ(  3, bin_t( 1).layer_bits() );
@@ -153,6 +231,34 @@ TEST(bin_test, left_right_parent) {
 }
 
 
+TEST(bin_test, peaks) {
+    bin_t peaks[64];
+
+    EXPECT_EQ( 0, bin_t::peaks(0, peaks) );
+    EXPECT_TRUE( peaks[0].is_none() );
+
+    EXPECT_EQ( 2, bin_t::peaks(5, peaks) );
+    EXPECT_TRUE( bin_t(3) == peaks[0] );
+    EXPECT_TRUE( bin_t(8) == peaks[1] );
+    EXPECT_TRUE( peaks[2].is_none() );
+
+    EXPECT_EQ( 1, bin_t::peaks(bin_t::ALL.base_length(), peaks) );
+    EXPECT_TRUE( bin_t::ALL == peaks[0] );
+
+    for(size_t n = 0; n < 1024; ++n) {
+        const bin_t::uint_t length = static_cast<bin_t::uint_t>(uniform(crandom, 1, bin_t::ALL.base_length()));
+        const int pp = bin_t::peaks(length, peaks);
+
+        bin_t::uint_t offset = 0;
+        for(int i = 0; i < pp; ++i) {
+            EXPECT_EQ( offset, peaks[i].base_offset() );
+            offset += peaks[i].base_length();
+        }
+        EXPECT_EQ( length, offset );
+    }
+}
+
+
 TEST(bin_test, contains) {
     EXPECT_TRUE( bin_t( 0).contains(bin_t( 0)) );
     EXPECT_TRUE( bin_t( 1).contains(bin_t( 0)) );
@@ -340,6 +446,1606 @@ TEST(binmap_test, find_empty) {
 }
 
 
+TEST(binmap_test, set_get64) {
+    const size_t N = 65536;
+    const bin64_t::uint_t BASE = static_cast<bin64_t::uint_t>(3) << 40;
+
+    binmap64_t binmap;
+
+    /* Setting every third base bin far beyond 2^32 */
+    for(size_t n = 0; n < N; n += 3)
+        binmap.set(bin64_t(2 * (BASE + n)));
+
+    /* Checking results */
+    for(size_t n = 0; n < N; ++n)
+        EXPECT_EQ( n % 3 == 0, binmap.get(bin64_t(2 * (BASE + n))) );
+
+    EXPECT_FALSE( binmap.get(bin64_t(2 * (BASE - 1))) );
+    EXPECT_EQ( 0, binmap.find_empty().base_offset() );
+
+    /* Filling the gaps packs the range into few cells */
+    for(size_t n = 0; n < N; ++n)
+        if( n % 3 != 0 )
+            binmap.set(bin64_t(2 * (BASE + n)));
+
+    EXPECT_TRUE( binmap.get(bin64_t(2 * BASE + N - 1)) );
+    EXPECT_LE( binmap.cells_number(), 64 );
+}
+
+
+TEST(bitmap_test, policies) {
+    for(unsigned int idx = 0; idx < bitmap_traits<bitmap32_t>::LAYER_BITS; ++idx) {
+        const bitmap32_t b = bitmap_traits<bitmap32_t>::bin(idx);
+
+        EXPECT_EQ( static_cast<bitmap64_t>(b), bitmap_traits<bitmap64_t>::bin(idx) );
+        EXPECT_EQ( static_cast<uint64_t>(b), bitmap_traits<bitmap128_t>::bin(idx).m_w[0] );
+        EXPECT_EQ( static_cast<uint64_t>(b), bitmap_traits<bitmap256_t>::bin(idx).m_w[0] );
+    }
+
+    for(size_t n = 0; n < 65536; ++n) {
+        const bitmap32_t b = static_cast<bitmap32_t>(equilikely(crandom, 1, 0xffffffffL));
+        const bitmap128_t b128 = { { b, 0 } };
+
+        EXPECT_EQ( bitmap_traits<bitmap32_t>::to_bin(b), bitmap_traits<bitmap64_t>::to_bin(b) );
+        EXPECT_EQ( bitmap_traits<bitmap32_t>::to_bin(b), bitmap_traits<bitmap128_t>::to_bin(b128) );
+    }
+
+    EXPECT_EQ( bitmap_traits<bitmap256_t>::LAYER_BITS / 2, bitmap_traits<bitmap256_t>::to_bin(bitmap_traits<bitmap256_t>::FILLED) );
+}
+
+
+TEST(binmap_test, range) {
+    const size_t N = 16 * 65536;
+
+    uint32_t * const bitmap = new uint32_t[ N / 32];
+    memset(bitmap, 0, N / 8);
+
+    binmap_t binmap;
+    binmap_t binmap_by_bin;
+
+    /* Making random range filling */
+    for(size_t i = 0; i < 4096; ++i) {
+        const size_t a = equilikely(crandom, 0, N - 1);
+        const size_t b = a + equilikely(crandom, 0, (i % 8 == 0) ? N / 4 : 96);
+        const size_t c = (b < N) ? b : N;
+        const bool is_set = bernoulli(crandom, 0.6);
+
+        if( is_set )
+            binmap.set_range(a, c);
+        else
+            binmap.reset_range(a, c);
+
+        for(size_t n = a; n < c; ++n) {
+            if( is_set ) {
+                binmap_by_bin.set(bin_t(2 * n));
+                bitmap[n / 32] |= (1 << (n % 32));
+            } else {
+                binmap_by_bin.reset(bin_t(2 * n));
+                bitmap[n / 32] &= ~(1 << (n % 32));
+            }
+        }
+    }
+
+    /* Checking results */
+    for(size_t n = 0; n < N; ++n) {
+        const bool f1 = binmap.get(bin_t(static_cast<bin_t::uint_t>(2 * n)));
+        const bool f2 = (0 != (bitmap[n / 32] & (1 << (n % 32))));
+
+        EXPECT_EQ( f2, f1 );
+    }
+
+    /* The tree is packed the same way */
+    EXPECT_EQ( binmap_by_bin.cells_number(), binmap.cells_number() );
+
+    /* Checking range queries */
+    for(size_t i = 0; i < 4096; ++i) {
+        const size_t a = equilikely(crandom, 0, N - 1);
+        const size_t c = a + equilikely(crandom, 1, (i % 2) ? 4 : 256);
+
+        bool is_filled = true;
+        bool is_empty = true;
+        for(size_t n = a; n < c; ++n) {
+            if( n < N && (bitmap[n / 32] & (1 << (n % 32))) )
+                is_empty = false;
+            else
+                is_filled = false;
+        }
+
+        EXPECT_EQ( is_filled, binmap.is_filled_range(a, c) );
+        EXPECT_EQ( is_empty, binmap.is_empty_range(a, c) );
+    }
+
+    binmap.set_range(0, N);
+    EXPECT_TRUE( binmap.is_filled_range(0, N) );
+    EXPECT_EQ( 1, binmap.cells_number() );
+
+    binmap.reset_range(1, N);
+    EXPECT_TRUE( binmap.get(bin_t(0)) );
+    EXPECT_TRUE( binmap.is_empty_range(1, 2 * N) );
+
+    delete [] bitmap;
+}
+
+
+TEST(binmap_test, batch) {
+    const size_t N = 16 * 65536;
+    const size_t K = 8192;
+
+    binmap_t::extent_t * const extents = new binmap_t::extent_t[K];
+    bin_t * const bins = new bin_t[K];
+
+    /* Making sorted extents and bins */
+    size_t offset = 0;
+    for(size_t i = 0; i < K; ++i) {
+        offset += equilikely(crandom, 0, 64);
+        extents[i].m_offset = offset;
+        extents[i].m_length = equilikely(crandom, 1, (i % 16) ? 16 : 2048);
+        offset += extents[i].m_length;
+    }
+
+    offset = 0;
+    for(size_t i = 0; i < K; ++i) {
+        const int layer = equilikely(crandom, 0, (i % 16) ? 3 : 11);
+        offset = ((offset >> layer) + equilikely(crandom, 0, 3)) << layer;
+        bins[i] = bin_t(2 * offset + (1U << layer) - 1);
+        offset += 1U << layer;
+    }
+
+    binmap_t binmap;
+    binmap_t binmap_by_range;
+
+    binmap.set(extents, K);
+    for(size_t i = 0; i < K; ++i)
+        binmap_by_range.set_range(extents[i].m_offset, extents[i].m_offset + extents[i].m_length);
+
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( binmap_by_range.get(bin_t(v)), binmap.get(bin_t(v)) );
+    EXPECT_EQ( binmap_by_range.cells_number(), binmap.cells_number() );
+
+    binmap.reset(bins, K);
+    for(size_t i = 0; i < K; ++i)
+        binmap_by_range.reset(bins[i]);
+
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( binmap_by_range.get(bin_t(v)), binmap.get(bin_t(v)) );
+    EXPECT_EQ( binmap_by_range.cells_number(), binmap.cells_number() );
+
+    binmap.set(bins, K);
+    for(size_t i = 0; i < K; ++i)
+        binmap_by_range.set(bins[i]);
+
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( binmap_by_range.get(bin_t(v)), binmap.get(bin_t(v)) );
+    EXPECT_EQ( binmap_by_range.cells_number(), binmap.cells_number() );
+
+    delete [] bins;
+    delete [] extents;
+}
+
+
+TEST(binmap_test, assign_from_bitmap) {
+    const size_t N = 4 * 65536;
+    const size_t bits = 8 * N - 3;
+
+    unsigned char * const bitmap = new unsigned char[N];
+
+    /* Making runs of empty, filled and random bytes */
+    for(size_t i = 0; i < N; ) {
+        const size_t length = equilikely(crandom, 1, 4096);
+        const int kind = equilikely(crandom, 0, 2);
+
+        for(size_t j = 0; j < length && i < N; ++j, ++i)
+            bitmap[i] = (kind == 0) ? 0x00 : (kind == 1) ? 0xff : static_cast<unsigned char>(equilikely(crandom, 0, 255));
+    }
+    bitmap[N - 1] = 0x10; /* the last bit */
+
+    binmap_t binmap;
+    for(size_t i = 0; i < bits; ++i) {
+        if( bitmap[i / 8] & (1 << (i % 8)) )
+            binmap.set(bin_t(2 * i));
+    }
+
+    binmap_t assigned;
+    binmap_t assigned_mt;
+
+    assigned.set_range(0, 8 * N);
+    assigned.assign_from_bitmap(bitmap, bits);
+    assigned_mt.assign_from_bitmap(bitmap, bits, 4);
+
+    for(size_t v = 0; v < 2 * bits; ++v) {
+        EXPECT_EQ( binmap.get(bin_t(v)), assigned.get(bin_t(v)) );
+        EXPECT_EQ( binmap.get(bin_t(v)), assigned_mt.get(bin_t(v)) );
+    }
+
+    /* No cells to be packed away */
+    EXPECT_EQ( binmap.cells_number(), assigned.cells_number() );
+    EXPECT_EQ( binmap.cells_number(), assigned_mt.cells_number() );
+
+    assigned.assign_from_bitmap(bitmap, 0);
+    EXPECT_EQ( 1, assigned.cells_number() );
+    EXPECT_TRUE( assigned.is_empty_range(0, 8 * N) );
+
+    delete [] bitmap;
+}
+
+
+TEST(binmap_test, to_bitmap) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+
+    /* Making random filling, including higher layers */
+    random_fill(binmap, N, 0, N, 9);
+
+    unsigned char * const bitmap = new unsigned char[N / 4];
+
+    /* Checking ranges inside, containing and beyond the root */
+    for(size_t i = 0; i < 256; ++i) {
+        const int layer = equilikely(crandom, 0, 17);
+        const bin_t::uint_t offset = equilikely(crandom, 0, (2 * N - 1) >> layer);
+        const bin_t range(((2 * offset + 1) << layer) - 1);
+
+        memset(bitmap, 0xaa, N / 4);
+        binmap.to_bitmap(range, bitmap);
+
+        for(size_t j = 0; j < range.base_length(); ++j)
+            EXPECT_EQ( binmap.get(bin_t(2 * (range.base_offset() + j))), (bitmap[j / 8] >> (j % 8)) & 1 );
+
+        if( range.base_length() < 8 ) {
+            EXPECT_EQ( 0, bitmap[0] >> range.base_length() );
+        }
+    }
+
+    delete [] bitmap;
+}
+
+
+TEST(binmap_test, set_operations) {
+    const size_t N = 65536;
+
+    for(int round = 0; round < 4; ++round) {
+        binmap_t a;
+        binmap_t b;
+
+        /* Making random filling of different sizes, including higher layers */
+        const size_t na = (round & 1) ? N : N / 16;
+        const size_t nb = (round & 2) ? N : N / 16;
+
+        random_fill(a, na, 0, na, 11);
+        random_fill(b, nb, 0, nb, 11);
+
+        for(int op = 0; op < 4; ++op) {
+            binmap_t in_place;
+            binmap_t assigned;
+
+            in_place.set_union(a);
+
+            if( op == 0 ) {
+                in_place.set_union(b);
+                assigned.set_union(a, b);
+            } else if( op == 1 ) {
+                in_place.set_intersection(b);
+                assigned.set_intersection(a, b);
+            } else if( op == 2 ) {
+                in_place.set_difference(b);
+                assigned.set_difference(a, b);
+            } else {
+                in_place.set_symmetric_difference(b);
+                assigned.set_symmetric_difference(a, b);
+            }
+
+            binmap_t expected;
+            for(size_t i = 0; i < N; ++i) {
+                const bool x = a.get(bin_t(2 * i));
+                const bool y = b.get(bin_t(2 * i));
+                const bool z = (op == 0) ? (x || y) : (op == 1) ? (x && y) : (op == 2) ? (x && !y) : (x != y);
+                if( z )
+                    expected.set(bin_t(2 * i));
+            }
+
+            for(size_t v = 0; v < 4 * N; ++v) {
+                EXPECT_EQ( expected.get(bin_t(v)), in_place.get(bin_t(v)) );
+                EXPECT_EQ( expected.get(bin_t(v)), assigned.get(bin_t(v)) );
+            }
+        }
+    }
+
+    /* Aliasing */
+    binmap_t a;
+    a.set(bin_t(1));
+    a.set_union(a, a);
+    EXPECT_TRUE( a.get(bin_t(1)) );
+    a.set_difference(a, a);
+    EXPECT_FALSE( a.get(bin_t(0)) );
+    EXPECT_EQ( 1, a.cells_number() );
+}
+
+
+TEST(binmap_test, find_within) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+
+    /* Making random filling, including higher layers */
+    random_fill(binmap, N / 4, 0, N, 11, 0.5);
+
+    for(size_t i = 0; i < 4096; ++i) {
+        const int layer = equilikely(crandom, 0, 17);
+        const bin_t::uint_t offset = equilikely(crandom, 0, (2 * N - 1) >> layer);
+        const bin_t within(((2 * offset + 1) << layer) - 1);
+        const bin_t::uint_t after = equilikely(crandom, 0, 2 * N - 1);
+
+        for(int filled = 0; filled < 2; ++filled) {
+            /* Checking the bins against the first base bin of the value */
+            for(int mode = 0; mode < 2; ++mode) {
+                const bin_t::uint_t begin = mode ? after : within.base_offset();
+                const bin_t::uint_t end = mode ? 4 * N : within.base_offset() + within.base_length();
+
+                bin_t::uint_t first = begin;
+                while( first < end && binmap.get(bin_t(2 * first)) != (filled != 0) )
+                    ++first;
+
+                const bin_t bin = mode ? (filled ? binmap.find_filled_after(after) : binmap.find_empty_after(after)) : (filled ? binmap.find_filled(within) : binmap.find_empty(within));
+
+                if( first == end ) {
+                    EXPECT_TRUE( bin.is_none() );
+                    continue;
+                }
+
+                ASSERT_FALSE( bin.is_none() );
+                EXPECT_EQ( first, bin.base_offset() );
+                EXPECT_LE( bin.base_offset() + bin.base_length(), end );
+                if( filled )
+                    EXPECT_TRUE( binmap.get(bin) );
+                else
+                    EXPECT_TRUE( binmap.is_empty_range(bin.base_offset(), bin.base_offset() + bin.base_length()) );
+            }
+        }
+    }
+
+    EXPECT_EQ( binmap.find_filled().toUInt(), binmap.find_filled(bin_t::ALL).toUInt() );
+}
+
+
+TEST(binmap_test, run_iterator) {
+    const size_t N = 65536;
+    const size_t K = 65536;
+
+    binmap_t binmap;
+
+    /* Making random filling, including higher layers */
+    random_fill(binmap, N / 4, 0, N, 11, 0.5);
+
+    bin_t::uint_t * const offsets = new bin_t::uint_t[K];
+    size_t count = 0;
+
+    /* Checking forward runs */
+    binmap_t::run_iterator_t it(binmap);
+    bin_t::uint_t end = 0;
+
+    for(bool ok = it.first(); ok; ok = it.next()) {
+        ASSERT_LT( count, K );
+        EXPECT_EQ( end, it.offset() );
+        EXPECT_LT( 0, it.length() );
+        if( count > 0 ) {
+            EXPECT_NE( binmap.get(bin_t(2 * (it.offset() - 1))), it.is_filled() );
+        }
+
+        if( it.is_filled() )
+            EXPECT_TRUE( binmap.is_filled_range(it.offset(), it.offset() + it.length()) );
+        else
+            EXPECT_TRUE( binmap.is_empty_range(it.offset(), it.offset() + it.length()) );
+
+        offsets[count++] = it.offset();
+        end = it.offset() + it.length();
+    }
+
+    EXPECT_LE( N, end );
+
+    /* Checking backward runs */
+    for(bool ok = it.last(); ok; ok = it.prev()) {
+        ASSERT_LT( 0, count );
+        EXPECT_EQ( offsets[--count], it.offset() );
+    }
+    EXPECT_EQ( 0, count );
+
+    /* Checking direction changes */
+    it.first();
+    it.next();
+    it.next();
+    const bin_t::uint_t offset = it.offset();
+    it.next();
+    it.prev();
+    EXPECT_EQ( offset, it.offset() );
+    it.prev();
+    it.next();
+    EXPECT_EQ( offset, it.offset() );
+
+    delete [] offsets;
+}
+
+
+TEST(binmap_test, find_complement) {
+    const size_t N = 65536;
+
+    for(int round = 0; round < 4; ++round) {
+        binmap_t have;
+        binmap_t mine;
+
+        /* Making random filling of different sizes, mostly overlapping */
+        const size_t nh = (round & 1) ? N : N / 16;
+        const size_t nm = (round & 2) ? N : N / 16;
+
+        mine.set_range(0, nm);
+        have.set_range(0, nh);
+
+        for(size_t i = 0; i < nh / 8; ++i)
+            have.reset(bin_t(2 * equilikely(crandom, 0, nh - 1)));
+        for(size_t i = 0; i < nm / 64; ++i)
+            mine.reset(bin_t(2 * equilikely(crandom, 0, nm - 1)));
+
+        for(size_t i = 0; i < 1024; ++i) {
+            const int layer = equilikely(crandom, 0, 17);
+            const bin_t::uint_t offset = equilikely(crandom, 0, (2 * N - 1) >> layer);
+            const bin_t within(((2 * offset + 1) << layer) - 1);
+
+            bin_t::uint_t first = within.base_offset();
+            const bin_t::uint_t end = first + within.base_length();
+            while( first < end && !(have.get(bin_t(2 * first)) && !mine.get(bin_t(2 * first))) )
+                ++first;
+
+            const bin_t bin = binmap_t::find_complement(have, mine, within);
+
+            if( first == end ) {
+                EXPECT_TRUE( bin.is_none() );
+                continue;
+            }
+
+            ASSERT_FALSE( bin.is_none() );
+            EXPECT_EQ( first, bin.base_offset() );
+            EXPECT_TRUE( within.contains(bin) );
+            EXPECT_TRUE( have.get(bin) );
+            EXPECT_TRUE( mine.is_empty_range(bin.base_offset(), bin.base_offset() + bin.base_length()) );
+        }
+    }
+}
+
+
+TEST(binmap_test, counts) {
+    const size_t N = 65536;
+    const size_t M = 4 * N;
+
+    binmap_t binmap;
+    EXPECT_TRUE( binmap.enable_counts() );
+
+    unsigned char * const bitmap = new unsigned char[M / 8];
+    size_t * const prefix = new size_t[M + 1];
+
+    for(int round = 0; round < 8; ++round) {
+        /* Making random changes by all kinds of operations */
+        random_fill(binmap, N / 16, 0, N, 11, 0.5);
+
+        const size_t a = equilikely(crandom, 0, N - 1);
+        const size_t c = a + equilikely(crandom, 0, N);
+
+        if( round % 4 == 0 ) {
+            binmap.set_range(a, c);
+        } else if( round % 4 == 1 ) {
+            binmap.reset_range(a, c);
+        } else {
+            binmap_t other;
+            other.set_range(a, c);
+            other.reset(bin_t(2 * a + 1));
+
+            if( round % 4 == 2 )
+                binmap.set_symmetric_difference(other);
+            else
+                binmap.set_union(other);
+        }
+
+        if( round == 7 ) {
+            binmap.to_bitmap(bin_t(M - 1), bitmap);
+            binmap.assign_from_bitmap(bitmap, M);
+        }
+
+        /* Checking against the flat bitmap */
+        binmap.to_bitmap(bin_t(M - 1), bitmap);
+
+        prefix[0] = 0;
+        for(size_t i = 0; i < M; ++i)
+            prefix[i + 1] = prefix[i] + ((bitmap[i / 8] >> (i % 8)) & 1);
+
+        EXPECT_EQ( prefix[M], binmap.count() );
+
+        binmap_t walked;
+        walked.set_union(binmap);
+        EXPECT_FALSE( walked.is_counting() );
+        EXPECT_EQ( prefix[M], walked.count() );
+
+        for(size_t i = 0; i < 256; ++i) {
+            const int layer = equilikely(crandom, 0, 18);
+            const bin_t::uint_t offset = equilikely(crandom, 0, (M - 1) >> layer);
+            const bin_t bin(((2 * offset + 1) << layer) - 1);
+
+            EXPECT_EQ( prefix[bin.base_offset() + bin.base_length()] - prefix[bin.base_offset()], binmap.count(bin) );
+
+            const size_t pos = equilikely(crandom, 0, M);
+            EXPECT_EQ( prefix[pos], binmap.rank(pos) );
+
+            /* k-th filled and empty */
+            if( prefix[pos] > 0 ) {
+                const size_t k = prefix[pos] - 1;
+                const size_t * found = prefix;
+                while( *found <= k )
+                    ++found;
+                EXPECT_EQ( 2 * (found - prefix - 1), binmap.select(k).toUInt() );
+            }
+
+            const size_t k = pos - prefix[pos];
+            if( k > 0 ) {
+                EXPECT_FALSE( binmap.get(binmap.select(k - 1, false)) );
+            }
+            EXPECT_EQ( k, binmap.select(k, false).base_offset() - binmap.rank(binmap.select(k, false).base_offset()) );
+        }
+
+        EXPECT_TRUE( binmap.select(prefix[M]).is_none() );
+    }
+
+    delete [] prefix;
+    delete [] bitmap;
+}
+
+
+TEST(binmap_test, serialization) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+    binmap.set(bin_t(2 * 3 * N));
+    random_fill(binmap, N, 0, N, 11);
+
+    /* Encoding by small pieces */
+    std::vector<unsigned char> stream;
+    binmap_t::encoder_t encoder(binmap);
+
+    unsigned char buffer[7];
+    for(size_t size; (size = encoder.encode(buffer, 1 + stream.size() % sizeof(buffer))) > 0; )
+        stream.insert(stream.end(), buffer, buffer + size);
+
+    EXPECT_TRUE( encoder.is_done() );
+    EXPECT_LT( stream.size(), binmap.cells_number() * sizeof(binmap_t::cell_t) );
+
+    /* Decoding by other pieces */
+    binmap_t decoded;
+    decoded.set(bin_t(2 * 4 * N));
+    EXPECT_TRUE( decoded.enable_counts() );
+
+    binmap_t::decoder_t decoder(decoded);
+    for(size_t pos = 0; pos < stream.size(); pos += 5) {
+        EXPECT_FALSE( decoder.is_done() );
+        EXPECT_TRUE( decoder.decode(&stream[pos], std::min<size_t>(5, stream.size() - pos)) );
+    }
+
+    EXPECT_TRUE( decoder.is_done() );
+    EXPECT_EQ( binmap.cells_number(), decoded.cells_number() );
+    EXPECT_EQ( binmap.count(), decoded.count() );
+
+    for(size_t v = 0; v < 8 * N; ++v)
+        EXPECT_EQ( binmap.get(bin_t(v)), decoded.get(bin_t(v)) );
+
+    /* Encoding the decoded binmap gives the same stream */
+    std::vector<unsigned char> again(stream.size() + 1);
+    binmap_t::encoder_t decoded_encoder(decoded);
+    EXPECT_EQ( stream.size(), decoded_encoder.encode(&again[0], again.size()) );
+    EXPECT_TRUE( std::equal(stream.begin(), stream.end(), again.begin()) );
+
+    /* Reading the stream in place */
+    const_binmap_view_t view(&stream[0], stream.size());
+    EXPECT_TRUE( view.is_valid() );
+
+    for(size_t v = 0; v < 8 * N; ++v)
+        EXPECT_EQ( binmap.get(bin_t(v)), view.get(bin_t(v)) );
+
+    EXPECT_EQ( binmap.find_empty().toUInt(), view.find_empty().toUInt() );
+    EXPECT_EQ( binmap.find_filled().toUInt(), view.find_filled().toUInt() );
+
+    for(size_t i = 0; i < 1024; ++i) {
+        const size_t a = equilikely(crandom, 0, 4 * N - 1);
+        const size_t c = a + equilikely(crandom, 0, 64);
+        const int layer = equilikely(crandom, 0, 12);
+        const bin_t within(((2 * (a >> layer) + 1) << layer) - 1);
+
+        EXPECT_EQ( binmap.find_empty(within).toUInt(), view.find_empty(within).toUInt() );
+        EXPECT_EQ( binmap.find_filled(within).toUInt(), view.find_filled(within).toUInt() );
+        EXPECT_EQ( binmap.find_empty_after(a).toUInt(), view.find_empty_after(a).toUInt() );
+        EXPECT_EQ( binmap.find_filled_after(a).toUInt(), view.find_filled_after(a).toUInt() );
+        EXPECT_EQ( binmap.is_filled_range(a, c), view.is_filled_range(a, c) );
+        EXPECT_EQ( binmap.is_empty_range(a, c), view.is_empty_range(a, c) );
+    }
+
+    binmap_t::run_iterator_t it(binmap);
+    const_binmap_view_t::run_iterator_t view_it(view);
+
+    bool ok = it.first();
+    bool view_ok = view_it.first();
+    for( ; ok && view_ok; ok = it.next(), view_ok = view_it.next()) {
+        EXPECT_EQ( it.offset(), view_it.offset() );
+        EXPECT_EQ( it.length(), view_it.length() );
+        EXPECT_EQ( it.is_filled(), view_it.is_filled() );
+    }
+    EXPECT_EQ( ok, view_ok );
+
+    const_binmap_view_t truncated_view(&stream[0], stream.size() / 2);
+    for(size_t v = 0; v < 8 * N; ++v) {
+        if( truncated_view.get(bin_t(v)) ) {
+            EXPECT_TRUE( binmap.get(bin_t(v)) );
+        }
+    }
+
+    const_binmap_view_t empty_view(&stream[0], 3);
+    EXPECT_FALSE( empty_view.is_valid() );
+    EXPECT_TRUE( empty_view.find_filled().is_none() );
+
+    /* Broken streams */
+    binmap_t broken;
+    broken.set(bin_t(2 * 5));
+
+    binmap_t::decoder_t truncated(broken);
+    EXPECT_TRUE( truncated.decode(&stream[0], stream.size() - 1) );
+    EXPECT_FALSE( truncated.is_done() );
+
+    binmap_t::decoder_t trailing(broken);
+    EXPECT_FALSE( trailing.decode(&again[0], again.size()) );
+    EXPECT_FALSE( trailing.decode(&again[0], 1) );
+    EXPECT_EQ( 1U, broken.cells_number() );
+    EXPECT_TRUE( broken.find_filled().is_none() );
+
+    stream[0] = 'X';
+    binmap_t::decoder_t corrupted(broken);
+    EXPECT_FALSE( corrupted.decode(&stream[0], stream.size()) );
+}
+
+
+TEST(binmap_test, serialization_deep) {
+    const size_t N = 16384;
+    const bin_t::uint_t M = 1U << 30;
+
+    /* Sparse bins all over the range make deep cells of two references */
+    binmap_t binmap;
+    std::vector<bin_t::uint_t> offsets;
+
+    for(size_t i = 0; i < N; ++i) {
+        const bin_t::uint_t n = equilikely(crandom, 0, M - 1);
+        binmap.set(bin_t(2 * n));
+        offsets.push_back(n);
+    }
+
+    std::vector<unsigned char> stream(64 * binmap.cells_number());
+    binmap_t::encoder_t encoder(binmap);
+    const size_t size = encoder.encode(&stream[0], stream.size());
+    EXPECT_TRUE( encoder.is_done() );
+    stream.resize(size);
+
+    /* The same size by small pieces */
+    binmap_t::encoder_t piece_encoder(binmap);
+    unsigned char buffer[3];
+    size_t piece_size = 0;
+    for(size_t n; (n = piece_encoder.encode(buffer, sizeof(buffer))) > 0; )
+        piece_size += n;
+    EXPECT_EQ( size, piece_size );
+
+    /* The sizes of the left subtrees let the view skip them */
+    const_binmap_view_t view(&stream[0], stream.size());
+    EXPECT_TRUE( view.is_valid() );
+
+    binmap_t decoded;
+    binmap_t::decoder_t decoder(decoded);
+    EXPECT_TRUE( decoder.decode(&stream[0], stream.size()) );
+    EXPECT_TRUE( decoder.is_done() );
+    EXPECT_EQ( binmap.cells_number(), decoded.cells_number() );
+
+    for(size_t i = 0; i < N; ++i) {
+        const bin_t::uint_t n = offsets[i];
+        EXPECT_TRUE( view.get(bin_t(2 * n)) );
+        EXPECT_TRUE( decoded.get(bin_t(2 * n)) );
+        EXPECT_EQ( binmap.get(bin_t(2 * (n ^ 1))), view.get(bin_t(2 * (n ^ 1))) );
+        EXPECT_EQ( binmap.get(bin_t(2 * (n ^ 1))), decoded.get(bin_t(2 * (n ^ 1))) );
+    }
+
+    EXPECT_EQ( binmap.count(), decoded.count() );
+}
+
+
+TEST(binmap_test, file_backed) {
+    const char * const path = "binmap-test.tmp";
+    const size_t N = 65536;
+
+    remove(path);
+
+    binmap_t reference;
+    {
+        binmap_t binmap;
+        binmap.set(bin_t(2 * 5));
+
+        EXPECT_TRUE( binmap.open_file(path) );
+        EXPECT_TRUE( binmap.is_file_backed() );
+        EXPECT_FALSE( binmap.open_file(path) );
+
+        /* Growing the file */
+        reference.set(bin_t(2 * 5));
+        for(size_t i = 0; i < N; ++i) {
+            const int n = equilikely(crandom, 0, N - 1);
+            if( bernoulli(crandom, 0.6) ) {
+                binmap.set(bin_t(2 * n));
+                reference.set(bin_t(2 * n));
+            } else {
+                binmap.reset(bin_t(2 * n));
+                reference.reset(bin_t(2 * n));
+            }
+        }
+
+        EXPECT_GT( binmap.blocks_number(), 1U );
+        EXPECT_TRUE( binmap.sync() );
+
+        binmap.set(bin_t(2 * N + 1));
+        reference.set(bin_t(2 * N + 1));
+    }
+
+    /* Opening the file */
+    binmap_t binmap;
+    binmap.set(bin_t(2 * 7));
+    EXPECT_TRUE( binmap.enable_counts() );
+    EXPECT_TRUE( binmap.open_file(path) );
+
+    EXPECT_EQ( reference.cells_number(), binmap.cells_number() );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 8 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    binmap.reset(bin_t(2 * N + 1));
+    binmap.set(bin_t(4 * N + 1));
+    EXPECT_TRUE( binmap.get(bin_t(4 * N + 1)) );
+    EXPECT_FALSE( binmap.get(bin_t(2 * N + 1)) );
+
+    /* Shrinking the file */
+    reference.reset(bin_t(2 * N + 1));
+    reference.set(bin_t(4 * N + 1));
+    binmap.reset_range(0, N);
+    reference.reset_range(0, N);
+    binmap.compact();
+
+    EXPECT_EQ( (binmap.cells_number() + 15) / 16, binmap.blocks_number() );
+    for(size_t v = 0; v < 8 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    /* Files of other binmaps */
+    basic_binmap_t< binmap_traits<bin_t, bitmap64_t> > wide_binmap;
+    EXPECT_FALSE( wide_binmap.open_file(path) );
+    EXPECT_FALSE( wide_binmap.is_file_backed() );
+
+    remove(path);
+
+    /* Cells of the same size with other references */
+    {
+        basic_binmap_t< binmap_traits<bin64_t, bitmap64_t> > binmap64;
+        binmap64.set(bin64_t(2 * 5));
+        EXPECT_TRUE( binmap64.open_file(path) );
+    }
+
+    basic_binmap_t< binmap_traits<bin64_t, bitmap64_t, uint64_t> > wide_ref_binmap;
+    EXPECT_FALSE( wide_ref_binmap.open_file(path) );
+
+    remove(path);
+
+    /* Broken root bins: a leaf half and a bin not at the offset 0 */
+    const uint64_t broken_roots[] = { 31, 191 };
+    for(size_t i = 0; i < 2; ++i) {
+        {
+            binmap_t binmap;
+            binmap.set(bin_t(2 * 5));
+            EXPECT_TRUE( binmap.open_file(path) );
+        }
+
+        FILE * const file = fopen(path, "r+b");
+        ASSERT_TRUE( file != NULL );
+        fseek(file, 16, SEEK_SET);
+        fwrite(&broken_roots[i], sizeof(broken_roots[i]), 1, file);
+        fclose(file);
+
+        binmap_t broken;
+        EXPECT_FALSE( broken.open_file(path) );
+
+        remove(path);
+    }
+}
+
+
+TEST(binmap_test, copy_move) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+    EXPECT_TRUE( binmap.enable_counts() );
+
+    /* Filling and partly clearing, leaving holes in the cells */
+    for(size_t i = 0; i < N; ++i)
+        binmap.set(bin_t(2 * equilikely(crandom, 0, N - 1)));
+    binmap.reset_range(0, N / 2);
+
+    const binmap_t copy(binmap);
+
+    EXPECT_TRUE( copy.is_counting() );
+    EXPECT_EQ( binmap.count(), copy.count() );
+    EXPECT_EQ( binmap.cells_number(), copy.cells_number() );
+    EXPECT_EQ( (copy.cells_number() + 15) / 16, copy.blocks_number() );
+    EXPECT_LT( copy.blocks_number(), binmap.blocks_number() );
+
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( binmap.get(bin_t(v)), copy.get(bin_t(v)) );
+
+    /* Assignment and swap */
+    binmap_t other;
+    other.set(bin_t(2 * N + 1));
+    other = copy;
+    EXPECT_EQ( copy.count(), other.count() );
+    EXPECT_FALSE( other.get(bin_t(2 * N + 1)) );
+
+    binmap_t empty;
+    empty.swap(other);
+    EXPECT_TRUE( other.find_filled().is_none() );
+    EXPECT_EQ( copy.count(), empty.count() );
+
+    /* Moves */
+    binmap_t moved(std::move(empty));
+    EXPECT_EQ( copy.count(), moved.count() );
+    EXPECT_TRUE( empty.find_filled().is_none() );
+
+    empty = std::move(moved);
+    EXPECT_EQ( copy.count(), empty.count() );
+}
+
+
+TEST(binmap_test, compact) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+    binmap_t reference;
+    EXPECT_TRUE( binmap.enable_counts() );
+
+    /* Fragmenting */
+    for(size_t i = 0; i < N; ++i) {
+        const int n = equilikely(crandom, 0, N - 1);
+        binmap.set(bin_t(2 * n));
+        reference.set(bin_t(2 * n));
+    }
+    for(size_t i = 0; i < 64; ++i) {
+        const size_t a = equilikely(crandom, 0, N - 1);
+        binmap.reset_range(a, a + 512);
+        reference.reset_range(a, a + 512);
+    }
+
+    const size_t blocks_number = binmap.blocks_number();
+
+    binmap.compact();
+
+    EXPECT_EQ( (binmap.cells_number() + 15) / 16, binmap.blocks_number() );
+    EXPECT_LT( binmap.blocks_number(), blocks_number );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    /* Compacting by steps between changes */
+    for(size_t i = 0; i < N; ++i) {
+        const int n = equilikely(crandom, 0, N - 1);
+        binmap.set(bin_t(2 * n));
+        reference.set(bin_t(2 * n));
+    }
+    binmap.reset_range(0, N / 2);
+    reference.reset_range(0, N / 2);
+
+    const size_t step_blocks_number = binmap.blocks_number();
+
+    size_t steps = 0;
+    while( !binmap.compact_step(64) ) {
+        for(size_t i = 0; i < 16; ++i) {
+            const int n = equilikely(crandom, 0, N - 1);
+            if( bernoulli(crandom, 0.5) ) {
+                binmap.set(bin_t(2 * n));
+                reference.set(bin_t(2 * n));
+            } else {
+                binmap.reset(bin_t(2 * n));
+                reference.reset(bin_t(2 * n));
+            }
+        }
+        ++steps;
+    }
+
+    EXPECT_GT( steps, 8U );
+    EXPECT_LT( binmap.blocks_number(), step_blocks_number );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    binmap.compact();
+    EXPECT_EQ( (binmap.cells_number() + 15) / 16, binmap.blocks_number() );
+
+    /* Releasing the tail */
+    binmap.reset_range(0, N);
+    binmap.shrink_to_fit();
+    EXPECT_EQ( 0U, binmap.blocks_number() );
+}
+
+
+TEST(binmap_test, inline_root) {
+    binmap_t binmap;
+    EXPECT_EQ( 0U, binmap.blocks_number() );
+    EXPECT_EQ( 1U, binmap.cells_number() );
+    EXPECT_TRUE( binmap.is_empty_range(0, 1024) );
+
+    /* Uniform binmaps keep the root in the object */
+    EXPECT_TRUE( binmap.enable_counts() );
+    binmap.set(bin_t(15));
+    EXPECT_TRUE( binmap.get(bin_t(15)) );
+    EXPECT_EQ( 16U, binmap.count() );
+    EXPECT_EQ( 0U, binmap.blocks_number() );
+
+    binmap_t copy(binmap);
+    EXPECT_EQ( 0U, copy.blocks_number() );
+    EXPECT_TRUE( copy.get(bin_t(15)) );
+
+    /* Growing the tree */
+    binmap.set(bin_t(2 * 1000));
+    EXPECT_GT( binmap.blocks_number(), 0U );
+    EXPECT_TRUE( binmap.get(bin_t(15)) );
+    EXPECT_TRUE( binmap.get(bin_t(2 * 1000)) );
+    EXPECT_EQ( 17U, binmap.count() );
+
+    copy.swap(binmap);
+    EXPECT_EQ( 0U, binmap.blocks_number() );
+    EXPECT_TRUE( binmap.get(bin_t(15)) );
+    EXPECT_FALSE( binmap.get(bin_t(2 * 1000)) );
+    EXPECT_TRUE( copy.get(bin_t(2 * 1000)) );
+
+    binmap.set(bin_t(2 * 1000));
+    binmap.clear();
+    binmap.set(bin_t(15));
+    binmap.set(bin_t(47));
+    binmap.shrink_to_fit();
+    EXPECT_EQ( 0U, binmap.blocks_number() );
+    EXPECT_TRUE( binmap.get(bin_t(31)) );
+    EXPECT_EQ( 32U, binmap.count() );
+
+    binmap = copy;
+    EXPECT_TRUE( binmap.get(bin_t(2 * 1000)) );
+    EXPECT_EQ( 17U, binmap.count() );
+}
+
+
+TEST(binmap_test, relayout) {
+    const size_t N = 65536;
+
+    binmap_t binmap;
+    binmap_t reference;
+    EXPECT_TRUE( binmap.enable_counts() );
+
+    for(size_t i = 0; i < 4 * N; ++i) {
+        const int n = equilikely(crandom, 0, N - 1);
+        if( bernoulli(crandom, 0.6) ) {
+            binmap.set(bin_t(2 * n));
+            reference.set(bin_t(2 * n));
+        } else {
+            binmap.reset(bin_t(2 * n));
+            reference.reset(bin_t(2 * n));
+        }
+    }
+
+    EXPECT_TRUE( binmap.relayout() );
+
+    EXPECT_EQ( (binmap.cells_number() + 15) / 16, binmap.blocks_number() );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    /* Changing the laid out binmap */
+    for(size_t i = 0; i < N; ++i) {
+        const int n = equilikely(crandom, 0, N - 1);
+        binmap.reset(bin_t(2 * n));
+        reference.reset(bin_t(2 * n));
+    }
+    binmap.set(bin_t(2 * N + 1));
+    reference.set(bin_t(2 * N + 1));
+
+    EXPECT_TRUE( binmap.relayout() );
+
+    EXPECT_EQ( reference.cells_number(), binmap.cells_number() );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 8 * N; ++v)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+}
+
+
+TEST(binmap_test, arena) {
+    const size_t M = 256;
+    const size_t N = 4096;
+
+    binmap_arena_t arena(65536);
+    binmap_t * binmaps[M];
+    binmap_t references[M];
+
+    for(size_t round = 0; round < 2; ++round) {
+        for(size_t i = 0; i < M; ++i)
+            binmaps[i] = new binmap_t(arena);
+
+        for(size_t k = 0; k < 16 * M; ++k) {
+            const size_t i = equilikely(crandom, 0, M - 1);
+            const int n = equilikely(crandom, 0, N - 1);
+            binmaps[i]->set(bin_t(2 * n));
+            references[i].set(bin_t(2 * n));
+        }
+
+        for(size_t i = 0; i < M; ++i) {
+            EXPECT_EQ( references[i].cells_number(), binmaps[i]->cells_number() );
+            for(size_t v = 0; v < 2 * N; v += 7)
+                EXPECT_EQ( references[i].get(bin_t(v)), binmaps[i]->get(bin_t(v)) );
+        }
+
+        /* Copies share the arena */
+        binmap_t copy(*binmaps[0]);
+        binmaps[1]->swap(copy);
+        references[1] = references[0];
+        binmaps[0]->compact();
+
+        for(size_t v = 0; v < 2 * N; ++v)
+            EXPECT_EQ( references[0].get(bin_t(v)), binmaps[1]->get(bin_t(v)) );
+
+        for(size_t i = 0; i < M; ++i) {
+            delete binmaps[i];
+            references[i].clear();
+        }
+    }
+
+    /* The released buffers are reused */
+    const size_t total_size = arena.total_size();
+    EXPECT_GT( total_size, 0U );
+
+    for(size_t i = 0; i < M; ++i)
+        binmaps[i] = new binmap_t(arena);
+    for(size_t i = 0; i < M; ++i)
+        delete binmaps[i];
+
+    EXPECT_EQ( total_size, arena.total_size() );
+}
+
+
+TEST(binmap_test, arena_huge_pages) {
+    const size_t N = 65536;
+
+    binmap_arena_t arena(65536, true);
+    binmap_t reference;
+
+    /* The slabs take whole huge pages */
+    {
+        binmap_t small(arena);
+        small.set(bin_t(2 * 1000));
+        EXPECT_EQ( 0U, arena.total_size() % (2 << 20) );
+    }
+
+    /* The big buffers are mapped apart */
+    binmap_t binmap(arena);
+    for(size_t i = 0; i < 4 * N; ++i) {
+        const int n = equilikely(crandom, 0, 256 * N - 1);
+        binmap.set(bin_t(2 * n));
+        reference.set(bin_t(2 * n));
+    }
+
+    EXPECT_GT( binmap.blocks_number() * 16 * 8, arena.total_size() / 4 );
+    EXPECT_EQ( reference.cells_number(), binmap.cells_number() );
+    for(size_t v = 0; v < 512 * N; v += 97)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    binmap.reset_range(0, 512 * N);
+    binmap.compact();
+    EXPECT_TRUE( binmap.is_empty_range(0, 512 * N) );
+
+    /* The big buffers are mapped on the explicit huge pages if the
+       system has some, the ones of 1 MB and the ones above the pages
+       left are mapped on the transparent ones, all are unmapped */
+    const size_t slabs_size = arena.total_size();
+    for(size_t i = 0; i < 8; ++i) {
+        const size_t size = (1 << 20) << (i % 4);
+
+        char * const buffer = static_cast<char *>(arena.alloc_buffer(size));
+        ASSERT_TRUE( buffer != NULL );
+        memset(buffer, static_cast<int>(i), size);
+        EXPECT_EQ( static_cast<char>(i), buffer[size - 1] );
+
+        arena.free_buffer(buffer, size);
+    }
+    EXPECT_EQ( slabs_size, arena.total_size() );
+}
+
+
+TEST(binmap_test, reserve) {
+    const size_t N = 1 << 17;
+
+    binmap_t binmap;
+    binmap_t reference;
+
+    /* The reserved buffers grow in place, on the huge pages */
+    EXPECT_TRUE( binmap.reserve(N, true) );
+    EXPECT_EQ( N / 16, binmap.blocks_number() );
+    EXPECT_TRUE( binmap.reserve(N / 2) );
+    EXPECT_EQ( N / 16, binmap.blocks_number() );
+    EXPECT_TRUE( binmap.enable_counts() );
+
+    for(size_t i = 0; i < 2 * N; ++i) {
+        const int n = equilikely(crandom, 0, 64 * N - 1);
+        if( bernoulli(crandom, 0.8) ) {
+            binmap.set(bin_t(2 * n));
+            reference.set(bin_t(2 * n));
+        } else {
+            binmap.reset(bin_t(2 * n));
+            reference.reset(bin_t(2 * n));
+        }
+    }
+
+    EXPECT_GT( binmap.cells_number(), N );
+    EXPECT_GT( binmap.blocks_number(), N / 16 );
+    EXPECT_EQ( reference.cells_number(), binmap.cells_number() );
+    for(size_t v = 0; v < 128 * N; v += 61)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+    EXPECT_EQ( reference.count(), binmap.count() );
+
+    const uint32_t total = binmap.count();
+    binmap_t copy(binmap);
+    binmap.reset_range(0, 96 * N);
+    reference.reset_range(0, 96 * N);
+    binmap.compact();
+    EXPECT_LT( binmap.blocks_number(), N / 16 );
+    EXPECT_EQ( reference.count(), binmap.count() );
+    for(size_t v = 0; v < 128 * N; v += 61)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+
+    copy.swap(binmap);
+    copy.clear();
+    copy.shrink_to_fit();
+    EXPECT_EQ( 0U, copy.blocks_number() );
+    binmap.disable_counts();
+    EXPECT_EQ( total, binmap.count() );
+}
+
+
+TEST(binmap_test, reserve_in_place) {
+    const size_t N = 1 << 14;
+
+    binmap_t binmap;
+    binmap_t reference;
+
+    EXPECT_TRUE( binmap.enable_counts() );
+    EXPECT_TRUE( binmap.reserve(N) );
+
+    random_fill(binmap, reference, N / 4, 0, 64 * N, 0);
+    binmap.compact();
+    EXPECT_LT( binmap.blocks_number(), N / 16 );
+
+    /* The cells grow in place up to the reserved number */
+    const void * const cell = binmap.cell_buffer();
+    while( binmap.blocks_number() < N / 16 ) {
+        random_fill(binmap, reference, 1, 0, 64 * N, 0);
+        if( binmap.blocks_number() <= N / 16 ) {
+            EXPECT_EQ( cell, binmap.cell_buffer() );
+        }
+    }
+
+    /* Past it, they are moved once */
+    random_fill(binmap, reference, 4 * N, 0, 64 * N, 0);
+    EXPECT_GT( binmap.blocks_number(), N / 16 );
+    EXPECT_EQ( reference.cells_number(), binmap.cells_number() );
+    for(size_t v = 0; v < 128 * N; v += 61)
+        EXPECT_EQ( reference.get(bin_t(v)), binmap.get(bin_t(v)) );
+    EXPECT_EQ( reference.count(), binmap.count() );
+}
+
+
+TEST(binmap_test, sliding_window) {
+    const size_t W = 4096;
+    const size_t N = 256 * W;
+
+    binmap_window_t window;
+    binmap_t reference;
+    size_t max_cells = 0;
+
+    for(size_t base = 0; base < N; base += W / 4) {
+        random_fill(window, reference, W / 2, base, W, 6, 0.7);
+
+        window.set_range(base + W / 2, base + W / 2 + 100);
+        reference.set_range(base + W / 2, base + W / 2 + 100);
+
+        /* Moving the window */
+        window.drop_before(base + W / 4);
+        reference.reset_range(0, base + W / 4);
+        EXPECT_EQ( base + W / 4, window.base() );
+        EXPECT_LE( window.shift(), window.base() );
+
+        for(size_t v = 2 * base; v < 2 * (base + 2 * W); v += 3)
+            EXPECT_EQ( reference.get(bin_t(v)), window.get(bin_t(v)) );
+
+        const size_t a = base + equilikely(crandom, 0, W - 1);
+        const size_t c = a + equilikely(crandom, 0, W);
+        EXPECT_EQ( reference.is_filled_range(a, c), window.is_filled_range(a, c) );
+        EXPECT_EQ( reference.is_empty_range(a, c), window.is_empty_range(a, c) );
+
+        if( window.binmap().cells_number() > max_cells )
+            max_cells = window.binmap().cells_number();
+    }
+
+    /* The bins before the base are dropped */
+    EXPECT_FALSE( window.get(bin_t(0)) );
+    EXPECT_TRUE( window.is_empty_range(0, N - W) );
+    window.set(bin_t(0));
+    EXPECT_TRUE( window.is_empty_range(0, N - W) );
+
+    /* The size is bounded by the window, not by the stream */
+    EXPECT_LT( max_cells, W / 8 );
+    EXPECT_GT( window.shift(), N - 4 * W );
+    EXPECT_EQ( reference.count(), window.binmap().count() );
+
+    /* Small maps keep a root of two bitmaps */
+    binmap_t small;
+    small.set(bin_t(2 * 40));
+    small.set(bin_t(2 * 50));
+    EXPECT_EQ( 0U, small.drop_before(40) );
+    EXPECT_TRUE( small.get(bin_t(2 * 40)) );
+    EXPECT_TRUE( small.get(bin_t(2 * 50)) );
+    EXPECT_FALSE( small.get(bin_t(2 * 39)) );
+    EXPECT_TRUE( small.is_filled_range(40, 41) );
+    EXPECT_EQ( 2U, small.count() );
+
+    small.set(bin_t(2 * 1001));
+    small.set(bin_t(2 * 1010));
+    const bin_t::uint_t shift = small.drop_before(1000);
+    EXPECT_LE( shift, 1000U );
+    EXPECT_FALSE( small.get(bin_t(2 * (40 - shift))) );
+    EXPECT_TRUE( small.get(bin_t(2 * (1001 - shift))) );
+    EXPECT_TRUE( small.get(bin_t(2 * (1010 - shift))) );
+    EXPECT_TRUE( small.is_empty_range(0, 1001 - shift) );
+    EXPECT_EQ( 2U, small.count() );
+
+    /* Unaligned drops of a fresh window */
+    binmap_window_t fresh;
+    fresh.drop_before(40);
+    fresh.set(bin_t(2 * 40));
+    fresh.set(bin_t(2 * 45));
+    EXPECT_TRUE( fresh.get(bin_t(2 * 40)) );
+    EXPECT_FALSE( fresh.get(bin_t(2 * 41)) );
+
+    fresh.drop_before(1000);
+    EXPECT_FALSE( fresh.get(bin_t(2 * 45)) );
+    fresh.set_range(1000, 1100);
+    fresh.set(bin_t(2 * 999));
+    EXPECT_TRUE( fresh.is_filled_range(1000, 1100) );
+    EXPECT_FALSE( fresh.is_filled_range(999, 1100) );
+    EXPECT_TRUE( fresh.get(bin_t(2 * 1050)) );
+    EXPECT_EQ( 100U, fresh.binmap().count() );
+}
+
+
+TEST(binlog_test, recovery) {
+    const char * const checkpoint_path = "binlog-test.cp.tmp";
+    const char * const log_path = "binlog-test.log.tmp";
+    const size_t N = 65536;
+
+    remove(checkpoint_path);
+    remove(log_path);
+
+    binmap_t binmap;
+    binlog_t log(binmap);
+
+    binmap.set(bin_t(2 * 5));
+    EXPECT_TRUE( log.open(checkpoint_path, log_path) );
+    EXPECT_TRUE( binmap.find_filled().is_none() );
+
+    for(int round = 0; round < 3; ++round) {
+        random_fill(log, N, 0, N, 11);
+
+        /* The batches are written to the log, the last one on commit */
+        EXPECT_GT( log.log_size(), 2 * N );
+
+        if( round == 1 ) {
+            EXPECT_TRUE( log.checkpoint() );
+            EXPECT_LT( log.log_size(), 8U );
+        } else {
+            EXPECT_TRUE( log.commit() );
+        }
+    }
+
+    /* Recovering the checkpoint and the log, with a torn tail */
+    FILE * const file = fopen(log_path, "ab");
+    fputs("torn", file);
+    fclose(file);
+
+    {
+        binmap_t recovered;
+        binlog_t recovered_log(recovered);
+
+        EXPECT_TRUE( recovered_log.open(checkpoint_path, log_path) );
+        EXPECT_EQ( log.log_size(), recovered_log.log_size() );
+
+        for(size_t v = 0; v < 4 * N; ++v)
+            EXPECT_EQ( binmap.get(bin_t(v)), recovered.get(bin_t(v)) );
+    }
+
+    /* Broken checkpoint */
+    FILE * const checkpoint = fopen(checkpoint_path, "r+b");
+    fputc('X', checkpoint);
+    fclose(checkpoint);
+
+    binmap_t broken;
+    binlog_t broken_log(broken);
+    EXPECT_FALSE( broken_log.open(checkpoint_path, log_path) );
+
+    remove(checkpoint_path);
+    remove(log_path);
+}
+
+
+TEST(binlog_test, drop_before) {
+    const char * const checkpoint_path = "binlog-drop-test.cp.tmp";
+    const char * const log_path = "binlog-drop-test.log.tmp";
+    const size_t N = 16384;
+
+    remove(checkpoint_path);
+    remove(log_path);
+
+    binmap_t binmap;
+    binlog_t log(binmap);
+    EXPECT_TRUE( log.open(checkpoint_path, log_path) );
+
+    /* The changes after a drop are in the shifted offsets */
+    bin_t::uint_t shifted = 0;
+    for(int round = 0; round < 4; ++round) {
+        random_fill(log, N, 0, 4 * N, 7);
+        shifted += log.drop_before(2 * N);
+
+        if( round == 1 ) {
+            EXPECT_TRUE( log.checkpoint() );
+        }
+    }
+    random_fill(log, N, 0, 4 * N, 7);
+    EXPECT_GT( shifted, 0U );
+    EXPECT_TRUE( log.commit() );
+
+    {
+        binmap_t recovered;
+        binlog_t recovered_log(recovered);
+
+        EXPECT_TRUE( recovered_log.open(checkpoint_path, log_path) );
+        EXPECT_EQ( binmap.count(), recovered.count() );
+        for(size_t v = 0; v < 8 * N; ++v)
+            EXPECT_EQ( binmap.get(bin_t(v)), recovered.get(bin_t(v)) );
+    }
+
+    remove(checkpoint_path);
+    remove(log_path);
+}
+
+
+#ifndef _WIN32
+TEST(binlog_test, write_error) {
+    const char * const checkpoint_path = "binlog-error-test.cp.tmp";
+    const char * const log_path = "binlog-error-test.log.tmp";
+    const size_t N = 65536;
+
+    remove(checkpoint_path);
+    remove(log_path);
+
+    binmap_t binmap;
+    binlog_t log(binmap);
+    EXPECT_TRUE( log.open(checkpoint_path, log_path) );
+
+    log.set(bin_t(2 * 5));
+    EXPECT_TRUE( log.commit() );
+
+    /* The writes past the limit of the file size fail */
+    struct rlimit old_limit;
+    getrlimit(RLIMIT_FSIZE, &old_limit);
+    void (* const old_handler)(int) = signal(SIGXFSZ, SIG_IGN);
+
+    struct rlimit limit = old_limit;
+    limit.rlim_cur = log.log_size() + 4;
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    /* The batch is kept and written again */
+    log.set(bin_t(2 * 7));
+    EXPECT_FALSE( log.commit() );
+    EXPECT_FALSE( log.commit() );
+
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    EXPECT_TRUE( log.commit() );
+
+    {
+        /* The torn frame is cut */
+        binmap_t recovered;
+        binlog_t recovered_log(recovered);
+
+        EXPECT_TRUE( recovered_log.open(checkpoint_path, log_path) );
+        EXPECT_EQ( log.log_size(), recovered_log.log_size() );
+        EXPECT_TRUE( recovered.get(bin_t(2 * 7)) );
+    }
+
+    /* The changes not logged fail the commits until a checkpoint */
+    limit.rlim_cur = log.log_size() + 1000;
+    setrlimit(RLIMIT_FSIZE, &limit);
+
+    for(size_t i = 0; i < N; ++i)
+        log.set(bin_t(2 * equilikely(crandom, 0, N - 1)));
+    EXPECT_FALSE( log.commit() );
+
+    setrlimit(RLIMIT_FSIZE, &old_limit);
+    signal(SIGXFSZ, old_handler);
+
+    EXPECT_FALSE( log.commit() );
+    EXPECT_TRUE( log.checkpoint() );
+    EXPECT_TRUE( log.commit() );
+
+    log.reset(bin_t(2 * 5));
+    EXPECT_TRUE( log.commit() );
+
+    {
+        binmap_t recovered;
+        binlog_t recovered_log(recovered);
+
+        EXPECT_TRUE( recovered_log.open(checkpoint_path, log_path) );
+        EXPECT_FALSE( recovered.get(bin_t(2 * 5)) );
+        EXPECT_TRUE( recovered.get(bin_t(2 * 7)) );
+
+        for(size_t v = 0; v < 4 * N; ++v)
+            EXPECT_EQ( binmap.get(bin_t(v)), recovered.get(bin_t(v)) );
+    }
+
+    remove(checkpoint_path);
+    remove(log_path);
+}
+#endif
+
+
+template <class binmap_type>
+class binmap_policy_test : public testing::Test {
+};
+
+typedef testing::Types<
+    basic_binmap_t< binmap_traits<bin_t, bitmap64_t> >,
+    basic_binmap_t< binmap_traits<bin_t, bitmap128_t> >,
+    basic_binmap_t< binmap_traits<bin_t, bitmap256_t> >,
+    basic_binmap_t< binmap_traits<bin64_t, bitmap64_t> >,
+    basic_binmap_t< binmap_traits<bin64_t, bitmap128_t, uint64_t> >,
+    wide_binmap64_t
+> binmap_policy_types;
+
+TYPED_TEST_CASE(binmap_policy_test, binmap_policy_types);
+
+
+TYPED_TEST(binmap_policy_test, set_reset_get) {
+    typedef typename TypeParam::bin_t wide_bin_t;
+
+    const size_t N = 4 * 65536;
+
+    binmap_t binmap;
+    TypeParam wide_binmap;
+    wide_binmap.enable_counts();
+
+    /* Making random filling, including higher layers */
+    random_fill(binmap, wide_binmap, 2 * N, 0, N, 9);
+
+    /* Checking results are identical to the 32-bit bitmaps */
+    for(size_t v = 0; v < 2 * N; ++v)
+        EXPECT_EQ( binmap.get(bin_t(v)), wide_binmap.get(wide_bin_t(v)) );
+
+    /* Checking ranges */
+    for(size_t i = 0; i < 1024; ++i) {
+        const size_t a = equilikely(crandom, 0, N - 1);
+        const size_t c = a + equilikely(crandom, 0, 1024);
+
+        if( i % 2 ) {
+            binmap.set_range(a, c);
+            wide_binmap.set_range(a, c);
+        } else {
+            binmap.reset_range(a, c);
+            wide_binmap.reset_range(a, c);
+        }
+
+        EXPECT_EQ( binmap.is_filled_range(c, c + 300), wide_binmap.is_filled_range(c, c + 300) );
+    }
+
+    for(size_t v = 0; v < 2 * N; v += 3)
+        EXPECT_EQ( binmap.get(bin_t(v)), wide_binmap.get(wide_bin_t(v)) );
+
+    /* Checking counts */
+    EXPECT_EQ( binmap.count(), wide_binmap.count() );
+    for(size_t i = 0; i < 1024; ++i) {
+        const size_t offset = equilikely(crandom, 0, N - 1);
+        EXPECT_EQ( binmap.rank(offset), wide_binmap.rank(offset) );
+    }
+
+    /* Checking searches from a position */
+    for(size_t i = 0; i < 1024; ++i) {
+        const size_t offset = equilikely(crandom, 0, N - 1);
+
+        EXPECT_EQ( binmap.find_empty_after(offset).base_offset(), wide_binmap.find_empty_after(offset).base_offset() );
+        EXPECT_EQ( binmap.find_filled_after(offset).base_offset(), wide_binmap.find_filled_after(offset).base_offset() );
+    }
+
+    /* Checking serialization */
+    std::vector<unsigned char> stream(wide_binmap.cells_number() * sizeof(typename TypeParam::cell_t) + 64);
+    typename TypeParam::encoder_t encoder(wide_binmap);
+    stream.resize(encoder.encode(&stream[0], stream.size()));
+    EXPECT_TRUE( encoder.is_done() );
+
+    TypeParam decoded;
+    typename TypeParam::decoder_t decoder(decoded);
+    EXPECT_TRUE( decoder.decode(&stream[0], stream.size()) );
+    EXPECT_TRUE( decoder.is_done() );
+    EXPECT_EQ( wide_binmap.cells_number(), decoded.cells_number() );
+    for(size_t v = 0; v < 2 * N; v += 3)
+        EXPECT_EQ( wide_binmap.get(wide_bin_t(v)), decoded.get(wide_bin_t(v)) );
+
+    /* Checking runs */
+    typename TypeParam::run_iterator_t it(wide_binmap);
+    for(bool ok = it.first(); ok; ok = it.next()) {
+        const size_t end = it.offset() + it.length();
+        if( it.is_filled() )
+            EXPECT_TRUE( binmap.is_filled_range(it.offset(), end) );
+        else
+            EXPECT_TRUE( binmap.is_empty_range(it.offset(), end) );
+        if( end < N ) {
+            EXPECT_NE( it.is_filled(), binmap.get(bin_t(2 * end)) );
+        }
+    }
+
+    /* Checking find_empty */
+    for(size_t i = 0; i < 1024; ++i) {
+        const bin_t bin = binmap.find_empty();
+
+        EXPECT_EQ( bin.toUInt(), wide_binmap.find_empty().toUInt() );
+
+        binmap.set(bin);
+        wide_binmap.set(wide_bin_t(bin.toUInt()));
+    }
+
+    /* Checking bottom-up construction */
+    unsigned char * const bitmap = new unsigned char[N / 8];
+    memset(bitmap, 0, N / 8);
+    for(size_t i = 0; i < N - 5; ++i) {
+        if( binmap.get(bin_t(2 * i)) )
+            bitmap[i / 8] |= 1 << (i % 8);
+    }
+
+    TypeParam assigned;
+    assigned.assign_from_bitmap(bitmap, N - 5, 3);
+
+    for(size_t i = 0; i < N; ++i)
+        EXPECT_EQ( i < N - 5 && binmap.get(bin_t(2 * i)), assigned.get(wide_bin_t(2 * i)) );
+
+    /* Checking export */
+    unsigned char * const exported = new unsigned char[N / 8];
+    assigned.to_bitmap(wide_bin_t(N - 1), exported);
+    EXPECT_EQ( 0, memcmp(bitmap, exported, N / 8) );
+
+    delete [] exported;
+
+    /* Checking set operations */
+    TypeParam flipped;
+    flipped.set_range(0, N);
+    flipped.set_symmetric_difference(assigned);
+
+    for(size_t i = 0; i < N; ++i)
+        EXPECT_NE( assigned.get(wide_bin_t(2 * i)), flipped.get(wide_bin_t(2 * i)) );
+
+    flipped.set_union(assigned);
+    EXPECT_TRUE( flipped.is_filled_range(0, N) );
+
+    delete [] bitmap;
+}
+
+
 int main(int argc, char ** argv) {
     testing::InitGoogleTest(&argc, argv);
 
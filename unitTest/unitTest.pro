@@ -16,3 +16,4 @@ INCLUDEPATH += ../cRandom
 LIBS        += -L.. -lbinmap
 LIBS        += -L../cRandom -lcrandom
 LIBS        += -lgtest
+unix:LIBS   += -lpthread